@@ -0,0 +1,278 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "CodecThreadPool.h"
+#include <cassert>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#include <pthread.h>
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+CodecThreadPool::Job::Job():
+home(0),
+pending(0),
+cancelled(false)
+{
+}
+
+//==============================================================================
+CodecThreadPool::JobQueue::JobQueue():
+cells(new Cell[maxNumJobs]),
+enqueuePos(0),
+dequeuePos(0)
+{
+	for (std::size_t i = 0; i < maxNumJobs; ++i)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+void CodecThreadPool::JobQueue::push(Job *job)
+{
+	std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell &cell = cells[pos & (maxNumJobs - 1)];
+		std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+		auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+		if (diff == 0) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cell.job = job;
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return;
+			}
+		} else {
+			// can't be full, see maxNumJobs
+			assert(diff > 0);
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+CodecThreadPool::Job *CodecThreadPool::JobQueue::pop()
+{
+	std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell &cell = cells[pos & (maxNumJobs - 1)];
+		std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+		auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+		if (diff == 0) {
+			if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				Job *job = cell.job;
+				cell.sequence.store(pos + maxNumJobs, std::memory_order_release);
+				return job;
+			}
+		} else if (diff < 0) {
+			return nullptr;
+		} else {
+			pos = dequeuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+//==============================================================================
+CodecThreadPool::CodecThreadPool(std::size_t numThreads):
+numThreads(numThreads),
+queues(new JobQueue[numThreads]),
+exiting(false),
+numJobs(0),
+nextHome(0)
+{
+	assert(numThreads >= 1);
+
+	// unnamed POSIX semaphores don't exist on OS X; GCD's do the same job
+#if defined(_WIN32)
+	semaphore = CreateSemaphoreW(nullptr, 0, 0x7fffffff, nullptr);
+#elif defined(__APPLE__)
+	semaphore = dispatch_semaphore_create(0);
+#else
+	sem_t *sem = new sem_t;
+	sem_init(sem, 0, 0);
+	semaphore = sem;
+#endif
+
+	threads.reserve(numThreads);
+	for (std::size_t i = 0; i < numThreads; ++i) {
+		threads.emplace_back([this, i] { run(i); });
+
+		// they have the same deadline as the audio threads. this needs
+		// privileges on some systems; if we don't have them they stay
+		// normal threads.
+#if defined(_WIN32)
+		SetThreadPriority(threads.back().native_handle(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+		sched_param param;
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+		pthread_setschedparam(threads.back().native_handle(), SCHED_FIFO, &param);
+#endif
+	}
+}
+
+CodecThreadPool::~CodecThreadPool()
+{
+	assert(numJobs == 0);
+
+	exiting = true;
+	for (std::size_t i = 0; i < numThreads; ++i)
+		post();
+	for (auto &thread: threads)
+		thread.join();
+
+#if defined(_WIN32)
+	CloseHandle(static_cast<HANDLE>(semaphore));
+#elif defined(__APPLE__)
+	dispatch_release(static_cast<dispatch_semaphore_t>(semaphore));
+#else
+	sem_destroy(static_cast<sem_t *>(semaphore));
+	delete static_cast<sem_t *>(semaphore);
+#endif
+}
+
+std::shared_ptr<CodecThreadPool> CodecThreadPool::getShared()
+{
+	static std::mutex sharedLock;
+	static std::weak_ptr<CodecThreadPool> shared;
+
+	std::lock_guard<std::mutex> lock(sharedLock);
+	std::shared_ptr<CodecThreadPool> pool = shared.lock();
+	if (!pool) {
+		// leave a core for the host's own audio threads
+		std::size_t numCores = std::thread::hardware_concurrency();
+		std::size_t numThreads = numCores > 1 ? numCores - 1 : 1;
+		if (numThreads > ROUNDTRIPOPUS_MAX_CODEC_THREADS)
+			numThreads = ROUNDTRIPOPUS_MAX_CODEC_THREADS;
+		pool = std::make_shared<CodecThreadPool>(numThreads);
+		shared = pool;
+	}
+	return pool;
+}
+
+void CodecThreadPool::post()
+{
+#if defined(_WIN32)
+	ReleaseSemaphore(static_cast<HANDLE>(semaphore), 1, nullptr);
+#elif defined(__APPLE__)
+	dispatch_semaphore_signal(static_cast<dispatch_semaphore_t>(semaphore));
+#else
+	sem_post(static_cast<sem_t *>(semaphore));
+#endif
+}
+
+void CodecThreadPool::waitForPost()
+{
+#if defined(_WIN32)
+	WaitForSingleObject(static_cast<HANDLE>(semaphore), INFINITE);
+#elif defined(__APPLE__)
+	dispatch_semaphore_wait(static_cast<dispatch_semaphore_t>(semaphore),
+							DISPATCH_TIME_FOREVER);
+#else
+	while (sem_wait(static_cast<sem_t *>(semaphore)) != 0) {
+		// interrupted by a signal
+	}
+#endif
+}
+
+//==============================================================================
+bool CodecThreadPool::add(Job &job, std::function<void()> task)
+{
+	std::lock_guard<std::mutex> lock(jobsLock);
+	if (numJobs == maxNumJobs)
+		return false;
+	++numJobs;
+
+	job.task = std::move(task);
+	job.home = nextHome++ % numThreads;
+	job.pending = 0;
+	job.cancelled = false;
+	return true;
+}
+
+void CodecThreadPool::remove(Job &job)
+{
+	// a queued job is still served (without running the task); once
+	// nothing is pending, no thread holds on to it anymore
+	job.cancelled = true;
+	while (job.pending.load() != 0)
+		std::this_thread::yield();
+
+	std::lock_guard<std::mutex> lock(jobsLock);
+	assert(numJobs > 0);
+	--numJobs;
+	job.task = nullptr;
+}
+
+void CodecThreadPool::submit(Job &job)
+{
+	if (job.pending.fetch_add(1) == 0) {
+		queues[job.home].push(&job);
+		post();
+	}
+}
+
+//==============================================================================
+CodecThreadPool::Job *CodecThreadPool::take(std::size_t index)
+{
+	// our own queue first, then steal from the neighbours
+	for (std::size_t i = 0; i < numThreads; ++i) {
+		if (Job *job = queues[(index + i) % numThreads].pop())
+			return job;
+	}
+	return nullptr;
+}
+
+void CodecThreadPool::serve(Job &job)
+{
+	std::uint32_t served = job.pending.load();
+	for (;;) {
+		if (!job.cancelled.load())
+			job.task();
+
+		// submits that came in while the task ran are served right here
+		std::uint32_t left = job.pending.fetch_sub(served) - served;
+		if (left == 0)
+			break;
+		served = left;
+	}
+}
+
+void CodecThreadPool::run(std::size_t index)
+{
+	// every submit that queues a job posts once, and everyone who wakes
+	// up looks at every queue, so nothing is left behind while all of us
+	// sleep
+	for (;;) {
+		if (Job *job = take(index)) {
+			serve(*job);
+			continue;
+		}
+		if (exiting.load())
+			break;
+		waitForPost();
+	}
+}
@@ -0,0 +1,143 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef CODECTHREADPOOL_H_INCLUDED
+#define CODECTHREADPOOL_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Upper limit on the number of threads of the shared pool. */
+#ifndef ROUNDTRIPOPUS_MAX_CODEC_THREADS
+#define ROUNDTRIPOPUS_MAX_CODEC_THREADS 8
+#endif
+
+/**
+ * Real-time priority threads that run the worker passes of every plugin
+ * instance in the process.
+ *
+ * Each instance adds a Job and submits it whenever it has new input. Jobs
+ * are spread over the threads when they are added and submitted to the
+ * queue of their thread; a thread that runs out of jobs steals from the
+ * others before it goes to sleep, so a few busy instances don't leave the
+ * other cores idle.
+ *
+ * A job is never queued or running more than once at a time. If it's
+ * submitted while it runs, it runs again on the same thread right after,
+ * so the passes of one instance stay in order.
+ */
+class CodecThreadPool
+{
+public:
+	class Job
+	{
+		friend class CodecThreadPool;
+
+		std::function<void()> task;
+		std::size_t home;
+
+		// submits that haven't been served yet. whoever brings it up
+		// from zero queues the job.
+		std::atomic<std::uint32_t> pending;
+		std::atomic<bool> cancelled;
+
+	public:
+		Job();
+
+		Job(const Job &) = delete;
+		void operator = (const Job &) = delete;
+	};
+
+	/** Most jobs one pool takes. */
+	static const std::size_t maxNumJobs = 1024;
+
+	explicit CodecThreadPool(std::size_t numThreads);
+	~CodecThreadPool();
+
+	CodecThreadPool(const CodecThreadPool &) = delete;
+	void operator = (const CodecThreadPool &) = delete;
+
+	/** Returns the pool shared by the whole process, starting its threads
+	 *  if nobody is holding it. Not from the audio thread. */
+	static std::shared_ptr<CodecThreadPool> getShared();
+
+	std::size_t getNumThreads() const { return numThreads; }
+
+	/** Not from the audio thread. Returns false if the pool is full. */
+	bool add(Job &job, std::function<void()> task);
+
+	/** Not from the audio thread, and not while the job may be submitted.
+	 *  Waits for the task to return if it's running. */
+	void remove(Job &job);
+
+	/** Lock-free, never allocates. */
+	void submit(Job &job);
+
+private:
+	// bounded MPMC queue (Dmitry Vyukov's). since a job is queued at most
+	// once, maxNumJobs cells never run out.
+	class JobQueue
+	{
+		struct Cell
+		{
+			std::atomic<std::size_t> sequence;
+			Job *job;
+		};
+
+		std::unique_ptr<Cell[]> cells;
+		std::atomic<std::size_t> enqueuePos;
+		std::atomic<std::size_t> dequeuePos;
+
+	public:
+		JobQueue();
+		void push(Job *job);
+		Job *pop();
+	};
+
+	std::size_t numThreads;
+	std::unique_ptr<JobQueue[]> queues;
+	std::vector<std::thread> threads;
+	std::atomic<bool> exiting;
+	void *semaphore;
+
+	std::mutex jobsLock;
+	std::size_t numJobs;
+	std::size_t nextHome;
+
+	void post();
+	void waitForPost();
+
+	void run(std::size_t index);
+	Job *take(std::size_t index);
+	void serve(Job &job);
+};
+
+#endif  // CODECTHREADPOOL_H_INCLUDED
@@ -0,0 +1,57 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "CodecWorker.h"
+
+CodecWorker::CodecWorker():
+running(false)
+{
+}
+
+CodecWorker::~CodecWorker()
+{
+	stop();
+}
+
+void CodecWorker::start(std::function<void()> task)
+{
+	stop();
+	if (!pool)
+		pool = CodecThreadPool::getShared();
+	if (pool->add(job, task)) {
+		running = true;
+	} else {
+		inPlaceTask = std::move(task);
+	}
+}
+
+void CodecWorker::stop()
+{
+	if (running) {
+		pool->remove(job);
+		running = false;
+	}
+	inPlaceTask = nullptr;
+}
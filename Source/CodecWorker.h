@@ -0,0 +1,76 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef CODECWORKER_H_INCLUDED
+#define CODECWORKER_H_INCLUDED
+
+#include "CodecThreadPool.h"
+#include <functional>
+#include <memory>
+
+/**
+ * Runs a task on the shared CodecThreadPool whenever it's woken up.
+ *
+ * wake() is safe to call from the audio thread: it never allocates or
+ * takes a lock. Every wake() leads to a run of the task, but a run may find
+ * that an earlier one already did the work, so the task should simply do
+ * all the work there is. Runs never overlap.
+ *
+ * The pool is held from the first start() until the worker is destroyed.
+ * Should it be full, wake() runs the task in place instead.
+ */
+class CodecWorker
+{
+	std::shared_ptr<CodecThreadPool> pool;
+	CodecThreadPool::Job job;
+	bool running;
+
+	std::function<void()> inPlaceTask;
+
+public:
+	CodecWorker();
+	~CodecWorker();
+
+	CodecWorker(const CodecWorker &) = delete;
+	void operator = (const CodecWorker &) = delete;
+
+	/** Not from the audio thread. Stops the current task first, if any. */
+	void start(std::function<void()> task);
+
+	/** Not from the audio thread. Waits for the task to return. */
+	void stop();
+
+	bool isRunning() const { return running || inPlaceTask; }
+
+	void wake()
+	{
+		if (running)
+			pool->submit(job);
+		else if (inPlaceTask)
+			inPlaceTask();
+	}
+};
+
+#endif  // CODECWORKER_H_INCLUDED
@@ -0,0 +1,109 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "ComplexityGovernor.h"
+#include <algorithm>
+
+// encoding is only part of what a callback does, and the time it takes
+// varies from frame to frame
+const double ComplexityGovernor::highLoad = 0.5;
+const double ComplexityGovernor::lowLoad = 0.2;
+const int ComplexityGovernor::raiseAfter;
+const int ComplexityGovernor::settleEncodes;
+
+ComplexityGovernor::ComplexityGovernor():
+deadline(0.0),
+minComplexity(0),
+maxComplexity(10),
+averageLoad(-1.0),
+numSettling(0),
+numUnderLow(0),
+complexity(10),
+numDeadlineMisses(0)
+{ }
+
+void ComplexityGovernor::setDeadline(StageStats::Ticks ticks)
+{
+	deadline = static_cast<double>(ticks);
+	averageLoad = -1.0;
+	numUnderLow = 0;
+}
+
+void ComplexityGovernor::reset(int newComplexity, int newMin, int newMax)
+{
+	minComplexity = std::min(newMin, newMax);
+	maxComplexity = std::max(newMin, newMax);
+	complexity.store(std::max(minComplexity, std::min(maxComplexity, newComplexity)),
+					 std::memory_order_relaxed);
+	averageLoad = -1.0;
+	numSettling = 0;
+	numUnderLow = 0;
+}
+
+bool ComplexityGovernor::addEncodeTime(StageStats::Ticks elapsed)
+{
+	if (deadline <= 0.0)
+		return false;
+
+	double load = static_cast<double>(elapsed) / deadline;
+	if (load > 1.0) {
+		numDeadlineMisses.store(numDeadlineMisses.load(std::memory_order_relaxed) + 1,
+								std::memory_order_relaxed);
+	}
+
+	if (numSettling > 0) {
+		--numSettling;
+		return false;
+	}
+
+	// a miss doesn't wait for the average to catch up
+	if (load > 1.0)
+		return step(-1);
+
+	averageLoad = averageLoad < 0.0 ? load : averageLoad + (load - averageLoad) * 0.125;
+	if (averageLoad > highLoad)
+		return step(-1);
+
+	if (averageLoad < lowLoad) {
+		if (++numUnderLow >= raiseAfter)
+			return step(1);
+	} else {
+		numUnderLow = 0;
+	}
+	return false;
+}
+
+bool ComplexityGovernor::step(int delta)
+{
+	int current = complexity.load(std::memory_order_relaxed);
+	int next = std::max(minComplexity, std::min(maxComplexity, current + delta));
+	averageLoad = -1.0;
+	numUnderLow = 0;
+	if (next == current)
+		return false;
+	complexity.store(next, std::memory_order_relaxed);
+	numSettling = settleEncodes;
+	return true;
+}
@@ -0,0 +1,91 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef COMPLEXITYGOVERNOR_H_INCLUDED
+#define COMPLEXITYGOVERNOR_H_INCLUDED
+
+#include "StageStats.h"
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Picks the encoder complexity from how long encoding takes.
+ *
+ * Every encode is measured against the time a host callback has (a block's
+ * worth of audio); one that takes longer than that on its own is a deadline
+ * miss. While the average stays over highLoad of the deadline, or on a miss,
+ * the complexity goes down a step. Only after it has stayed under lowLoad
+ * for raiseAfter encodes in a row does it go up one. Nothing changes in
+ * between, and after each step the figures of the old setting are thrown
+ * away, so it settles instead of going back and forth.
+ *
+ * The thread running the encoder owns it; getComplexity and
+ * getNumDeadlineMisses can be called from any thread.
+ */
+class ComplexityGovernor
+{
+public:
+	ComplexityGovernor();
+
+	/** The time a callback has, in StageStats ticks. Not while encoding. */
+	void setDeadline(StageStats::Ticks ticks);
+
+	/** Starts over at complexity, which is kept within the bounds from
+	 *  now on. Equal bounds hold it still; misses are counted anyway. */
+	void reset(int complexity, int minComplexity, int maxComplexity);
+
+	/** Takes the time an encode took. Returns true if getComplexity
+	 *  changed. */
+	bool addEncodeTime(StageStats::Ticks elapsed);
+
+	int getComplexity() const
+	{ return complexity.load(std::memory_order_relaxed); }
+
+	/** Encodes that took longer than a whole callback, ever. */
+	std::uint64_t getNumDeadlineMisses() const
+	{ return numDeadlineMisses.load(std::memory_order_relaxed); }
+
+private:
+	static const double highLoad;
+	static const double lowLoad;
+	static const int raiseAfter = 64;
+
+	// encodes to wait after a step before judging the new setting
+	static const int settleEncodes = 4;
+
+	double deadline;
+	int minComplexity, maxComplexity;
+
+	double averageLoad; // of the deadline; negative if there's no figure yet
+	int numSettling;
+	int numUnderLow;
+
+	std::atomic<int> complexity;
+	std::atomic<std::uint64_t> numDeadlineMisses;
+
+	bool step(int delta);
+};
+
+#endif  // COMPLEXITYGOVERNOR_H_INCLUDED
@@ -0,0 +1,276 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "EncodeCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+	// entry files: this header, the packet, then the decoded frame as
+	// native floats. the cache isn't meant to move between machines.
+	struct EntryHeader
+	{
+		char magic[4];
+		std::uint32_t packetLength;
+		std::uint32_t numSamples;
+	};
+	const char entryMagic[4] = {'R', 'T', 'O', '1'};
+
+	// eviction goes down to this fraction of the limit, so that it doesn't
+	// have to run again after the next few stores
+	const std::int64_t evictTargetPercent = 75;
+
+	// temporary files this old were left behind by a writer that died
+	const RelativeTime staleTempAge = RelativeTime::hours(1);
+
+	inline std::uint64_t rotl64(std::uint64_t x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	inline std::uint64_t fmix64(std::uint64_t k)
+	{
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+}
+
+EncodeCache::Key EncodeCache::hash(const void *data, std::size_t length, Key seed)
+{
+	const std::uint64_t c1 = 0x87c37b91114253d5ULL;
+	const std::uint64_t c2 = 0x4cf5ad432745937fULL;
+
+	const unsigned char *bytes = static_cast<const unsigned char *>(data);
+	std::uint64_t h1 = seed.high;
+	std::uint64_t h2 = seed.low;
+
+	std::size_t numBlocks = length / 16;
+	for (std::size_t i = 0; i < numBlocks; ++i) {
+		std::uint64_t k1, k2;
+		std::memcpy(&k1, bytes + i * 16, 8);
+		std::memcpy(&k2, bytes + i * 16 + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const unsigned char *tail = bytes + numBlocks * 16;
+	std::size_t tailLength = length & 15;
+	std::uint64_t k1 = 0, k2 = 0;
+	for (std::size_t i = 0; i < tailLength; ++i) {
+		if (i < 8)
+			k1 |= static_cast<std::uint64_t>(tail[i]) << (i * 8);
+		else
+			k2 |= static_cast<std::uint64_t>(tail[i]) << ((i - 8) * 8);
+	}
+	if (tailLength > 8) {
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+	if (tailLength > 0) {
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= length;
+	h2 ^= length;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	Key result;
+	result.high = h1;
+	result.low = h2;
+	return result;
+}
+
+std::shared_ptr<EncodeCache> EncodeCache::open(const File &directory,
+											   std::int64_t maxBytes)
+{
+	static std::mutex registryLock;
+	static std::vector<std::weak_ptr<EncodeCache>> registry;
+
+	std::lock_guard<std::mutex> lock(registryLock);
+	registry.erase(std::remove_if(registry.begin(), registry.end(),
+								  [](const std::weak_ptr<EncodeCache> &cache) {
+									  return cache.expired();
+								  }), registry.end());
+	for (auto &weak: registry) {
+		std::shared_ptr<EncodeCache> cache = weak.lock();
+		if (cache && cache->directory == directory) {
+			cache->maxBytes = maxBytes;
+			return cache;
+		}
+	}
+
+	if (!directory.createDirectory().wasOk())
+		return nullptr;
+
+	std::shared_ptr<EncodeCache> cache(new EncodeCache(directory, maxBytes));
+	cache->evict();
+	registry.push_back(cache);
+	return cache;
+}
+
+EncodeCache::EncodeCache(const File &directory, std::int64_t maxBytes):
+directory(directory),
+maxBytes(maxBytes),
+numBytes(0),
+numHits(0),
+numMisses(0)
+{ }
+
+File EncodeCache::getEntryFile(const Key &key) const
+{
+	// spread over 256 subdirectories, so none of them gets huge
+	char name[33];
+	std::snprintf(name, sizeof(name), "%016llx%016llx",
+				  (unsigned long long)key.high, (unsigned long long)key.low);
+	return directory.getChildFile(String(name, (size_t)2)).getChildFile(name);
+}
+
+int EncodeCache::lookup(const Key &key, unsigned char *packet, int maxPacketLength,
+						float *pcm, std::size_t numSamples)
+{
+	File file = getEntryFile(key);
+	FileInputStream stream(file);
+
+	EntryHeader header;
+	int pcmBytes = static_cast<int>(numSamples * sizeof(float));
+	bool found = !stream.failedToOpen() &&
+	stream.read(&header, sizeof(header)) == sizeof(header) &&
+	std::memcmp(header.magic, entryMagic, sizeof(entryMagic)) == 0 &&
+	header.numSamples == numSamples &&
+	header.packetLength <= static_cast<std::uint32_t>(maxPacketLength) &&
+	stream.read(packet, static_cast<int>(header.packetLength)) ==
+	static_cast<int>(header.packetLength) &&
+	stream.read(pcm, pcmBytes) == pcmBytes;
+	if (!found) {
+		numMisses.fetch_add(1, std::memory_order_relaxed);
+		return -1;
+	}
+
+	// it's the oldest entries that go first
+	file.setLastModificationTime(Time::getCurrentTime());
+	numHits.fetch_add(1, std::memory_order_relaxed);
+	return static_cast<int>(header.packetLength);
+}
+
+void EncodeCache::store(const Key &key, const unsigned char *packet, int packetLength,
+						const float *pcm, std::size_t numSamples)
+{
+	File file = getEntryFile(key);
+	if (!file.getParentDirectory().createDirectory().wasOk())
+		return;
+
+	// written next to where it goes and renamed, so that whoever looks it
+	// up sees all of it or nothing. the name only has to be unique among
+	// the writers of this directory.
+	static std::atomic<std::uint32_t> tempCounter {0};
+	File temp = file.getSiblingFile
+	(file.getFileName() + "." +
+	 String::toHexString((int64)(pointer_sized_int)Thread::getCurrentThreadId()) + "." +
+	 String::toHexString(Time::getHighResolutionTicks()) + "." +
+	 String::toHexString((int)tempCounter.fetch_add(1)) + ".tmp");
+
+	EntryHeader header;
+	std::memcpy(header.magic, entryMagic, sizeof(entryMagic));
+	header.packetLength = static_cast<std::uint32_t>(packetLength);
+	header.numSamples = static_cast<std::uint32_t>(numSamples);
+
+	bool written;
+	{
+		std::unique_ptr<FileOutputStream> stream(temp.createOutputStream());
+		written = stream &&
+		stream->write(&header, sizeof(header)) &&
+		stream->write(packet, static_cast<std::size_t>(packetLength)) &&
+		stream->write(pcm, numSamples * sizeof(float));
+	}
+	if (!written || !temp.moveFileTo(file)) {
+		temp.deleteFile();
+		return;
+	}
+
+	std::int64_t size = static_cast<std::int64_t>
+	(sizeof(header) + packetLength + numSamples * sizeof(float));
+	if (numBytes.fetch_add(size) + size > maxBytes.load())
+		evict();
+}
+
+void EncodeCache::evict()
+{
+	std::unique_lock<std::mutex> lock(evictLock, std::try_to_lock);
+	if (!lock.owns_lock())
+		return;
+
+	struct Entry
+	{
+		Time lastUsed;
+		std::int64_t size;
+		File file;
+	};
+	std::vector<Entry> entries;
+	std::int64_t total = 0;
+	Time staleTime = Time::getCurrentTime() - staleTempAge;
+
+	DirectoryIterator it(directory, true, "*", File::findFiles);
+	Entry entry;
+	while (it.next(nullptr, nullptr, &entry.size, &entry.lastUsed, nullptr, nullptr)) {
+		entry.file = it.getFile();
+		if (entry.file.hasFileExtension(".tmp")) {
+			if (entry.lastUsed < staleTime)
+				entry.file.deleteFile();
+			continue;
+		}
+		total += entry.size;
+		entries.push_back(entry);
+	}
+
+	std::int64_t limit = maxBytes.load();
+	if (total > limit) {
+		std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+			return a.lastUsed < b.lastUsed;
+		});
+		std::int64_t target = limit / 100 * evictTargetPercent;
+		for (const Entry &oldest: entries) {
+			if (total <= target)
+				break;
+			// a file some other process deleted first is gone just the same
+			oldest.file.deleteFile();
+			total -= oldest.size;
+		}
+	}
+	numBytes = total;
+}
@@ -0,0 +1,108 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef ENCODECACHE_H_INCLUDED
+#define ENCODECACHE_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/**
+ * Remembers what the codec made of each frame on disk, so that rendering
+ * the same material again with the same settings can skip Opus.
+ *
+ * Entries are content-addressed: the key of a frame hashes the frame
+ * together with the key of the one before it (and so everything the
+ * encoder has been fed since it was reset) and the settings. Each entry
+ * is a file of its own, holding the packet and the decoded frame, which
+ * only ever appears under its name complete (it's written elsewhere and
+ * renamed), so any number of instances and processes can share a
+ * directory. The least recently used entries are deleted when it grows
+ * over its size limit.
+ *
+ * Lookups and stores do file I/O; they are for offline rendering only.
+ */
+class EncodeCache
+{
+public:
+	struct Key
+	{
+		std::uint64_t high, low;
+		Key(): high(0), low(0) { }
+	};
+
+	/** 128-bit MurmurHash3 of the bytes, starting from seed instead of a
+	 *  32-bit one so that hashes can be chained. */
+	static Key hash(const void *data, std::size_t length, Key seed = Key());
+
+	/** Returns the cache kept in directory, creating the directory if
+	 *  needed. Everyone in the process asking for the same directory gets
+	 *  the same one; the latest maxBytes applies. Scans the directory, so
+	 *  not for the audio thread. nullptr if the directory can't be made. */
+	static std::shared_ptr<EncodeCache> open(const File &directory,
+											 std::int64_t maxBytes);
+
+	EncodeCache(const EncodeCache &) = delete;
+	void operator = (const EncodeCache &) = delete;
+
+	/** Fills packet and pcm (exactly numSamples floats) and returns the
+	 *  length of the packet, or -1 if there's no such entry. */
+	int lookup(const Key &key, unsigned char *packet, int maxPacketLength,
+			   float *pcm, std::size_t numSamples);
+
+	void store(const Key &key, const unsigned char *packet, int packetLength,
+			   const float *pcm, std::size_t numSamples);
+
+	const File &getDirectory() const { return directory; }
+	std::uint64_t getNumHits() const { return numHits.load(std::memory_order_relaxed); }
+	std::uint64_t getNumMisses() const { return numMisses.load(std::memory_order_relaxed); }
+
+private:
+	EncodeCache(const File &directory, std::int64_t maxBytes);
+
+	File directory;
+	std::atomic<std::int64_t> maxBytes;
+
+	// what this process thinks the directory holds. others may be adding
+	// to it too; evict counts again.
+	std::atomic<std::int64_t> numBytes;
+	std::mutex evictLock;
+
+	std::atomic<std::uint64_t> numHits;
+	std::atomic<std::uint64_t> numMisses;
+
+	File getEntryFile(const Key &key) const;
+
+	/** Counts the directory again and deletes the oldest entries until
+	 *  it's well under the limit. Returns right away if someone else in
+	 *  the process is at it. */
+	void evict();
+};
+
+#endif  // ENCODECACHE_H_INCLUDED
@@ -0,0 +1,281 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#ifndef FIFO_H_INCLUDED
+#define FIFO_H_INCLUDED
+
+#include "MirroredBuffer.h"
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+template <class T>
+static inline void copyWithStride(T *dest, const T *src, std::size_t count,
+								  std::size_t destStride, std::size_t srcStride)
+{
+	if (destStride == 1 && srcStride == 1) {
+		std::memcpy(dest, src, count * sizeof(T));
+		return;
+	}
+	while (count--) {
+		*dest = *src;
+		dest += destStride;
+		src += srcStride;
+	}
+}
+
+enum class FifoLayout
+{
+	/** One buffer per channel. */
+	Planar,
+
+	/** A single buffer of interleaved frames, as libopus and libsamplerate
+	 *  (with more than one channel) want them. */
+	Interleaved
+};
+
+/**
+ * A ring buffer of up to N channels, counted in samples per channel.
+ *
+ * The storage is a MirroredBuffer, so whatever is readable or writable is
+ * always one contiguous run: the *SingleCustom callbacks see everything at
+ * once and dequeue/enqueue never split. The capacity is rounded up to a
+ * power of two (and to whole pages of the mirror).
+ *
+ * The buffer sets passed to the *SingleCustom callbacks point to the first
+ * sample of each channel; consecutive samples of a channel are
+ * getChannelStride() elements apart. With the interleaved layout, element 0
+ * of the set is the start of a run of interleaved frames.
+ */
+template <class T, int N, FifoLayout Layout = FifoLayout::Planar>
+class Fifo
+{
+	static const bool interleaved = Layout == FifoLayout::Interleaved;
+
+	MirroredBuffer buffers[interleaved ? 1 : N];
+	std::size_t numChannels;
+	std::size_t capacity;
+	std::size_t readCursor;
+	std::size_t size;
+
+	T *getBufferData(std::size_t i)
+	{
+		return static_cast<T *>(buffers[i].getData());
+	}
+
+	std::size_t wrapAround(std::size_t i)
+	{
+		return i & (capacity - 1);
+	}
+
+	std::size_t getReadCursor()
+	{
+		assert(readCursor < capacity);
+		return readCursor;
+	}
+
+	std::size_t getWriteCursor()
+	{
+		return wrapAround(readCursor + size);
+	}
+
+	template <class P>
+	void getBuffersAt(std::array<P, N> &bufs, std::size_t cursor)
+	{
+		for (std::size_t i = 0; i < N; ++i) {
+			if (interleaved) {
+				bufs[i] = i < numChannels ?
+				getBufferData(0) + cursor * numChannels + i : nullptr;
+			} else {
+				bufs[i] = getBufferData(i) + cursor;
+			}
+		}
+	}
+
+	void mirrorWritten(std::size_t cursor, std::size_t samples)
+	{
+		std::size_t frame = getChannelStride() * sizeof(T);
+		for (auto &buffer: buffers)
+			buffer.mirror(cursor * frame, samples * frame);
+	}
+
+	template <class P>
+	bool isSameInterleaving(const std::array<P, N> &bufs, std::size_t stride)
+	{
+		if (!interleaved || stride != numChannels || !bufs[0])
+			return false;
+		for (std::size_t i = 1; i < numChannels; ++i) {
+			if (bufs[i] != bufs[0] + i)
+				return false;
+		}
+		return true;
+	}
+
+public:
+	using BufferSet = std::array<T *, N>;
+	using ConstBufferSet = std::array<const T *, N>;
+
+	void setCapacity(std::size_t samples, std::size_t channels = N)
+	{
+		assert(channels >= 1 && channels <= N);
+		numChannels = channels;
+
+		// the mirror works in whole pages, so keep doubling until a lap
+		// of the ring is a multiple of them
+		std::size_t frame = getChannelStride() * sizeof(T);
+		std::size_t granularity = MirroredBuffer::getGranularity();
+		capacity = 1;
+		while (capacity < samples || (capacity * frame) % granularity)
+			capacity <<= 1;
+
+		for (auto &buffer: buffers)
+			buffer.allocate(capacity * frame);
+		readCursor = 0;
+		size = 0;
+	}
+	Fifo(std::size_t capacity, std::size_t channels = N)
+	{
+		setCapacity(capacity, channels);
+	}
+	void clear()
+	{
+		readCursor = 0;
+		size = 0;
+	}
+	std::size_t getNumChannels()
+	{
+		return numChannels;
+	}
+	std::size_t getCapacity()
+	{
+		return capacity;
+	}
+	/** Distance between two consecutive samples of a channel. */
+	std::size_t getChannelStride()
+	{
+		return interleaved ? numChannels : 1;
+	}
+	bool canDequeueAtLeast(std::size_t samples)
+	{
+		return size >= samples;
+	}
+	bool canEnqueueAtLeast(std::size_t samples)
+	{
+		return samples + size <= capacity;
+	}
+	std::size_t getNumberOfSamplesEnqueueable()
+	{
+		return capacity - size;
+	}
+	std::size_t getNumberOfSamplesDequeueable()
+	{
+		return size;
+	}
+	/** Same as getNumberOfSamplesEnqueueable since runs never split. */
+	std::size_t getNumberOfSamplesEnqueueableBySingleRun()
+	{
+		return capacity - size;
+	}
+	/** Same as getNumberOfSamplesDequeueable since runs never split. */
+	std::size_t getNumberOfSamplesDequeueableBySingleRun()
+	{
+		return size;
+	}
+	template <class F>
+	std::size_t dequeueSingleCustom(F fn)
+	{
+		ConstBufferSet bufs;
+		getBuffersAt(bufs, getReadCursor());
+
+		auto runLength = getNumberOfSamplesDequeueableBySingleRun();
+		auto adv = fn(bufs, runLength);
+		assert(adv <= runLength);
+
+		readCursor = wrapAround(readCursor + adv);
+		size -= adv;
+
+		return adv;
+	}
+	template <class F>
+	std::size_t enqueueSingleCustom(F fn)
+	{
+		BufferSet bufs;
+		auto writeCursor = getWriteCursor();
+		getBuffersAt(bufs, writeCursor);
+
+		auto runLength = getNumberOfSamplesEnqueueableBySingleRun();
+		auto adv = fn(bufs, runLength);
+		assert(adv <= runLength);
+
+		mirrorWritten(writeCursor, adv);
+		size += adv;
+
+		return adv;
+	}
+	std::size_t dequeue(BufferSet buffers, std::size_t size, std::size_t stride = 1)
+	{
+		std::size_t qstride = getChannelStride();
+		return dequeueSingleCustom([&](ConstBufferSet qb, std::size_t samples) {
+			if (samples > size) {
+				samples = size;
+			}
+			if (isSameInterleaving(buffers, stride)) {
+				// same interleaved layout on both sides
+				copyWithStride(buffers[0], qb[0], samples * qstride, 1, 1);
+				return samples;
+			}
+			for (std::size_t i = 0; i < N; ++i) {
+				if (buffers[i] && qb[i]) {
+					copyWithStride(buffers[i], qb[i], samples,
+								   stride, qstride);
+				}
+			}
+			return samples;
+		});
+	}
+	std::size_t enqueue(ConstBufferSet buffers, std::size_t size, std::size_t stride = 1)
+	{
+		std::size_t qstride = getChannelStride();
+		return enqueueSingleCustom([&](BufferSet qb, std::size_t samples) {
+			if (samples > size) {
+				samples = size;
+			}
+			if (isSameInterleaving(buffers, stride)) {
+				copyWithStride(qb[0], buffers[0], samples * qstride, 1, 1);
+				return samples;
+			}
+			for (std::size_t i = 0; i < N; ++i) {
+				if (buffers[i] && qb[i]) {
+					copyWithStride(qb[i], buffers[i], samples,
+								   qstride, stride);
+				}
+			}
+			return samples;
+		});
+	}
+
+};
+
+#endif  // FIFO_H_INCLUDED
@@ -0,0 +1,181 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#ifndef LOCKFREE_H_INCLUDED
+#define LOCKFREE_H_INCLUDED
+
+#include "MirroredBuffer.h"
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+
+/**
+ * Passes the latest value of T from one writer thread to one reader thread.
+ * Neither side ever blocks or fails; the reader simply sees the most recently
+ * published value (intermediate ones may be skipped).
+ */
+template <class T>
+class TripleBuffer
+{
+	enum : unsigned
+	{
+		IndexMask = 3,
+		DirtyBit = 4
+	};
+
+	T slots[3];
+
+	// index of the slot in the middle, plus DirtyBit if it contains a value
+	// the reader hasn't picked up yet
+	std::atomic<unsigned> middle;
+
+	unsigned writeIndex; // owned by the writer
+	unsigned readIndex;  // owned by the reader
+
+public:
+	TripleBuffer(const T &initial = T()):
+	middle(1), writeIndex(0), readIndex(2)
+	{
+		for (auto &slot: slots)
+			slot = initial;
+	}
+
+	/** Writer side. Fill this in, then call publish(). */
+	T &getWriteBuffer()
+	{
+		return slots[writeIndex];
+	}
+
+	/** Writer side. Makes the write buffer visible to the reader. */
+	void publish()
+	{
+		unsigned prev = middle.exchange(writeIndex | DirtyBit,
+										std::memory_order_acq_rel);
+		writeIndex = prev & IndexMask;
+	}
+
+	/** Reader side. Returns true if a new value was picked up. */
+	bool update()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & DirtyBit))
+			return false;
+		unsigned prev = middle.exchange(readIndex, std::memory_order_acq_rel);
+		readIndex = prev & IndexMask;
+		return true;
+	}
+
+	/** Reader side. Valid until the next call to update(). */
+	const T &getReadBuffer() const
+	{
+		return slots[readIndex];
+	}
+};
+
+/**
+ * A ring of interleaved frames between one producer thread and one
+ * consumer thread. Neither side ever blocks.
+ *
+ * Like Fifo it sits on a MirroredBuffer, so both sides always see what
+ * they can read or write as one contiguous run. Unlike Fifo the two
+ * positions are atomic, so the sides can be on different threads.
+ */
+template <class T>
+class SpscRing
+{
+	MirroredBuffer buffer;
+	std::size_t capacity;
+	std::size_t frameSize;
+
+	// frames ever written and read. they only ever grow, so the difference
+	// is the fill level even after they wrap around.
+	std::atomic<std::size_t> writeCount;
+	std::atomic<std::size_t> readCount;
+
+	T *getFrame(std::size_t count) const
+	{
+		return static_cast<T *>(buffer.getData()) +
+		(count & (capacity - 1)) * frameSize;
+	}
+
+public:
+	SpscRing():
+	capacity(0), frameSize(1), writeCount(0), readCount(0)
+	{ }
+
+	/** Not thread safe. Rounds up to a power of two (and whole pages). */
+	void setCapacity(std::size_t frames, std::size_t numChannels)
+	{
+		frameSize = numChannels;
+		std::size_t frame = frameSize * sizeof(T);
+		std::size_t granularity = MirroredBuffer::getGranularity();
+		capacity = 1;
+		while (capacity < frames || (capacity * frame) % granularity)
+			capacity <<= 1;
+		buffer.allocate(capacity * frame);
+		clear();
+	}
+
+	/** Not thread safe. */
+	void clear()
+	{
+		writeCount.store(0, std::memory_order_relaxed);
+		readCount.store(0, std::memory_order_relaxed);
+	}
+
+	std::size_t getCapacity() const { return capacity; }
+
+	/** Producer side. fn(T *frames, std::size_t maxFrames) fills in
+	 *  interleaved frames and returns how many. */
+	template <class F>
+	std::size_t write(F fn)
+	{
+		std::size_t written = writeCount.load(std::memory_order_relaxed);
+		std::size_t available = capacity -
+		(written - readCount.load(std::memory_order_acquire));
+		std::size_t count = fn(getFrame(written), available);
+		assert(count <= available);
+
+		std::size_t frame = frameSize * sizeof(T);
+		buffer.mirror((written & (capacity - 1)) * frame, count * frame);
+		writeCount.store(written + count, std::memory_order_release);
+		return count;
+	}
+
+	/** Consumer side. fn(const T *frames, std::size_t numFrames) returns
+	 *  how many of them it took. */
+	template <class F>
+	std::size_t read(F fn)
+	{
+		std::size_t taken = readCount.load(std::memory_order_relaxed);
+		std::size_t available =
+		writeCount.load(std::memory_order_acquire) - taken;
+		std::size_t count = fn(const_cast<const T *>(getFrame(taken)), available);
+		assert(count <= available);
+
+		readCount.store(taken + count, std::memory_order_release);
+		return count;
+	}
+};
+
+#endif  // LOCKFREE_H_INCLUDED
@@ -0,0 +1,227 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#include "MirroredBuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+MirroredBuffer::MirroredBuffer():
+data(nullptr),
+size(0),
+mapped(false)
+#ifdef _WIN32
+, mappingHandle(nullptr)
+#endif
+{ }
+
+MirroredBuffer::~MirroredBuffer()
+{
+	release();
+}
+
+std::size_t MirroredBuffer::getGranularity()
+{
+#ifdef _WIN32
+	// views have to start at multiples of this, not just the page size
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+#else
+	return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+void MirroredBuffer::allocate(std::size_t bytes)
+{
+	assert(bytes > 0 && bytes % getGranularity() == 0);
+	release();
+
+	if (map(bytes)) {
+		// fresh mappings are zeroed
+		mapped = true;
+	} else {
+		data = new char[bytes * 2]();
+		mapped = false;
+	}
+	size = bytes;
+}
+
+void MirroredBuffer::release()
+{
+	if (!data)
+		return;
+	if (mapped) {
+		unmap();
+	} else {
+		delete[] static_cast<char *>(data);
+	}
+	data = nullptr;
+	size = 0;
+	mapped = false;
+}
+
+void MirroredBuffer::copyToMirror(std::size_t offset, std::size_t length)
+{
+	char *bytes = static_cast<char *>(data);
+	std::size_t end = offset + length;
+	assert(end <= size * 2);
+
+	if (offset < size) {
+		std::size_t firstEnd = std::min(end, size);
+		std::memcpy(bytes + offset + size, bytes + offset, firstEnd - offset);
+	}
+	if (end > size) {
+		std::size_t secondStart = std::max(offset, size);
+		std::memcpy(bytes + secondStart - size, bytes + secondStart,
+					end - secondStart);
+	}
+}
+
+#ifdef _WIN32
+
+bool MirroredBuffer::map(std::size_t bytes)
+{
+	std::uint64_t size64 = bytes;
+	HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr,
+										PAGE_READWRITE,
+										static_cast<DWORD>(size64 >> 32),
+										static_cast<DWORD>(size64),
+										nullptr);
+	if (!mapping)
+		return false;
+
+	// there's no way to reserve an address range and map into it, so find
+	// a free range, let go of it and hope nobody takes it in the meantime
+	for (int attempt = 0; attempt < 16; ++attempt) {
+		char *address = static_cast<char *>
+		(VirtualAlloc(nullptr, bytes * 2, MEM_RESERVE, PAGE_NOACCESS));
+		if (!address)
+			break;
+		VirtualFree(address, 0, MEM_RELEASE);
+
+		void *first = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS,
+									  0, 0, bytes, address);
+		void *second = first ?
+		MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS,
+						0, 0, bytes, address + bytes) : nullptr;
+		if (first && second) {
+			data = first;
+			mappingHandle = mapping;
+			return true;
+		}
+		if (first)
+			UnmapViewOfFile(first);
+	}
+
+	CloseHandle(mapping);
+	return false;
+}
+
+void MirroredBuffer::unmap()
+{
+	UnmapViewOfFile(static_cast<char *>(data) + size);
+	UnmapViewOfFile(data);
+	CloseHandle(static_cast<HANDLE>(mappingHandle));
+	mappingHandle = nullptr;
+}
+
+#else
+
+static int createMemoryObject()
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+	int fd = static_cast<int>(syscall(SYS_memfd_create, "RoundTripOpus", 1 /* MFD_CLOEXEC */));
+	if (fd >= 0)
+		return fd;
+#endif
+	// the name only has to exist until it's unlinked again
+	static std::atomic<unsigned> counter(0);
+	char name[64];
+	std::snprintf(name, sizeof(name), "/RoundTripOpus-%d-%u",
+				  static_cast<int>(getpid()), counter.fetch_add(1));
+	int fd2 = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd2 >= 0)
+		shm_unlink(name);
+	return fd2;
+}
+
+bool MirroredBuffer::map(std::size_t bytes)
+{
+	int fd = createMemoryObject();
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+		close(fd);
+		return false;
+	}
+
+	// reserve both halves first so the second mapping can't collide with
+	// anything else
+	void *reserved = mmap(nullptr, bytes * 2, PROT_NONE,
+						  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserved == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	char *address = static_cast<char *>(reserved);
+	void *first = mmap(address, bytes, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_FIXED, fd, 0);
+	void *second = mmap(address + bytes, bytes, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_FIXED, fd, 0);
+	close(fd); // the mappings keep the object alive
+
+	if (first != address || second != address + bytes) {
+		munmap(reserved, bytes * 2);
+		return false;
+	}
+	data = address;
+	return true;
+}
+
+void MirroredBuffer::unmap()
+{
+	munmap(data, size * 2);
+}
+
+#endif
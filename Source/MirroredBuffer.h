@@ -0,0 +1,87 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#ifndef MIRROREDBUFFER_H_INCLUDED
+#define MIRROREDBUFFER_H_INCLUDED
+
+#include <cstddef>
+
+/**
+ * A block of memory that appears twice in a row in the address space:
+ * byte i and byte i + getSize() are the same byte. A ring buffer built on
+ * it can hand out any run of up to getSize() bytes as one contiguous range,
+ * no matter where it wraps.
+ *
+ * The mirror is made by mapping the same memory object twice (memfd on
+ * Linux, POSIX shared memory elsewhere, a page-file backed section on
+ * Windows). If the OS refuses, a plain buffer of twice the size is used
+ * instead and mirror() has to be called after writing.
+ */
+class MirroredBuffer
+{
+	void *data;
+	std::size_t size;
+	bool mapped;
+
+#ifdef _WIN32
+	void *mappingHandle;
+#endif
+
+	bool map(std::size_t bytes);
+	void unmap();
+
+public:
+	MirroredBuffer();
+	~MirroredBuffer();
+
+	MirroredBuffer(const MirroredBuffer &) = delete;
+	void operator = (const MirroredBuffer &) = delete;
+
+	/** Sizes passed to allocate must be a multiple of this. */
+	static std::size_t getGranularity();
+
+	/** Replaces the current contents with bytes of zeroes (mirrored). */
+	void allocate(std::size_t bytes);
+	void release();
+
+	void *getData() const { return data; }
+	std::size_t getSize() const { return size; }
+
+	/** False if the fallback is in use. */
+	bool isMapped() const { return mapped; }
+
+	/** Copies the bytes in [offset, offset + length) (offset + length at
+	 *  most 2 * getSize()) to the other copy. Does nothing when the mirror
+	 *  is done by the MMU. */
+	void mirror(std::size_t offset, std::size_t length)
+	{
+		if (!mapped && length)
+			copyToMirror(offset, length);
+	}
+
+private:
+	void copyToMirror(std::size_t offset, std::size_t length);
+};
+
+#endif  // MIRROREDBUFFER_H_INCLUDED
@@ -0,0 +1,361 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "OggOpusCapture.h"
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+	// the queue holds this much; at 510kbps per stream that's a good few
+	// seconds, while the writer looks at it every writeInterval
+	const std::size_t queueCapacity = 1 << 20;
+	const auto writeInterval = std::chrono::milliseconds(100);
+
+	// pages are closed at about this size
+	const std::size_t pageBodySize = 8192;
+
+	// CRC-32 as Ogg uses it: polynomial 0x04c11db7, not reflected, no
+	// initial or final xor
+	struct CrcTable
+	{
+		std::uint32_t entries[256];
+		CrcTable()
+		{
+			for (std::uint32_t i = 0; i < 256; ++i) {
+				std::uint32_t crc = i << 24;
+				for (int bit = 0; bit < 8; ++bit)
+					crc = (crc << 1) ^ (crc & 0x80000000u ? 0x04c11db7u : 0);
+				entries[i] = crc;
+			}
+		}
+	};
+	const CrcTable crcTable;
+
+	std::uint32_t updateCrc(std::uint32_t crc, const unsigned char *data,
+							std::size_t length)
+	{
+		for (std::size_t i = 0; i < length; ++i)
+			crc = (crc << 8) ^ crcTable.entries[(crc >> 24) ^ data[i]];
+		return crc;
+	}
+
+	void putLE(std::vector<unsigned char> &out, std::uint64_t value, int numBytes)
+	{
+		for (int i = 0; i < numBytes; ++i)
+			out.push_back(static_cast<unsigned char>(value >> (i * 8)));
+	}
+
+	void putString(std::vector<unsigned char> &out, const char *text)
+	{
+		out.insert(out.end(), text, text + std::strlen(text));
+	}
+}
+
+OggOpusCapture::OggOpusCapture():
+session(0),
+numDroppedPackets(0),
+producerSession(0),
+producerNumChannels(0),
+producerGranule(0),
+exiting(false),
+inStream(false),
+serial(0),
+pageSequence(0),
+lastGranule(0),
+pageGranule(0),
+pageContinues(false)
+{ }
+
+OggOpusCapture::~OggOpusCapture()
+{
+	stop();
+}
+
+bool OggOpusCapture::start(const File &file)
+{
+	stop();
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	file.deleteFile();
+	stream.reset(file.createOutputStream(64 * 1024));
+	if (!stream)
+		return false;
+
+	// the queue only ever grows; stale records in it are skipped by
+	// their session
+	if (!queue.getCapacity())
+		queue.setCapacity(queueCapacity, 1);
+
+	inStream = false;
+	exiting = false;
+
+	// the release makes the queue visible to the encoding thread
+	session.fetch_add(1, std::memory_order_release);
+	writer = std::thread([this] { writerThread(); });
+	return true;
+}
+
+void OggOpusCapture::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!writer.joinable())
+			return;
+		exiting = true;
+
+		// no new packets from here on; what's already queued still goes in
+		session.fetch_add(1, std::memory_order_relaxed);
+	}
+	cond.notify_all();
+	writer.join();
+
+	std::lock_guard<std::mutex> guard(lock);
+	drain();
+	closeFile();
+}
+
+void OggOpusCapture::addPacket(OpusCodec &codec, int codecRate, int frameSize,
+							   const unsigned char *data, int length)
+{
+	std::uint32_t current = session.load(std::memory_order_acquire);
+	if (!(current & 1) || length <= 0 || length > 0xffff)
+		return;
+
+	if (current != producerSession ||
+		codec.getNumChannels() != producerNumChannels) {
+		// a new file, or a layout the current stream can't carry
+		opus_int32 lookahead = 0;
+		codec.encoderCtl(OPUS_GET_LOOKAHEAD(&lookahead));
+
+		StreamFormat format;
+		format.inputRate = static_cast<std::uint32_t>(codecRate);
+		format.preSkip = static_cast<std::uint16_t>
+		(static_cast<std::int64_t>(lookahead) * 48000 / codecRate);
+		format.numChannels = static_cast<std::uint8_t>(codec.getNumChannels());
+		format.numStreams = static_cast<std::uint8_t>(codec.getNumStreams());
+		format.numCoupledStreams = static_cast<std::uint8_t>(codec.getNumCoupledStreams());
+		std::memcpy(format.mapping, codec.getMapping(), sizeof(format.mapping));
+
+		if (!push(current, StreamStart, 0, &format, sizeof(format))) {
+			// try again with the next packet
+			numDroppedPackets.store(numDroppedPackets.load(std::memory_order_relaxed) + 1,
+									std::memory_order_relaxed);
+			return;
+		}
+		producerSession = current;
+		producerNumChannels = codec.getNumChannels();
+		producerGranule = format.preSkip;
+	}
+
+	// Ogg Opus counts time at 48kHz whatever the codec runs at. a dropped
+	// packet still takes up its time.
+	producerGranule += static_cast<std::uint64_t>(frameSize) * 48000 / codecRate;
+	if (!push(current, Packet, producerGranule, data, static_cast<std::size_t>(length))) {
+		numDroppedPackets.store(numDroppedPackets.load(std::memory_order_relaxed) + 1,
+								std::memory_order_relaxed);
+	}
+}
+
+bool OggOpusCapture::push(std::uint32_t recordSession, RecordType type,
+						  std::uint64_t granule, const void *payload,
+						  std::size_t length)
+{
+	RecordHeader header;
+	header.session = recordSession;
+	header.type = type;
+	header.length = static_cast<std::uint16_t>(length);
+	header.granule = granule;
+
+	std::size_t size = sizeof(header) + length;
+	return queue.write([&](unsigned char *bytes, std::size_t room) -> std::size_t {
+		if (room < size)
+			return 0;
+		std::memcpy(bytes, &header, sizeof(header));
+		std::memcpy(bytes + sizeof(header), payload, length);
+		return size;
+	}) != 0;
+}
+
+void OggOpusCapture::writerThread()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (!exiting) {
+		cond.wait_for(guard, writeInterval);
+		drain();
+	}
+}
+
+void OggOpusCapture::drain()
+{
+	std::uint32_t current = session.load(std::memory_order_relaxed);
+	// stop() has already moved on to the next (even) session
+	std::uint32_t writing = (current & 1) ? current : current - 1;
+
+	queue.read([&](const unsigned char *bytes, std::size_t available) {
+		// every record went in whole, so only whole records are here
+		std::size_t pos = 0;
+		while (pos + sizeof(RecordHeader) <= available) {
+			RecordHeader header;
+			std::memcpy(&header, bytes + pos, sizeof(header));
+			const unsigned char *payload = bytes + pos + sizeof(header);
+			pos += sizeof(header) + header.length;
+
+			if (header.session != writing || !stream)
+				continue;
+			if (header.type == StreamStart) {
+				StreamFormat format;
+				std::memcpy(&format, payload, sizeof(format));
+				endStream();
+				beginStream(format);
+			} else if (inStream) {
+				addToPage(payload, header.length, header.granule);
+			}
+		}
+		return pos;
+	});
+}
+
+void OggOpusCapture::beginStream(const StreamFormat &format)
+{
+	inStream = true;
+	serial = static_cast<std::uint32_t>(Random::getSystemRandom().nextInt());
+	pageSequence = 0;
+	lastGranule = 0;
+	pageSegments.clear();
+	pageBody.clear();
+	pageContinues = false;
+
+	// RFC 7845 identification header. family 1 (Vorbis order) above
+	// two channels, matching how the codec was created.
+	std::vector<unsigned char> head;
+	putString(head, "OpusHead");
+	head.push_back(1);
+	head.push_back(format.numChannels);
+	putLE(head, format.preSkip, 2);
+	putLE(head, format.inputRate, 4);
+	putLE(head, 0, 2); // output gain
+	if (format.numChannels > 2) {
+		head.push_back(1);
+		head.push_back(format.numStreams);
+		head.push_back(format.numCoupledStreams);
+		head.insert(head.end(), format.mapping, format.mapping + format.numChannels);
+	} else {
+		head.push_back(0);
+	}
+	writeHeaderPacket(head);
+
+	std::vector<unsigned char> tags;
+	putString(tags, "OpusTags");
+	const char *vendor = opus_get_version_string();
+	putLE(tags, std::strlen(vendor), 4);
+	putString(tags, vendor);
+	const char *comment = "ENCODER=RoundTripOpus";
+	putLE(tags, 1, 4);
+	putLE(tags, std::strlen(comment), 4);
+	putString(tags, comment);
+	writeHeaderPacket(tags);
+}
+
+void OggOpusCapture::endStream()
+{
+	if (!inStream)
+		return;
+	writePage(true);
+	inStream = false;
+}
+
+void OggOpusCapture::writeHeaderPacket(const std::vector<unsigned char> &packet)
+{
+	// each header gets pages of its own
+	addToPage(packet.data(), packet.size(), 0);
+	writePage(false);
+}
+
+void OggOpusCapture::addToPage(const unsigned char *data, std::size_t length,
+							   std::uint64_t granule)
+{
+	// a packet takes length / 255 + 1 lacing values; close the page first
+	// if it wouldn't fit
+	std::size_t numSegments = length / 255 + 1;
+	if (!pageSegments.empty() &&
+		(pageSegments.size() + numSegments > 255 ||
+		 pageBody.size() + length > pageBodySize)) {
+		writePage(false);
+	}
+
+	for (std::size_t left = length; ; left -= 255) {
+		if (left < 255) {
+			pageSegments.push_back(static_cast<unsigned char>(left));
+			break;
+		}
+		pageSegments.push_back(255);
+	}
+	pageBody.insert(pageBody.end(), data, data + length);
+	pageGranule = granule;
+	lastGranule = granule;
+}
+
+void OggOpusCapture::writePage(bool endOfStream)
+{
+	if (pageSegments.empty() && !endOfStream)
+		return;
+
+	std::vector<unsigned char> page;
+	page.reserve(27 + pageSegments.size() + pageBody.size());
+	putString(page, "OggS");
+	page.push_back(0); // version
+	page.push_back(static_cast<unsigned char>
+				   ((pageContinues ? 1 : 0) | (pageSequence == 0 ? 2 : 0) |
+					(endOfStream ? 4 : 0)));
+	putLE(page, pageSegments.empty() ? lastGranule : pageGranule, 8);
+	putLE(page, serial, 4);
+	putLE(page, pageSequence, 4);
+	putLE(page, 0, 4); // CRC, filled in below
+	page.push_back(static_cast<unsigned char>(pageSegments.size()));
+	page.insert(page.end(), pageSegments.begin(), pageSegments.end());
+	page.insert(page.end(), pageBody.begin(), pageBody.end());
+
+	std::uint32_t crc = updateCrc(0, page.data(), page.size());
+	for (int i = 0; i < 4; ++i)
+		page[22 + i] = static_cast<unsigned char>(crc >> (i * 8));
+
+	stream->write(page.data(), page.size());
+
+	++pageSequence;
+	pageSegments.clear();
+	pageBody.clear();
+	pageContinues = false;
+}
+
+void OggOpusCapture::closeFile()
+{
+	if (!stream)
+		return;
+	endStream();
+	stream->flush();
+	stream.reset();
+}
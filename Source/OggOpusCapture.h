@@ -0,0 +1,149 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef OGGOPUSCAPTURE_H_INCLUDED
+#define OGGOPUSCAPTURE_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "LockFree.h"
+#include "OpusCodecPool.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Saves the packets an encoder produces to an Ogg Opus file, exactly as
+ * they came out.
+ *
+ * The encoding thread only copies each packet into a lock-free queue;
+ * a background thread muxes them into Ogg pages and writes those out in
+ * large batches. Packets that don't fit in the queue are dropped (and
+ * counted) rather than waited for. If the channel layout changes, the
+ * current logical stream ends and a new one is chained after it.
+ */
+class OggOpusCapture
+{
+public:
+	OggOpusCapture();
+	~OggOpusCapture();
+
+	/** Starts writing to a new file, finishing the previous one if any.
+	 *  Not for the encoding thread. */
+	bool start(const File &file);
+
+	/** Writes out whatever is queued and closes the file. Not for the
+	 *  encoding thread. */
+	void stop();
+
+	bool isCapturing() const
+	{ return (session.load(std::memory_order_relaxed) & 1) != 0; }
+
+	/** Encoding thread, one at a time. Does nothing unless capturing;
+	 *  never blocks or allocates. frameSize is in samples at codecRate,
+	 *  the rate the encoder runs at. */
+	void addPacket(OpusCodec &codec, int codecRate, int frameSize,
+				   const unsigned char *data, int length);
+
+	std::uint64_t getNumDroppedPackets() const
+	{ return numDroppedPackets.load(std::memory_order_relaxed); }
+
+private:
+	enum RecordType : std::uint16_t
+	{
+		/** Begins a logical stream; the payload is a StreamFormat. */
+		StreamStart,
+		Packet
+	};
+
+	struct RecordHeader
+	{
+		std::uint32_t session;
+		std::uint16_t type;
+		std::uint16_t length; // of the payload
+		std::uint64_t granule; // at the end of the packet
+	};
+
+	struct StreamFormat
+	{
+		std::uint32_t inputRate;
+		std::uint16_t preSkip;
+		std::uint8_t numChannels;
+		std::uint8_t numStreams;
+		std::uint8_t numCoupledStreams;
+		std::uint8_t mapping[8];
+	};
+
+	// odd while capturing. bumped by every start and stop, so records
+	// left over from an earlier file can be told apart.
+	std::atomic<std::uint32_t> session;
+
+	SpscRing<unsigned char> queue;
+	std::atomic<std::uint64_t> numDroppedPackets;
+
+	// the encoding thread's
+	std::uint32_t producerSession;
+	int producerNumChannels;
+	std::uint64_t producerGranule;
+
+	// the rest is only touched with lock held
+	std::mutex lock;
+	std::condition_variable cond;
+	std::thread writer;
+	bool exiting;
+	std::unique_ptr<FileOutputStream> stream;
+
+	// the logical stream being written
+	bool inStream;
+	std::uint32_t serial;
+	std::uint32_t pageSequence;
+	std::uint64_t lastGranule;
+	std::vector<unsigned char> pageSegments;
+	std::vector<unsigned char> pageBody;
+	std::uint64_t pageGranule;
+	bool pageContinues;
+
+	bool push(std::uint32_t session, RecordType type, std::uint64_t granule,
+			  const void *payload, std::size_t length);
+
+	void writerThread();
+
+	/** Consumes everything queued. Called with lock held. */
+	void drain();
+
+	void beginStream(const StreamFormat &format);
+	void endStream();
+	void addToPage(const unsigned char *data, std::size_t length,
+				   std::uint64_t granule);
+	void writePage(bool endOfStream);
+	void writeHeaderPacket(const std::vector<unsigned char> &packet);
+
+	void closeFile();
+};
+
+#endif  // OGGOPUSCAPTURE_H_INCLUDED
@@ -0,0 +1,208 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "OggOpusReplay.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	std::uint32_t readLE32(const unsigned char *p)
+	{
+		return static_cast<std::uint32_t>(p[0]) |
+		static_cast<std::uint32_t>(p[1]) << 8 |
+		static_cast<std::uint32_t>(p[2]) << 16 |
+		static_cast<std::uint32_t>(p[3]) << 24;
+	}
+}
+
+OggOpusReplay::OggOpusReplay():
+length(0),
+preSkip(0),
+numChannels(0),
+numStreams(0),
+numCoupledStreams(0)
+{
+	std::memset(mapping, 0, sizeof(mapping));
+}
+
+OggOpusReplay::~OggOpusReplay()
+{ }
+
+bool OggOpusReplay::open(const File &path)
+{
+	packets.clear();
+	joinedPackets.clear();
+	length = 0;
+
+	file.reset(new MemoryMappedFile(path, MemoryMappedFile::readOnly));
+	const unsigned char *data = static_cast<const unsigned char *>(file->getData());
+	std::size_t size = file->getSize();
+	if (!data)
+		return false;
+
+	// walk the pages of the first logical stream, cutting packets out of
+	// them by their lacing values. a truncated or damaged file is used up
+	// to the first page that doesn't look right.
+	std::uint32_t serial = 0;
+	bool haveSerial = false;
+	int numHeaders = 0;
+	std::vector<unsigned char> partial; // a packet continuing on the next page
+	bool inPartial = false;
+
+	for (std::size_t pos = 0; pos + 27 <= size;) {
+		const unsigned char *page = data + pos;
+		if (std::memcmp(page, "OggS", 4) || page[4] != 0)
+			break;
+		int flags = page[5];
+		std::uint32_t pageSerial = readLE32(page + 14);
+		std::size_t numSegments = page[26];
+		if (pos + 27 + numSegments > size)
+			break;
+		const unsigned char *lacing = page + 27;
+		std::size_t bodySize = 0;
+		for (std::size_t i = 0; i < numSegments; ++i)
+			bodySize += lacing[i];
+		if (pos + 27 + numSegments + bodySize > size)
+			break;
+		const unsigned char *body = lacing + numSegments;
+		pos += 27 + numSegments + bodySize;
+
+		if (!haveSerial) {
+			if (!(flags & 2))
+				continue;
+			serial = pageSerial;
+			haveSerial = true;
+		} else if (pageSerial != serial) {
+			// another stream multiplexed or chained in
+			continue;
+		}
+		if (!(flags & 1) && inPartial) {
+			// the rest of the packet went missing
+			partial.clear();
+			inPartial = false;
+		}
+
+		std::size_t packetStart = 0, offset = 0;
+		for (std::size_t i = 0; i < numSegments; ++i) {
+			offset += lacing[i];
+			if (lacing[i] == 255)
+				continue;
+
+			// a packet ends here
+			const unsigned char *packet = body + packetStart;
+			std::size_t packetLength = offset - packetStart;
+			if (inPartial) {
+				partial.insert(partial.end(), packet, packet + packetLength);
+				joinedPackets.push_back(std::move(partial));
+				partial = std::vector<unsigned char>();
+				inPartial = false;
+				packet = joinedPackets.back().data();
+				packetLength = joinedPackets.back().size();
+			}
+			packetStart = offset;
+
+			if (numHeaders == 0) {
+				if (!parseHead(packet, packetLength))
+					return false;
+				++numHeaders;
+				continue;
+			}
+			if (numHeaders == 1) {
+				// OpusTags; nothing in there is needed
+				++numHeaders;
+				continue;
+			}
+
+			int duration = opus_packet_get_nb_samples
+			(packet, static_cast<opus_int32>(packetLength), 48000);
+			Packet entry;
+			entry.data = packet;
+			entry.length = static_cast<int>(packetLength);
+			entry.start = length;
+			packets.push_back(entry);
+			if (duration > 0)
+				length += duration;
+		}
+		if (packetStart < bodySize) {
+			partial.insert(partial.end(), body + packetStart, body + bodySize);
+			inPartial = true;
+		}
+
+		if (flags & 4)
+			break;
+	}
+
+	return numHeaders == 2;
+}
+
+bool OggOpusReplay::parseHead(const unsigned char *data, std::size_t size)
+{
+	if (size < 19 || std::memcmp(data, "OpusHead", 8) || (data[8] & 0xf0))
+		return false;
+	numChannels = data[9];
+	preSkip = data[10] | data[11] << 8;
+	int family = data[18];
+	if (numChannels < 1)
+		return false;
+	if (family == 0) {
+		if (numChannels > 2)
+			return false;
+		numStreams = 1;
+		numCoupledStreams = numChannels - 1;
+		for (int i = 0; i < numChannels; ++i)
+			mapping[i] = static_cast<unsigned char>(i);
+		return true;
+	}
+
+	// the codec only goes as far as 7.1
+	if (numChannels > 8 || size < static_cast<std::size_t>(21 + numChannels))
+		return false;
+	numStreams = data[19];
+	numCoupledStreams = data[20];
+	std::memcpy(mapping, data + 21, numChannels);
+	return true;
+}
+
+std::size_t OggOpusReplay::findPacket(std::int64_t time) const
+{
+	if (time >= length)
+		return packets.size();
+	auto it = std::upper_bound(packets.begin(), packets.end(), time,
+							   [](std::int64_t t, const Packet &packet) {
+		return t < packet.start;
+	});
+	return it == packets.begin() ? 0 : static_cast<std::size_t>(it - packets.begin() - 1);
+}
+
+bool OggOpusReplay::isCompatibleWith(const OpusCodec &codec) const
+{
+	if (numChannels <= 2 && codec.getNumChannels() <= 2)
+		return true;
+	return numChannels == codec.getNumChannels() &&
+	numStreams == codec.getNumStreams() &&
+	numCoupledStreams == codec.getNumCoupledStreams() &&
+	std::equal(mapping, mapping + numChannels, codec.getMapping());
+}
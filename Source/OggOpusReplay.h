@@ -0,0 +1,102 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef OGGOPUSREPLAY_H_INCLUDED
+#define OGGOPUSREPLAY_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "OpusCodecPool.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * A packet index over an Ogg Opus file, such as one OggOpusCapture wrote.
+ *
+ * The file is memory-mapped and scanned once when opened; after that the
+ * packets are handed out straight from the mapping, and finding the one
+ * at a given time is a binary search. Only the first logical stream is
+ * used. Nothing here changes after open, so any number of threads can
+ * read at once.
+ */
+class OggOpusReplay
+{
+public:
+	OggOpusReplay();
+	~OggOpusReplay();
+
+	/** Maps and indexes the file. Not for the audio thread. */
+	bool open(const File &file);
+
+	std::size_t getNumPackets() const { return packets.size(); }
+
+	/** Where packet i starts, at 48kHz, counting the pre-skip. */
+	std::int64_t getPacketStart(std::size_t i) const
+	{ return packets[i].start; }
+	const unsigned char *getPacketData(std::size_t i) const
+	{ return packets[i].data; }
+	int getPacketLength(std::size_t i) const
+	{ return packets[i].length; }
+
+	/** The end of the last packet, in the same units. */
+	std::int64_t getLength() const { return length; }
+
+	/** The packet that covers time (48kHz, counting the pre-skip), or
+	 *  getNumPackets() if the stream has ended by then. */
+	std::size_t findPacket(std::int64_t time) const;
+
+	int getPreSkip() const { return preSkip; }
+	int getNumChannels() const { return numChannels; }
+
+	/** Whether the decoder of codec can take these packets. Mono and
+	 *  stereo always can; above that the stream layouts must match. */
+	bool isCompatibleWith(const OpusCodec &codec) const;
+
+private:
+	struct Packet
+	{
+		const unsigned char *data;
+		int length;
+		std::int64_t start;
+	};
+
+	std::unique_ptr<MemoryMappedFile> file;
+	std::vector<Packet> packets;
+
+	// packets that span pages aren't contiguous in the file; these are
+	// joined copies of them
+	std::vector<std::vector<unsigned char>> joinedPackets;
+
+	std::int64_t length;
+	int preSkip;
+	int numChannels;
+	int numStreams;
+	int numCoupledStreams;
+	unsigned char mapping[8];
+
+	bool parseHead(const unsigned char *data, std::size_t size);
+};
+
+#endif  // OGGOPUSREPLAY_H_INCLUDED
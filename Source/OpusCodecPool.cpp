@@ -0,0 +1,402 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#include "OpusCodecPool.h"
+#include <algorithm>
+#include <cassert>
+
+OpusCodec::OpusCodec():
+encoder(nullptr),
+decoder(nullptr),
+msEncoder(nullptr),
+msDecoder(nullptr),
+numChannels(0),
+numStreams(0),
+numCoupledStreams(0),
+bitRate(notSet),
+complexity(notSet),
+maxBandwidth(notSet),
+dtx(notSet)
+{ }
+
+OpusCodec::~OpusCodec()
+{
+	destroy();
+}
+
+bool OpusCodec::create(int samplingRate, int numChannels, int application)
+{
+	destroy();
+	
+	int err;
+	if (numChannels <= 2) {
+		encoder = opus_encoder_create(samplingRate, numChannels,
+									  application, &err);
+		decoder = opus_decoder_create(samplingRate, numChannels, &err);
+		numStreams = 1;
+		numCoupledStreams = numChannels - 1;
+		for (int i = 0; i < numChannels; ++i)
+			mapping[i] = static_cast<unsigned char>(i);
+	} else {
+		// let libopus pick the stream layout for the standard surround
+		// mapping, then set up the decoder to match
+		unsigned char surroundMapping[255];
+		msEncoder = opus_multistream_surround_encoder_create
+		(samplingRate, numChannels, 1, &numStreams, &numCoupledStreams,
+		 surroundMapping, application, &err);
+		if (msEncoder) {
+			msDecoder = opus_multistream_decoder_create
+			(samplingRate, numChannels, numStreams, numCoupledStreams,
+			 surroundMapping, &err);
+			std::copy(surroundMapping, surroundMapping + std::min(numChannels, 8),
+					  mapping);
+		}
+	}
+	
+	if (!isValid()) {
+		destroy();
+		return false;
+	}
+	this->numChannels = numChannels;
+	return true;
+}
+
+void OpusCodec::destroy()
+{
+	if (encoder)
+		opus_encoder_destroy(encoder);
+	encoder = nullptr;
+	if (decoder)
+		opus_decoder_destroy(decoder);
+	decoder = nullptr;
+	if (msEncoder)
+		opus_multistream_encoder_destroy(msEncoder);
+	msEncoder = nullptr;
+	if (msDecoder)
+		opus_multistream_decoder_destroy(msDecoder);
+	msDecoder = nullptr;
+	numChannels = 0;
+	bitRate = notSet;
+	complexity = notSet;
+	maxBandwidth = notSet;
+	dtx = notSet;
+}
+
+void OpusCodec::setBitRate(int value)
+{
+	if (value != bitRate && encoderCtl(OPUS_SET_BITRATE(value)) == OPUS_OK)
+		bitRate = value;
+}
+
+void OpusCodec::setComplexity(int value)
+{
+	if (value != complexity && encoderCtl(OPUS_SET_COMPLEXITY(value)) == OPUS_OK)
+		complexity = value;
+}
+
+void OpusCodec::setMaxBandwidth(int value)
+{
+	if (value != maxBandwidth &&
+		encoderCtl(OPUS_SET_MAX_BANDWIDTH(value)) == OPUS_OK) {
+		maxBandwidth = value;
+	}
+}
+
+void OpusCodec::setDtx(bool enable)
+{
+	int value = enable ? 1 : 0;
+	if (value != dtx && encoderCtl(OPUS_SET_DTX(value)) == OPUS_OK)
+		dtx = value;
+}
+
+int OpusCodec::encode(const float *pcm, int frameSize,
+					  unsigned char *data, int maxDataBytes)
+{
+	return msEncoder ?
+	opus_multistream_encode_float(msEncoder, pcm, frameSize,
+								  data, maxDataBytes) :
+	opus_encode_float(encoder, pcm, frameSize, data, maxDataBytes);
+}
+
+int OpusCodec::decode(const unsigned char *data, int len,
+					  float *pcm, int maxFrameSize)
+{
+	return msDecoder ?
+	opus_multistream_decode_float(msDecoder, data, len,
+								  pcm, maxFrameSize, 0) :
+	opus_decode_float(decoder, data, len, pcm, maxFrameSize, 0);
+}
+
+OpusCodecPool::OpusCodecPool(std::size_t capacity):
+slots(new Slot[capacity]),
+capacity(capacity),
+useCounter(0),
+exiting(false)
+{
+	for (auto &request: asyncRequests)
+		request = 0;
+	for (std::size_t i = 0; i < capacity; ++i) {
+		slots[i].state = Empty;
+		slots[i].key = 0;
+		slots[i].lastUsed = 0;
+	}
+	builder = std::thread([this] { builderThread(); });
+}
+
+OpusCodecPool::~OpusCodecPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(queueLock);
+		exiting = true;
+	}
+	queueCond.notify_all();
+	builder.join();
+
+	for (std::size_t i = 0; i < capacity; ++i) {
+		// nothing should be in use at this point
+		assert((slots[i].state & StateMask) != InUse);
+	}
+}
+
+std::uint64_t OpusCodecPool::packKey(const Key &key)
+{
+	// never 0 since samplingRate isn't
+	return static_cast<std::uint64_t>(key.samplingRate) |
+	static_cast<std::uint64_t>(key.numChannels) << 24 |
+	static_cast<std::uint64_t>(key.application) << 32 |
+	static_cast<std::uint64_t>(key.instance) << 48;
+}
+
+OpusCodecPool::Key OpusCodecPool::unpackKey(std::uint64_t packed)
+{
+	Key key;
+	key.samplingRate = static_cast<int>(packed & 0xffffff);
+	key.numChannels = static_cast<int>((packed >> 24) & 0xff);
+	key.application = static_cast<int>((packed >> 32) & 0xffff);
+	key.instance = static_cast<int>(packed >> 48);
+	return key;
+}
+
+void OpusCodecPool::prepare(const Key &key)
+{
+	{
+		std::lock_guard<std::mutex> lock(queueLock);
+		queue.push_back(key);
+	}
+	queueCond.notify_one();
+}
+
+void OpusCodecPool::prepareAsync(const Key &key)
+{
+	const std::uint64_t packed = packKey(key);
+	for (auto &request: asyncRequests) {
+		std::uint64_t expected = 0;
+		if (request.compare_exchange_strong(expected, packed,
+											std::memory_order_release) ||
+			expected == packed)
+			return;
+	}
+}
+
+OpusCodecPool::Codec *OpusCodecPool::acquire(const Key &key)
+{
+	const std::uint64_t packed = packKey(key);
+	for (std::size_t i = 0; i < capacity; ++i) {
+		Slot &slot = slots[i];
+		std::uint32_t state = slot.state.load(std::memory_order_acquire);
+		if ((state & StateMask) != Ready ||
+			slot.key.load(std::memory_order_relaxed) != packed)
+			continue;
+
+		// the builder might have evicted and rebuilt the slot since we
+		// loaded the state; the generation count makes this fail then
+		std::uint32_t newState = (state & ~StateMask) | InUse;
+		if (!slot.state.compare_exchange_strong(state, newState,
+												std::memory_order_acquire))
+			continue;
+
+		slot.lastUsed.store(++useCounter, std::memory_order_relaxed);
+
+		// start a new stream
+		slot.codec.encoderCtl(OPUS_RESET_STATE);
+		slot.codec.decoderCtl(OPUS_RESET_STATE);
+
+		return &slot.codec;
+	}
+	return nullptr;
+}
+
+OpusCodecPool::Codec *OpusCodecPool::acquireWait(const Key &key)
+{
+	prepare(key);
+
+	std::unique_lock<std::mutex> lock(queueLock);
+	for (;;) {
+		if (Codec *codec = acquire(key))
+			return codec;
+
+		const std::uint64_t packed = packKey(key);
+		bool failed = false;
+		for (std::size_t i = 0; i < capacity; ++i) {
+			std::uint32_t state = slots[i].state.load(std::memory_order_acquire);
+			if ((state & StateMask) == Failed &&
+				slots[i].key.load(std::memory_order_relaxed) == packed)
+				failed = true;
+		}
+		if (failed)
+			return nullptr;
+
+		builtCond.wait(lock);
+	}
+}
+
+void OpusCodecPool::release(Codec *codec)
+{
+	if (!codec)
+		return;
+
+	for (std::size_t i = 0; i < capacity; ++i) {
+		Slot &slot = slots[i];
+		if (&slot.codec != codec)
+			continue;
+
+		std::uint32_t state = slot.state.load(std::memory_order_relaxed);
+		assert((state & StateMask) == InUse);
+		slot.state.store((state & ~StateMask) | Ready,
+						 std::memory_order_release);
+		return;
+	}
+	assert(false);
+}
+
+bool OpusCodecPool::has(const Key &key)
+{
+	const std::uint64_t packed = packKey(key);
+	for (std::size_t i = 0; i < capacity; ++i) {
+		std::uint32_t state = slots[i].state.load(std::memory_order_acquire);
+		switch (state & StateMask) {
+			case Ready:
+			case InUse:
+			case Failed:
+				if (slots[i].key.load(std::memory_order_relaxed) == packed)
+					return true;
+				break;
+			default:
+				break;
+		}
+	}
+	return false;
+}
+
+void OpusCodecPool::builderThread()
+{
+	std::unique_lock<std::mutex> lock(queueLock);
+	while (!exiting) {
+		if (!queue.empty()) {
+			Key key = queue.front();
+			queue.pop_front();
+
+			lock.unlock();
+			build(key);
+			lock.lock();
+
+			builtCond.notify_all();
+			continue;
+		}
+
+		bool built = false;
+		for (auto &request: asyncRequests) {
+			if (std::uint64_t packed = request.exchange(0)) {
+				lock.unlock();
+				build(unpackKey(packed));
+				lock.lock();
+				built = true;
+			}
+		}
+		if (built) {
+			builtCond.notify_all();
+			continue;
+		}
+
+		// prepareAsync doesn't wake us up, so poll it every now and then
+		queueCond.wait_for(lock, std::chrono::milliseconds(20));
+	}
+}
+
+void OpusCodecPool::build(const Key &key)
+{
+	if (has(key))
+		return;
+
+	// find an empty slot, or evict the least recently used idle one
+	Slot *target = nullptr;
+	std::uint32_t targetState = 0;
+	for (std::size_t i = 0; i < capacity; ++i) {
+		Slot &slot = slots[i];
+		std::uint32_t state = slot.state.load(std::memory_order_acquire);
+		switch (state & StateMask) {
+			case Empty:
+				if (!target || (targetState & StateMask) != Empty) {
+					target = &slot;
+					targetState = state;
+				}
+				break;
+			case Ready:
+			case Failed:
+				if (!target ||
+					((targetState & StateMask) != Empty &&
+					 slot.lastUsed.load() < target->lastUsed.load())) {
+					target = &slot;
+					targetState = state;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	if (!target) {
+		// everything is in use
+		return;
+	}
+
+	std::uint32_t buildingState =
+	(targetState & ~StateMask) + GenerationUnit + Building;
+	if (!target->state.compare_exchange_strong(targetState, buildingState)) {
+		// the audio thread took it just now; try again later
+		prepareAsync(key);
+		return;
+	}
+
+	// nobody else touches the slot until the state below is published
+	Codec &codec = target->codec;
+	codec.key = key;
+	target->key.store(packKey(key), std::memory_order_relaxed);
+
+	bool ok = codec.create(key.samplingRate, key.numChannels, key.application);
+
+	target->lastUsed.store(++useCounter);
+
+	target->state.store((buildingState & ~StateMask) | (ok ? Ready : Failed),
+						std::memory_order_release);
+}
@@ -0,0 +1,229 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#ifndef OPUSCODECPOOL_H_INCLUDED
+#define OPUSCODECPOOL_H_INCLUDED
+
+#include <opus/opus.h>
+#include <opus/opus_multistream.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/**
+ * An encoder/decoder pair. Up to two channels this is a plain Opus stream;
+ * beyond that it's a multistream codec with the Vorbis channel mapping
+ * (mapping family 1), so samples must be passed in Vorbis channel order.
+ */
+class OpusCodec
+{
+	OpusEncoder *encoder;
+	OpusDecoder *decoder;
+	OpusMSEncoder *msEncoder;
+	OpusMSDecoder *msDecoder;
+	
+	// the stream layout, as an Ogg Opus header describes it
+	int numChannels;
+	int numStreams;
+	int numCoupledStreams;
+	unsigned char mapping[8];
+	
+	// the encoder settings as last set, notSet until they are
+	static const int notSet = -0x7fffffff;
+	int bitRate;
+	int complexity;
+	int maxBandwidth;
+	int dtx;
+	
+public:
+	OpusCodec();
+	~OpusCodec();
+	
+	OpusCodec(const OpusCodec &) = delete;
+	void operator = (const OpusCodec &) = delete;
+	
+	bool create(int samplingRate, int numChannels, int application);
+	void destroy();
+	
+	bool isValid() const
+	{ return (encoder && decoder) || (msEncoder && msDecoder); }
+	
+	int getNumChannels() const { return numChannels; }
+	int getNumStreams() const { return numStreams; }
+	int getNumCoupledStreams() const { return numCoupledStreams; }
+	
+	/** Channel to stream mapping (mapping family 1); only meaningful
+	 *  above two channels. */
+	const unsigned char *getMapping() const { return mapping; }
+	
+	int encode(const float *pcm, int frameSize,
+			   unsigned char *data, int maxDataBytes);
+	int decode(const unsigned char *data, int len,
+			   float *pcm, int maxFrameSize);
+	
+	/** These only go through to libopus when the value differs from the
+	 *  last one set, so they can be called for every frame. OPUS_RESET_STATE
+	 *  keeps the settings. */
+	void setBitRate(int);
+	void setComplexity(int);
+	void setMaxBandwidth(int);
+	void setDtx(bool);
+	
+	template <class... Args>
+	int encoderCtl(int request, Args... args)
+	{
+		return msEncoder ?
+		opus_multistream_encoder_ctl(msEncoder, request, args...) :
+		opus_encoder_ctl(encoder, request, args...);
+	}
+	template <class... Args>
+	int decoderCtl(int request, Args... args)
+	{
+		return msDecoder ?
+		opus_multistream_decoder_ctl(msDecoder, request, args...) :
+		opus_decoder_ctl(decoder, request, args...);
+	}
+};
+
+/**
+ * Keeps a few encoder/decoder pairs around, keyed by the parameters that
+ * can only be set when the codec is created.
+ *
+ * Codecs are created and destroyed on a background thread. The audio thread
+ * only calls acquire/release, which never allocate or block, so switching
+ * back and forth between a handful of settings costs nothing once they have
+ * been built.
+ */
+class OpusCodecPool
+{
+public:
+	struct Key
+	{
+		int samplingRate;
+		int numChannels;
+		int application; // OPUS_APPLICATION_*
+
+		// tells apart codecs that are otherwise the same, so that more
+		// than one of them can be in use at a time
+		int instance;
+
+		bool operator == (const Key &o) const
+		{
+			return samplingRate == o.samplingRate &&
+			numChannels == o.numChannels &&
+			application == o.application &&
+			instance == o.instance;
+		}
+		bool operator != (const Key &o) const
+		{
+			return !(*this == o);
+		}
+	};
+
+	struct Codec : OpusCodec
+	{
+		Key key;
+	};
+
+	explicit OpusCodecPool(std::size_t capacity = 4);
+	~OpusCodecPool();
+
+	/** Schedules the construction of a codec. Must not be called from the
+	 *  audio thread. */
+	void prepare(const Key &key);
+
+	/** Like prepare, but lock-free. The request is noticed with a slight
+	 *  delay since the builder thread isn't woken up, and it's dropped if
+	 *  numAsyncRequests others are still waiting; the caller is expected
+	 *  to ask again when acquire fails. */
+	void prepareAsync(const Key &key);
+
+	/** Returns a codec with a freshly reset state, or nullptr if there is
+	 *  none available yet. Lock-free. */
+	Codec *acquire(const Key &key);
+
+	/** Blocks until the codec is built. Must not be called from the audio
+	 *  thread. Returns nullptr if libopus refused to create it. */
+	Codec *acquireWait(const Key &key);
+
+	/** Puts the codec back. It stays in the pool until it is evicted. */
+	void release(Codec *codec);
+
+private:
+	enum SlotState : std::uint32_t
+	{
+		Empty,
+		Building,
+		Ready,
+		InUse,
+		Failed,
+
+		StateMask = 7,
+		// the rest of the word counts reuses of the slot so that a stale
+		// compare-exchange on the state fails
+		GenerationUnit = 8
+	};
+
+	struct Slot
+	{
+		std::atomic<std::uint32_t> state;
+		// packKey(codec.key), written only while the slot is Building so
+		// that it can be compared without owning the slot
+		std::atomic<std::uint64_t> key;
+		std::atomic<std::uint64_t> lastUsed;
+		Codec codec;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	std::size_t capacity;
+
+	std::atomic<std::uint64_t> useCounter;
+
+	// packed Keys written by prepareAsync, 0 if none. there's room for a
+	// codec per variant and then some.
+	static const std::size_t numAsyncRequests = 8;
+	std::atomic<std::uint64_t> asyncRequests[numAsyncRequests];
+
+	std::mutex queueLock;
+	std::condition_variable queueCond;
+	std::condition_variable builtCond;
+	std::deque<Key> queue;
+	bool exiting;
+
+	std::thread builder;
+
+	static std::uint64_t packKey(const Key &key);
+	static Key unpackKey(std::uint64_t packed);
+
+	void builderThread();
+	void build(const Key &key);
+	bool has(const Key &key);
+};
+
+#endif  // OPUSCODECPOOL_H_INCLUDED
@@ -27,275 +27,734 @@
 #include <array>
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <thread>
 
-template <class T>
-static inline void copyWithStride(T *dest, const T *src, std::size_t count,
-								  std::size_t destStride, std::size_t srcStride)
+// position of each host channel (WAVE order: L R C LFE BL BR SL SR) in the
+// Vorbis order the Opus surround mapping expects, by channel count
+static const int vorbisChannelOrder[RoundTripOpusAudioProcessor::maxNumChannels]
+[RoundTripOpusAudioProcessor::maxNumChannels] =
 {
-	while (count--) {
-		*dest = *src;
-		dest += destStride;
-		src += srcStride;
+	{0},
+	{0, 1},
+	{0, 2, 1},
+	{0, 1, 2, 3},
+	{0, 2, 1, 3, 4},
+	{0, 2, 1, 5, 3, 4},
+	{0, 2, 1, 6, 5, 3, 4},
+	{0, 2, 1, 7, 5, 6, 3, 4}
+};
+
+const int RoundTripOpusAudioProcessor::maxNumChannels;
+const int RoundTripOpusAudioProcessor::maxNumVariants;
+const int RoundTripOpusAudioProcessor::maxReplayPacket;
+const float RoundTripOpusAudioProcessor::settledThreshold = 1.f / 16777216.f; // -144dB
+const int RoundTripOpusAudioProcessor::opusSamplingRates[numOpusSamplingRates] =
+{8000, 12000, 16000, 24000, 48000};
+
+// the frame sizes the frame size parameters select, and from which
+// value (times 60) on each of them does
+static const struct
+{
+	int frameSizeTime; // 0.1ms
+	float start;
+} frameSizeRanges[] =
+{
+	{25, 0.f}, {50, 4.f}, {100, 7.5f}, {200, 15.f}, {400, 30.f}, {600, 40.f}
+};
+static const int numFrameSizeRanges =
+sizeof(frameSizeRanges) / sizeof(frameSizeRanges[0]);
+
+// the parameters the host sees, in order. Application and Signal are
+// kept hidden.
+static const RoundTripOpusAudioProcessor::Parameter hostParameters[] =
+{
+	RoundTripOpusAudioProcessor::Parameter::SamplingRate,
+	RoundTripOpusAudioProcessor::Parameter::Bitrate,
+	RoundTripOpusAudioProcessor::Parameter::FrameSize,
+	RoundTripOpusAudioProcessor::Parameter::ResamplerQuality,
+	RoundTripOpusAudioProcessor::Parameter::LowLatency,
+	RoundTripOpusAudioProcessor::Parameter::WorkerThread,
+	RoundTripOpusAudioProcessor::Parameter::NumVariants,
+	RoundTripOpusAudioProcessor::Parameter::ListenVariant,
+	RoundTripOpusAudioProcessor::Parameter::BitrateB,
+	RoundTripOpusAudioProcessor::Parameter::FrameSizeB,
+	RoundTripOpusAudioProcessor::Parameter::BitrateC,
+	RoundTripOpusAudioProcessor::Parameter::FrameSizeC,
+	RoundTripOpusAudioProcessor::Parameter::BitrateD,
+	RoundTripOpusAudioProcessor::Parameter::FrameSizeD,
+	RoundTripOpusAudioProcessor::Parameter::Complexity,
+	RoundTripOpusAudioProcessor::Parameter::AdaptiveComplexity,
+	RoundTripOpusAudioProcessor::Parameter::MinComplexity,
+	RoundTripOpusAudioProcessor::Parameter::MaxComplexity,
+	RoundTripOpusAudioProcessor::Parameter::CurrentComplexity,
+	RoundTripOpusAudioProcessor::Parameter::DeadlineMisses,
+	RoundTripOpusAudioProcessor::Parameter::Dtx,
+	RoundTripOpusAudioProcessor::Parameter::WorkerTakeover
+};
+static const int numHostParameters =
+sizeof(hostParameters) / sizeof(hostParameters[0]);
+
+// the variant (1 for B) a per-variant parameter belongs to, 0 if none
+static int getVariantOfParameter(RoundTripOpusAudioProcessor::Parameter parameter)
+{
+	using Parameter = RoundTripOpusAudioProcessor::Parameter;
+	switch (parameter) {
+		case Parameter::BitrateB:
+		case Parameter::FrameSizeB:
+			return 1;
+		case Parameter::BitrateC:
+		case Parameter::FrameSizeC:
+			return 2;
+		case Parameter::BitrateD:
+		case Parameter::FrameSizeD:
+			return 3;
+		default:
+			return 0;
 	}
 }
 
-template <class T, int N>
-class RoundTripOpusAudioProcessor::Fifo
+static const char *const variantNames[RoundTripOpusAudioProcessor::maxNumVariants] =
+{"A", "B", "C", "D"};
+
+//==============================================================================
+RoundTripOpusAudioProcessor::RoundTripOpusAudioProcessor()
 {
-	std::vector<T> buffers[N];
-	std::size_t capacity;
-	std::size_t readCursor;
-	std::size_t size;
+	opusCodec = nullptr;
+	hasNextConfig = false;
+	inputResampler = nullptr;
+	outputResampler = nullptr;
+	resamplerSamplingRate = 0;
+	resamplerQuality = ResamplerQuality::Medium;
+	srcNumChannels = 0;
+	directSamplingRate = 0;
+	maxBlockSize = 0;
+	inputSamplingRate = 0.0;
 	
-	std::size_t wrapAround(std::size_t i)
-	{
-		while (i >= capacity)
-			i -= capacity;
-		assert(i < capacity);
-		return i;
-	}
+	outputPrefill = 0;
+	outputCorrection = 0;
+	pipelineBalance = 0;
+	pipelineLatency = 0;
+	silentInputLength = 0;
+	silentOutputLength = 0;
 	
-	std::size_t getReadCursor()
-	{
-		assert(readCursor < capacity);
-		return readCursor;
-	}
+	threaded = false;
+	takeover = false;
+	ringCorrection = 0;
+	pipelineBusy = false;
 	
-	std::size_t getWriteCursor()
-	{
-		return wrapAround(readCursor + size);
-	}
+	replayRequest = nullptr;
+	replayInUse = nullptr;
+	replayStartTime = 0.0;
+	hasAnchor = false;
+	inputIndex = 0;
+	replay = nullptr;
+	pipelineInputIndex = 0;
+	hasNextAnchor = false;
+	replayFrameIndex = 0.0;
+	replayPosition = 0;
+	replaySynced = false;
+	replayCodec = nullptr;
+	replayPacket = 0;
+	replayLeadIn = 0;
+	replayBufferStart = replayBufferEnd = 0;
 	
-public:
-	using BufferSet = std::array<T *, N>;
-	using ConstBufferSet = std::array<const T *, N>;
+	cacheUsable = false;
+	cacheBehind = false;
+	cacheHistoryLength = 0;
 	
-	void setCapacity(std::size_t samples)
-	{
-		capacity = samples;
-		for (auto &buffer: buffers)
-			buffer.resize(samples);
-		readCursor = 0;
-		size = 0;
+	numVariants = 1;
+	variantsFed = 0;
+	listenVariant = 0;
+	for (auto &variant: variants) {
+		variant.reset(new Variant());
+		variant->codec = nullptr;
+		variant->outputCorrection = 0;
+		variant->outputResampler = nullptr;
+		variant->state = Variant::Idle;
+		variant->input.reset(new AudioFifo(16, 2));
+		variant->decoded.reset(new AudioFifo(16, 2));
+		variant->output.reset(new AudioFifo(16, 2));
 	}
-	Fifo(std::size_t capacity)
-	{
-		setCapacity(capacity);
+	
+	fifo1.reset(new AudioFifo(4096, 2));
+	fifo2.reset(new AudioFifo(16384, 2));
+	fifo3.reset(new AudioFifo(16384, 2));
+	fifo4.reset(new AudioFifo(4096, 2));
+	
+	hostConfig.samplingRate = 48000;
+	hostConfig.bitRate = 64000;
+	hostConfig.frameSizeTime = 400;
+	hostConfig.application = Application::Audio;
+	hostConfig.signal = Signal::Auto;
+	hostConfig.complexity = 5;
+	hostConfig.adaptiveComplexity = false;
+	hostConfig.minComplexity = 0;
+	hostConfig.maxComplexity = 10;
+	hostConfig.lowLatency = false;
+	hostConfig.dtx = false;
+	hostConfig.resamplerQuality = ResamplerQuality::Medium;
+	hostConfig.workerThread = false;
+	hostConfig.workerTakeover = false;
+	hostConfig.numVariants = 1;
+	for (int i = 0; i < maxNumVariants - 1; ++i) {
+		// some lower rates to compare A against
+		static const int defaultBitRates[] = {32000, 24000, 16000};
+		hostConfig.variants[i].bitRate = defaultBitRates[i];
+		hostConfig.variants[i].frameSizeTime = 400;
 	}
-	bool canDequeueAtLeast(std::size_t samples)
-	{
-		return size >= samples;
+	hostConfigVersion = 0;
+	hostConfigVersionSeen = 0;
+	
+	numConfigChangesApplied = 0;
+	configChanges.setCapacity(64, 1);
+	hasOutgoingConfig = false;
+	
+	opusNumChannels = 2;
+	opusComplexity = -1; // so that the governor starts
+	const CodecConfig config = hostConfig.load();
+	encoderComplexity = config.complexity;
+	setCurrentConfig(config);
+	
+	// the room a single codec had, for every variant
+	codecPool.reset(new OpusCodecPool(4 * maxNumVariants));
+	opusCodec = codecPool->acquireWait(makeCodecKey(config, opusNumChannels));
+	// FIXME: error check
+}
+
+RoundTripOpusAudioProcessor::~RoundTripOpusAudioProcessor()
+{
+	codecWorker.stop();
+	capture.stop();
+	for (auto &variant: variants) {
+		variant->worker.stop();
+		codecPool->release(variant->codec);
 	}
-	bool canEnqueueAtLeast(std::size_t samples)
-	{
-		return samples + size <= capacity;
+	codecPool->release(opusCodec);
+	codecPool.reset();
+	invalidateSrc();
+}
+
+int RoundTripOpusAudioProcessor::getOpusApplication(Application application)
+{
+	switch (application) {
+		case Application::Audio:
+			return OPUS_APPLICATION_AUDIO;
+		case Application::VoiceOverIP:
+			return OPUS_APPLICATION_VOIP;
+		case Application::LowDelay:
+			return OPUS_APPLICATION_RESTRICTED_LOWDELAY;
 	}
-	std::size_t getNumberOfSamplesEnqueueable()
-	{
-		return capacity - size;
+	return OPUS_APPLICATION_AUDIO;
+}
+
+int RoundTripOpusAudioProcessor::getOpusBandwidth(int samplingRate)
+{
+	if (samplingRate <= 8000) {
+		return OPUS_BANDWIDTH_NARROWBAND;
+	} else if (samplingRate <= 12000) {
+		return OPUS_BANDWIDTH_MEDIUMBAND;
+	} else if (samplingRate <= 16000) {
+		return OPUS_BANDWIDTH_WIDEBAND;
+	} else if (samplingRate <= 24000) {
+		return OPUS_BANDWIDTH_SUPERWIDEBAND;
 	}
-	std::size_t getNumberOfSamplesDequeueable()
-	{
-		return size;
+	return OPUS_BANDWIDTH_FULLBAND;
+}
+
+int RoundTripOpusAudioProcessor::getCodecSamplingRate(int samplingRate) const
+{
+	// on the direct path the selected rate only limits the bandwidth
+	int direct = directSamplingRate.load(std::memory_order_relaxed);
+	return direct ? direct : samplingRate;
+}
+
+OpusCodecPool::Key RoundTripOpusAudioProcessor::makeCodecKey
+(const CodecConfig &config, int numChannels, int variant) const
+{
+	OpusCodecPool::Key key;
+	key.samplingRate = getCodecSamplingRate(config.samplingRate);
+	key.numChannels = numChannels;
+	key.instance = variant;
+	// low latency mode always goes for the shortest lookahead
+	key.application = getOpusApplication(config.lowLatency ?
+										  Application::LowDelay :
+										  config.application);
+	return key;
+}
+
+int RoundTripOpusAudioProcessor::getFrameSize(const CodecConfig &config) const
+{
+	int codecRate = getCodecSamplingRate(config.samplingRate);
+	if (!config.lowLatency)
+		return config.frameSizeTime * codecRate / 10000;
+	
+	// take the longest frame (up to the 20ms a single CELT frame can be)
+	// that the host block splits into evenly, so that every block turns
+	// into whole frames and nothing has to wait for the next one. that
+	// only works when the codec runs at the host rate; otherwise, or if
+	// nothing divides the block, the shortest frame keeps the wait short.
+	static const int frameSizeTimes[] = {200, 100, 50, 25}; // 0.1ms
+	bool direct = directSamplingRate.load(std::memory_order_relaxed) != 0;
+	for (int frameSizeTime: frameSizeTimes) {
+		std::size_t frameSize = frameSizeTime * codecRate / 10000;
+		if (direct && maxBlockSize > 0 && maxBlockSize % frameSize == 0)
+			return static_cast<int>(frameSize);
 	}
-	std::size_t getNumberOfSamplesEnqueueableBySingleRun()
-	{
-		if (size == capacity) {
-			return 0;
-		} else {
-			auto rc = getReadCursor();
-			auto wc = getWriteCursor();
-			if (wc >= rc) {
-				return capacity - wc;
-			} else {
-				return rc - wc;
-			}
-		}
+	return 25 * codecRate / 10000;
+}
+
+int RoundTripOpusAudioProcessor::getMaxFrameSize() const
+{
+	int frameSize = opusFrameSize;
+	for (int i = 1; i < numVariants; ++i)
+		frameSize = std::max(frameSize, variants[i - 1]->frameSize);
+	return frameSize;
+}
+
+RoundTripOpusAudioProcessor::CodecConfig
+RoundTripOpusAudioProcessor::getCurrentConfig() const
+{
+	// the config the audio thread is running with
+	CodecConfig config;
+	config.samplingRate = opusSamplingRate;
+	config.bitRate = opusBitRate;
+	config.frameSizeTime = opusFrameSizeTime;
+	config.application = opusApplication;
+	config.signal = opusSignal;
+	config.complexity = opusComplexity;
+	config.adaptiveComplexity = opusAdaptiveComplexity;
+	config.minComplexity = opusMinComplexity;
+	config.maxComplexity = opusMaxComplexity;
+	config.lowLatency = opusLowLatency;
+	config.dtx = opusDtx;
+	config.resamplerQuality = resamplerQuality;
+	config.workerThread = threaded;
+	config.workerTakeover = takeover;
+	config.numVariants = numVariants;
+	for (int i = 0; i < maxNumVariants - 1; ++i) {
+		config.variants[i].bitRate = variants[i]->bitRate;
+		config.variants[i].frameSizeTime = variants[i]->frameSizeTime;
 	}
-	std::size_t getNumberOfSamplesDequeueableBySingleRun()
-	{
-		if (size == 0) {
-			return 0;
-		} else {
-			auto rc = getReadCursor();
-			auto wc = getWriteCursor();
-			if (rc >= wc) {
-				return capacity - rc;
-			} else {
-				return wc - rc;
-			}
-		}
+	return config;
+}
+
+void RoundTripOpusAudioProcessor::invalidateSrc()
+{
+	for (auto &resampler: inputResamplers)
+		resampler.reset();
+	for (auto &resampler: outputResamplers)
+		resampler.reset();
+	for (auto &variant: variants) {
+		for (auto &resampler: variant->outputResamplers)
+			resampler.reset();
+		variant->outputResampler = nullptr;
 	}
-	template <class F>
-	std::size_t dequeueSingleCustom(F fn)
-	{
-		ConstBufferSet bufs;
-		auto cursor = getReadCursor();
-		for (std::size_t i = 0; i < N; ++i) {
-			bufs[i] = buffers[i].data() + cursor;
+	inputResampler = nullptr;
+	outputResampler = nullptr;
+	resamplerSamplingRate = 0;
+	srcNumChannels = 0;
+}
+
+void RoundTripOpusAudioProcessor::selectResamplers()
+{
+	// audio thread. the converters were built by prepareToPlay, so this
+	// only switches pointers.
+	if (resamplerSamplingRate == opusSamplingRate)
+		return;
+	for (int i = 0; i < numOpusSamplingRates; ++i) {
+		if (opusSamplingRates[i] != opusSamplingRate ||
+			!inputResamplers[i] || !outputResamplers[i])
+			continue;
+		inputResampler = inputResamplers[i].get();
+		outputResampler = outputResamplers[i].get();
+		inputResampler->reset();
+		outputResampler->reset();
+		for (int j = 1; j < numVariants; ++j) {
+			Variant &variant = *variants[j - 1];
+			variant.outputResampler = variant.outputResamplers[i].get();
+			if (variant.outputResampler)
+				variant.outputResampler->reset();
 		}
-		
-		auto runLength = getNumberOfSamplesDequeueableBySingleRun();
-		auto adv = fn(bufs, runLength);
-		assert(adv <= runLength);
-		
-		readCursor = wrapAround(readCursor + adv);
-		size -= adv;
-		
-		return adv;
+		resamplerSamplingRate = opusSamplingRate;
+		return;
 	}
-	template <class F>
-	std::size_t enqueueSingleCustom(F fn)
-	{
-		BufferSet bufs;
-		auto cursor = getWriteCursor();
-		for (std::size_t i = 0; i < N; ++i) {
-			bufs[i] = buffers[i].data() + cursor;
+}
+
+void RoundTripOpusAudioProcessor::resample(Resampler *resampler,
+											AudioFifo &from, AudioFifo &to)
+{
+	// both FIFOs are mirrored, so everything readable and everything
+	// writable is one run and a single call converts as much as possible.
+	// both sides are interleaved too, so that's all channels at once.
+	from.dequeueSingleCustom
+	([&](const AudioFifo::ConstBufferSet &inBuffers, std::size_t inSamples) {
+		if (!inSamples)
+			return inSamples;
+		to.enqueueSingleCustom
+		([&](const AudioFifo::BufferSet &outBuffers, std::size_t outSamples) {
+			return resampler->process(inBuffers[0], inSamples,
+									  outBuffers[0], outSamples,
+									  inSamples);
+		});
+		return inSamples;
+	});
+}
+
+bool RoundTripOpusAudioProcessor::updateLatency()
+{
+	// Opus output arrives a whole frame at a time, and the converters can
+	// hold back a few samples on top of that, so the output has to start
+	// out that far ahead to never run dry. that prefill, the encoder's
+	// lookahead and the filter delays of the converters add up to the
+	// end-to-end delay.
+	bool direct = directSamplingRate.load(std::memory_order_relaxed) != 0;
+	double codecRate = getCodecSamplingRate(opusSamplingRate);
+	double hostPerCodecSample = inputSamplingRate > 0.0 ?
+	inputSamplingRate / codecRate : 1.0;
+	
+	opus_int32 lookahead = 0;
+	if (opusCodec)
+		opusCodec->encoderCtl(OPUS_GET_LOOKAHEAD(&lookahead));
+	
+	// in A/B mode every variant's output starts as far ahead as the one
+	// with the longest frame needs, which keeps them aligned
+	int maxFrameSize = getMaxFrameSize();
+	
+	double codecSideFrames = maxFrameSize; // in codec samples
+	if (direct && opusLowLatency && maxBlockSize > 0) {
+		// host blocks of maxBlockSize always leave a multiple of their
+		// common divisor with the frame size over, so less than a frame
+		// does. none at all if the frame divides the block. hosts that
+		// send shorter blocks get a glitch (but no drift) instead.
+		std::size_t frameSize = maxFrameSize;
+		std::size_t a = maxBlockSize, b = frameSize;
+		while (b) {
+			std::size_t t = a % b;
+			a = b;
+			b = t;
 		}
-		
-		auto runLength = getNumberOfSamplesEnqueueableBySingleRun();
-		auto adv = fn(bufs, runLength);
-		assert(adv <= runLength);
-		
-		size += adv;
-		
-		return adv;
+		codecSideFrames = static_cast<double>(frameSize - a);
 	}
-	std::size_t dequeue(BufferSet buffers, std::size_t size, std::size_t stride = 1)
-	{
-		std::size_t ttl = 0;
-		while (size > 0) {
-			auto processed =
-			dequeueSingleCustom([&](ConstBufferSet qb, std::size_t samples) {
-				if (samples > size) {
-					samples = size;
-				}
-				for (std::size_t i = 0; i < N; ++i) {
-					if (buffers[i]) {
-						copyWithStride(buffers[i], qb[i], samples,
-									   stride, 1);
-					}
-				}
-				return samples;
-			});
-			if (processed == 0) {
-				break;
-			}
-			size -= processed;
-			for (std::size_t i = 0; i < N; ++i) {
-				if (buffers[i])
-					buffers[i] += processed * stride;
-			}
-			ttl += processed;
-		}
-		return ttl;
+	double codecSideDelay = lookahead;
+	double hostSideFrames = 0.0;
+	double hostSideDelay = 0.0;
+	if (!direct && inputResampler && outputResampler) {
+		codecSideFrames += inputResampler->getHoldback();
+		codecSideDelay += inputResampler->getDelay();
+		// plus one for the rounding of the conversion ratio
+		hostSideFrames += outputResampler->getHoldback() + 1;
+		hostSideDelay += outputResampler->getDelay();
 	}
-	std::size_t enqueue(ConstBufferSet buffers, std::size_t size, std::size_t stride = 1)
-	{
-		std::size_t ttl = 0;
-		while (size > 0) {
-			auto processed =
-			enqueueSingleCustom([&](BufferSet qb, std::size_t samples) {
-				if (samples > size) {
-					samples = size;
-				}
-				for (std::size_t i = 0; i < N; ++i) {
-					if (buffers[i]) {
-						copyWithStride(qb[i], buffers[i], samples,
-									   1, stride);
-					}
-				}
-				return samples;
-			});
-			if (processed == 0) {
-				break;
-			}
-			size -= processed;
-			for (std::size_t i = 0; i < N; ++i) {
-				if (buffers[i])
-					buffers[i] += processed * stride;
-			}
-			ttl += processed;
-		}
-		return ttl;
+	
+	outputPrefill = static_cast<std::size_t>
+	(std::ceil(codecSideFrames * hostPerCodecSample + hostSideFrames));
+	if (threaded) {
+		// the worker gets a frame's time (or a block's, if those are
+		// longer) to deliver, so the output starts that much further ahead
+		std::size_t frame = static_cast<std::size_t>
+		(std::ceil(maxFrameSize * hostPerCodecSample));
+		outputPrefill += std::max(frame, maxBlockSize);
 	}
+	int latency = roundDoubleToInt(outputPrefill +
+								   codecSideDelay * hostPerCodecSample +
+								   hostSideDelay);
 	
-};
+	return pipelineLatency.exchange(latency) != latency;
+}
 
-//==============================================================================
-RoundTripOpusAudioProcessor::RoundTripOpusAudioProcessor()
+void RoundTripOpusAudioProcessor::correctOutput()
 {
-	opusEncoder = nullptr;
-	opusDecoder = nullptr;
-	for (auto &s: srcState)
-		s = nullptr;
-	
-	resolvingUnderrun = false;
-	resolvingOverrun = false;
+	correctOutput(*fifo4, outputCorrection);
+}
+
+void RoundTripOpusAudioProcessor::correctOutput(AudioFifo &fifo,
+												std::ptrdiff_t &correction)
+{
+	// audio thread. the output FIFO only ever grows or shrinks by whole
+	// samples of silence here, which keeps input and output in lockstep.
+	if (correction > 0) {
+		std::size_t stride = fifo.getChannelStride();
+		correction -= fifo.enqueueSingleCustom
+		([&](const AudioFifo::BufferSet &frames, std::size_t samples) {
+			samples = std::min(samples, static_cast<std::size_t>(correction));
+			std::fill(frames[0], frames[0] + samples * stride, 0.f);
+			return samples;
+		});
+	} else if (correction < 0) {
+		correction += fifo.dequeueSingleCustom
+		([&](const AudioFifo::ConstBufferSet &, std::size_t samples) {
+			return std::min(samples, static_cast<std::size_t>(-correction));
+		});
+	}
+}
+
+RoundTripOpusAudioProcessor::AudioFifo &
+RoundTripOpusAudioProcessor::getOutputFifo(int variant)
+{
+	return variant ? *variants[variant - 1]->output : *fifo4;
+}
+
+std::ptrdiff_t &RoundTripOpusAudioProcessor::getOutputCorrection(int variant)
+{
+	return variant ? variants[variant - 1]->outputCorrection : outputCorrection;
+}
+
+void RoundTripOpusAudioProcessor::handleAsyncUpdate()
+{
+	setLatencySamples(pipelineLatency.load());
+}
+
+void RoundTripOpusAudioProcessor::setCurrentConfig(const CodecConfig &config)
+{
+	// the governor keeps what it learnt through other changes
+	if (config.complexity != opusComplexity ||
+		config.adaptiveComplexity != opusAdaptiveComplexity ||
+		config.minComplexity != opusMinComplexity ||
+		config.maxComplexity != opusMaxComplexity) {
+		if (config.adaptiveComplexity) {
+			complexityGovernor.reset(config.complexity, config.minComplexity,
+									 config.maxComplexity);
+		} else {
+			complexityGovernor.reset(config.complexity, config.complexity,
+									 config.complexity);
+		}
+	}
 	
-	fifo1.reset(new AudioFifo(4096));
-	fifo2.reset(new AudioFifo(16384));
-	fifo3.reset(new AudioFifo(16384));
-	fifo4.reset(new AudioFifo(4096));
+	opusSamplingRate = config.samplingRate;
+	opusBitRate = config.bitRate;
+	opusFrameSizeTime = config.frameSizeTime;
+	opusApplication = config.application;
+	opusSignal = config.signal;
+	opusComplexity = config.complexity;
+	opusAdaptiveComplexity = config.adaptiveComplexity;
+	opusMinComplexity = config.minComplexity;
+	opusMaxComplexity = config.maxComplexity;
+	opusLowLatency = config.lowLatency;
+	opusDtx = config.dtx;
 	
-	opusSamplingRate = 48000;
-	opusNumChannels = 2;
-	opusApplication = Application::Audio;
-	opusFrameSizeTime = 400;
-	opusBitRate = 64000;
-	opusComplexity = 5;
-	opusSignal = Signal::Auto;
+	opusFrameSize = getFrameSize(config);
 	
-	createOpusCodec();
+	// the variants only differ in these
+	for (int i = 0; i < maxNumVariants - 1; ++i) {
+		Variant &variant = *variants[i];
+		CodecConfig variantConfig = config;
+		variantConfig.frameSizeTime = config.variants[i].frameSizeTime;
+		variant.bitRate = config.variants[i].bitRate;
+		variant.frameSizeTime = config.variants[i].frameSizeTime;
+		variant.frameSize = getFrameSize(variantConfig);
+	}
 }
 
-RoundTripOpusAudioProcessor::~RoundTripOpusAudioProcessor()
+RoundTripOpusAudioProcessor::CodecConfig
+RoundTripOpusAudioProcessor::HostConfig::load() const
 {
-	invalidateOpusCodec();
-	invalidateSrc();
+	CodecConfig config;
+	config.samplingRate = samplingRate;
+	config.bitRate = bitRate;
+	config.frameSizeTime = frameSizeTime;
+	config.application = application;
+	config.signal = signal;
+	config.complexity = complexity;
+	config.adaptiveComplexity = adaptiveComplexity;
+	config.minComplexity = minComplexity;
+	config.maxComplexity = maxComplexity;
+	config.lowLatency = lowLatency;
+	config.dtx = dtx;
+	for (int i = 0; i < maxNumVariants - 1; ++i) {
+		config.variants[i].bitRate = variants[i].bitRate;
+		config.variants[i].frameSizeTime = variants[i].frameSizeTime;
+	}
+	config.resamplerQuality = resamplerQuality;
+	config.workerThread = workerThread;
+	config.workerTakeover = workerTakeover;
+	config.numVariants = numVariants;
+	return config;
 }
 
-void RoundTripOpusAudioProcessor::createOpusCodec()
+void RoundTripOpusAudioProcessor::publishConfig()
 {
-	if (!opusEncoder) {
-		int err;
-		int app;
-		switch (opusApplication) {
-			case Application::Audio:
-				app = OPUS_APPLICATION_AUDIO;
-				break;
-			case Application::VoiceOverIP:
-				app = OPUS_APPLICATION_VOIP;
-				break;
-			case Application::LowDelay:
-				app = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
-				break;
+	// called from setParameter, maybe on the audio thread. the field has
+	// been stored already.
+	hostConfigVersion.fetch_add(1, std::memory_order_release);
+	
+	// get the codecs built before the audio thread asks for them. this
+	// goes through prepareAsync since prepare takes a lock.
+	int numChannels = getNumInputChannels();
+	if (numChannels > 0) {
+		const CodecConfig config = hostConfig.load();
+		for (int i = 0; i < config.numVariants; ++i)
+			codecPool->prepareAsync(makeCodecKey(config, numChannels, i));
+	}
+}
+
+bool RoundTripOpusAudioProcessor::acquireCodecs(const CodecConfig &config)
+{
+	// audio thread. every variant switches to its new codec at once or
+	// none does, so that they never run with different settings.
+	OpusCodecPool::Codec *codecs[maxNumVariants] = {};
+	bool ready = true;
+	for (int i = 0; i < numVariants; ++i) {
+		auto key = makeCodecKey(config, opusNumChannels, i);
+		OpusCodecPool::Codec *current = i ? variants[i - 1]->codec : opusCodec;
+		if (current && current->key == key)
+			continue;
+		codecs[i] = codecPool->acquire(key);
+		if (!codecs[i]) {
+			codecPool->prepareAsync(key);
+			ready = false;
 		}
-		opusEncoder = opus_encoder_create
-		(opusSamplingRate, opusNumChannels, app, &err);
 	}
-	if (!opusDecoder) {
-		int err;
-		opusDecoder = opus_decoder_create
-		(opusSamplingRate, opusNumChannels, &err);
-		// FIXME: error check
+	for (int i = 0; i < numVariants; ++i) {
+		if (!codecs[i])
+			continue;
+		OpusCodecPool::Codec *&current = i ? variants[i - 1]->codec : opusCodec;
+		codecPool->release(ready ? current : codecs[i]);
+		if (ready)
+			current = codecs[i];
 	}
+	return ready;
 }
-void RoundTripOpusAudioProcessor::invalidateOpusCodec()
+
+void RoundTripOpusAudioProcessor::sendConfigChange()
 {
-	if (opusEncoder)
-		opus_encoder_destroy(opusEncoder);
-	opusEncoder = nullptr;
-	if (opusDecoder)
-		opus_decoder_destroy(opusDecoder);
-	opusDecoder = nullptr;
+	// if the host published several changes since the last slice only the
+	// latest one is seen. the host can't say where in a block a change
+	// falls, so it's put at the start.
+	std::uint32_t version = hostConfigVersion.load(std::memory_order_acquire);
+	if (version != hostConfigVersionSeen) {
+		hostConfigVersionSeen = version;
+		outgoingConfig.inputIndex = inputIndex;
+		outgoingConfig.config = hostConfig.load();
+		hasOutgoingConfig = true;
+	}
+	if (!hasOutgoingConfig)
+		return;
+	
+	std::size_t written = configChanges.write([&](ConfigChange *changes,
+												  std::size_t maxChanges) {
+		if (!maxChanges)
+			return static_cast<std::size_t>(0);
+		changes[0] = outgoingConfig;
+		return static_cast<std::size_t>(1);
+	});
+	if (written)
+		hasOutgoingConfig = false;
 }
 
-void RoundTripOpusAudioProcessor::invalidateSrc()
+double RoundTripOpusAudioProcessor::getFrameInputIndex() const
 {
-	for (auto &state: srcState)
-		if (state)
-			state = src_delete(state);
+	if (replay)
+		return replayFrameIndex;
+	
+	// what went into fifo1 and hasn't left it yet comes after the frame
+	double index = static_cast<double>(pipelineInputIndex -
+		static_cast<std::int64_t>(fifo1->getNumberOfSamplesDequeueable()));
+	bool direct = directSamplingRate.load(std::memory_order_relaxed) != 0;
+	if (!direct && inputResampler) {
+		// and so does what's converted but still queued. the converter's
+		// filter delay is the part of the frame from before that.
+		double codecRate = getCodecSamplingRate(opusSamplingRate);
+		double queued = fifo2->getNumberOfSamplesDequeueable() +
+		inputResampler->getDelay();
+		index -= queued * inputSamplingRate / codecRate;
+	}
+	return index;
+}
+
+void RoundTripOpusAudioProcessor::applyPendingConfig()
+{
+	// pipeline only. never blocks. everything due by the next frame is
+	// taken at once; only the latest of it counts. without a codec to run
+	// frames with, nothing would ever come due, so all of it is.
+	double frameIndex = std::numeric_limits<double>::infinity();
+	if (opusCodec && opusCodec->key.numChannels == opusNumChannels)
+		frameIndex = getFrameInputIndex();
+	configChanges.read([&](const ConfigChange *changes, std::size_t numChanges) {
+		std::size_t due = 0;
+		while (due < numChanges &&
+			   static_cast<double>(changes[due].inputIndex) <= frameIndex) {
+			++due;
+		}
+		if (due) {
+			nextConfig = changes[due - 1].config;
+			hasNextConfig = true;
+		}
+		return due;
+	});
+	if (!hasNextConfig)
+		return;
+	
+	const CodecConfig &config = nextConfig;
+	
+	// the variants' state is about to change under them
+	finishVariants();
+	
+	OpusCodecPool::Codec *oldCodec = opusCodec;
+	if (!acquireCodecs(config)) {
+		// not built yet. keep running with the current settings and try
+		// again at the next frame boundary.
+		pipelineStats.count(StageStats::CodecNotReady);
+		return;
+	}
+	hasNextConfig = false;
+	
+	bool direct = directSamplingRate.load(std::memory_order_relaxed) != 0;
+	bool rateChanged = !direct && config.samplingRate != opusSamplingRate;
+	std::size_t oldPrefill = outputPrefill;
+	
+	setCurrentConfig(config);
+	
+	// the codec is kept through changes of the frame size or the bit
+	// rate; libopus takes those at any frame
+	updateEncoderSettings();
+	if (opusCodec != oldCodec)
+		restartEncodeCache();
+	
+	bool latencyChanged;
+	if (rateChanged) {
+		// whatever is queued at the old rate is of no use anymore
+		selectResamplers();
+		latencyChanged = updateLatency();
+		flushCodecStage();
+	} else {
+		// everything in flight stays valid; only the prefill moves
+		latencyChanged = updateLatency();
+		for (int i = 0; i < numVariants; ++i) {
+			getOutputCorrection(i) += static_cast<std::ptrdiff_t>(outputPrefill) -
+			static_cast<std::ptrdiff_t>(oldPrefill);
+		}
+	}
+	
+	if (latencyChanged) {
+		// posting the message may lock, but this only happens when the
+		// user changes a setting that affects the delay
+		RealtimeSafety::ScopedAllow allow;
+		triggerAsyncUpdate();
+	}
+	
+	numConfigChangesApplied.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RoundTripOpusAudioProcessor::flushCodecStage()
+{
+	// start over as prepareToPlay would, except that some input may
+	// already have been taken in with its output still owed
+	fifo2->clear();
+	fifo3->clear();
+	for (int i = 1; i < numVariants; ++i) {
+		variants[i - 1]->input->clear();
+		variants[i - 1]->decoded->clear();
+	}
+	for (int i = 0; i < numVariants; ++i) {
+		getOutputCorrection(i) = static_cast<std::ptrdiff_t>(outputPrefill) +
+		pipelineBalance -
+		static_cast<std::ptrdiff_t>(fifo1->getNumberOfSamplesDequeueable() +
+									getOutputFifo(i).getNumberOfSamplesDequeueable());
+	}
 }
 
 //==============================================================================
@@ -308,33 +767,84 @@ const String RoundTripOpusAudioProcessor::getName() const
 
 int RoundTripOpusAudioProcessor::getNumParameters()
 {
-    return 3; // hide last two
+	return numHostParameters;
 }
 
 float RoundTripOpusAudioProcessor::getParameter (int index)
 {
-	switch ((Parameter)index) {
+	if (index < 0 || index >= numHostParameters)
+		return 0.0f;
+	return getParameterValue(hostParameters[index]);
+}
+
+void RoundTripOpusAudioProcessor::setParameter (int index, float newValue)
+{
+	if (index < 0 || index >= numHostParameters)
+		return;
+	setParameterValue(hostParameters[index], newValue);
+}
+
+float RoundTripOpusAudioProcessor::getParameterValue (Parameter parameter)
+{
+	const CodecConfig config = hostConfig.load();
+	
+	switch (parameter) {
 		case Parameter::SamplingRate:
-			return opusSamplingRate / 48000.f;
+			return config.samplingRate / 48000.f;
 		case Parameter::FrameSize:
-			return opusFrameSizeTime / 600.f;
+			return getFrameSizeParameterValue(config.frameSizeTime / 10.f);
 		case Parameter::Application:
-			return (float)opusApplication / 2.f;
+			return (float)config.application / 2.f;
 		case Parameter::Bitrate:
-			return opusBitRate / 512000.f;
+			return config.bitRate / 512000.f;
 		case Parameter::Signal:
-			return (float)opusSignal / 2.f;
+			return (float)config.signal / 2.f;
+		case Parameter::Complexity:
+			return config.complexity / 10.f;
+		case Parameter::AdaptiveComplexity:
+			return config.adaptiveComplexity ? 1.f : 0.f;
+		case Parameter::MinComplexity:
+			return config.minComplexity / 10.f;
+		case Parameter::MaxComplexity:
+			return config.maxComplexity / 10.f;
+		case Parameter::CurrentComplexity:
+			return encoderComplexity.load(std::memory_order_relaxed) / 10.f;
+		case Parameter::DeadlineMisses:
+			// the text has the actual count
+			return jmin(complexityGovernor.getNumDeadlineMisses(),
+						(std::uint64_t)1000) / 1000.f;
+		case Parameter::ResamplerQuality:
+			return (float)config.resamplerQuality / 3.f;
+		case Parameter::LowLatency:
+			return config.lowLatency ? 1.f : 0.f;
+		case Parameter::Dtx:
+			return config.dtx ? 1.f : 0.f;
+		case Parameter::WorkerThread:
+			return config.workerThread ? 1.f : 0.f;
+		case Parameter::WorkerTakeover:
+			return config.workerTakeover ? 1.f : 0.f;
+		case Parameter::NumVariants:
+			return (config.numVariants - 1) / (float)(maxNumVariants - 1);
+		case Parameter::ListenVariant:
+			return listenVariant.load() / (float)(maxNumVariants - 1);
+		case Parameter::BitrateB:
+		case Parameter::BitrateC:
+		case Parameter::BitrateD:
+			return config.variants[getVariantOfParameter(parameter) - 1].bitRate / 512000.f;
+		case Parameter::FrameSizeB:
+		case Parameter::FrameSizeC:
+		case Parameter::FrameSizeD:
+			return getFrameSizeParameterValue
+			(config.variants[getVariantOfParameter(parameter) - 1].frameSizeTime / 10.f);
 	}
     return 0.0f;
 }
 
-void RoundTripOpusAudioProcessor::setParameter (int index, float newValue)
+void RoundTripOpusAudioProcessor::setParameterValue (Parameter parameter, float newValue)
 {
-	std::lock_guard<std::mutex> lock(objLock);
-	
 	int rounded = roundFloatToInt(newValue);
 	
-	switch ((Parameter)index) {
+	switch (parameter) {
 		case Parameter::SamplingRate:
 			// round
 			rounded = roundFloatToInt(newValue * 48000.f);
@@ -349,10 +859,7 @@ void RoundTripOpusAudioProcessor::setParameter (int index, float newValue)
 			} else {
 				rounded = 48000;
 			}
-			if (rounded != opusSamplingRate) {
-				opusSamplingRate = rounded;
-				invalidateOpusCodec();
-			}
+			hostConfig.samplingRate = rounded;
 			break;
 		case Parameter::Application:
 			rounded = roundFloatToInt(newValue * 2.f);
@@ -360,8 +867,7 @@ void RoundTripOpusAudioProcessor::setParameter (int index, float newValue)
 				case (int)Application::Audio:
 				case (int)Application::VoiceOverIP:
 				case (int)Application::LowDelay:
-					opusApplication = (Application)rounded;
-					invalidateOpusCodec();
+					hostConfig.application = (Application)rounded;
 					break;
 				default:
 					// invalid value
@@ -369,12 +875,19 @@ void RoundTripOpusAudioProcessor::setParameter (int index, float newValue)
 			}
 			break;
 		case Parameter::Bitrate:
+		case Parameter::BitrateB:
+		case Parameter::BitrateC:
+		case Parameter::BitrateD:
 			rounded = roundFloatToInt(newValue * 512000.f);
 			if (rounded < 600)
 				rounded = 600;
 			if (rounded > 512000)
 				rounded = 512000;
-			opusBitRate = rounded;
+			if (int variant = getVariantOfParameter(parameter)) {
+				hostConfig.variants[variant - 1].bitRate = rounded;
+			} else {
+				hostConfig.bitRate = rounded;
+			}
 			break;
 		case Parameter::Signal:
 			rounded = roundFloatToInt(newValue * 2.f);
@@ -382,39 +895,110 @@ void RoundTripOpusAudioProcessor::setParameter (int index, float newValue)
 				case (int)Signal::Auto:
 				case (int)Signal::Voice:
 				case (int)Signal::Music:
-					opusSignal = (Signal)rounded;
+					hostConfig.signal = (Signal)rounded;
 					break;
 				default:
 					// invalid value
 					break;
 			}
 			break;
+		case Parameter::Complexity:
+			hostConfig.complexity = jlimit(0, 10, roundFloatToInt(newValue * 10.f));
+			break;
+		case Parameter::AdaptiveComplexity:
+			hostConfig.adaptiveComplexity = newValue >= 0.5f;
+			break;
+		case Parameter::MinComplexity:
+			hostConfig.minComplexity = jlimit(0, 10, roundFloatToInt(newValue * 10.f));
+			break;
+		case Parameter::MaxComplexity:
+			hostConfig.maxComplexity = jlimit(0, 10, roundFloatToInt(newValue * 10.f));
+			break;
+		case Parameter::CurrentComplexity:
+		case Parameter::DeadlineMisses:
+			// read-only
+			return;
 		case Parameter::FrameSize:
-			newValue *= 60.f;
-			if (newValue < 4.f) {
-				rounded = 25;
-			} else if (newValue < 7.5f) {
-				rounded = 50;
-			} else if (newValue < 15.f) {
-				rounded = 100;
-			} else if (newValue < 30.f) {
-				rounded = 200;
-			} else if (newValue < 40.f) {
-				rounded = 400;
+		case Parameter::FrameSizeB:
+		case Parameter::FrameSizeC:
+		case Parameter::FrameSizeD:
+			rounded = roundFloatToInt(getFrameSizeTime(newValue) * 10.f);
+			if (int variant = getVariantOfParameter(parameter)) {
+				hostConfig.variants[variant - 1].frameSizeTime = rounded;
 			} else {
-				rounded = 600;
+				hostConfig.frameSizeTime = rounded;
 			}
-			if (rounded != opusFrameSizeTime) {
-				opusFrameSizeTime = rounded;
-				invalidateOpusCodec();
+			break;
+		case Parameter::ResamplerQuality:
+			rounded = roundFloatToInt(newValue * 3.f);
+			switch (rounded) {
+				case (int)ResamplerQuality::Low:
+				case (int)ResamplerQuality::Medium:
+				case (int)ResamplerQuality::High:
+				case (int)ResamplerQuality::LibSampleRate:
+					hostConfig.resamplerQuality = (ResamplerQuality)rounded;
+					break;
+				default:
+					// invalid value
+					break;
 			}
 			break;
+		case Parameter::LowLatency:
+			hostConfig.lowLatency = newValue >= 0.5f;
+			break;
+		case Parameter::Dtx:
+			hostConfig.dtx = newValue >= 0.5f;
+			break;
+		case Parameter::WorkerThread:
+			hostConfig.workerThread = newValue >= 0.5f;
+			break;
+		case Parameter::WorkerTakeover:
+			hostConfig.workerTakeover = newValue >= 0.5f;
+			break;
+		case Parameter::NumVariants:
+			rounded = roundFloatToInt(newValue * (maxNumVariants - 1));
+			hostConfig.numVariants = jlimit(1, (int)maxNumVariants, rounded + 1);
+			break;
+		case Parameter::ListenVariant:
+			// nothing to hand over; the audio thread reads it directly
+			rounded = roundFloatToInt(newValue * (maxNumVariants - 1));
+			listenVariant = jlimit(0, (int)maxNumVariants - 1, rounded);
+			return;
 	}
+	
+	publishConfig();
+}
+
+float RoundTripOpusAudioProcessor::getFrameSizeParameterValue(float frameSizeTime)
+{
+	// the plain value where it works, the middle of the range if not
+	float value = frameSizeTime / 60.f;
+	for (int i = 0; i < numFrameSizeRanges; ++i) {
+		if (roundFloatToInt(frameSizeTime * 10.f) != frameSizeRanges[i].frameSizeTime)
+			continue;
+		if (getFrameSizeTime(value) == frameSizeTime)
+			return value;
+		float end = i + 1 < numFrameSizeRanges ? frameSizeRanges[i + 1].start : 60.f;
+		return (frameSizeRanges[i].start + end) * 0.5f / 60.f;
+	}
+	return -1.f;
+}
+
+float RoundTripOpusAudioProcessor::getFrameSizeTime(float parameterValue)
+{
+	int frameSizeTime = frameSizeRanges[0].frameSizeTime;
+	for (const auto &range: frameSizeRanges) {
+		if (parameterValue * 60.f >= range.start)
+			frameSizeTime = range.frameSizeTime;
+	}
+	return frameSizeTime / 10.f;
 }
 
 const String RoundTripOpusAudioProcessor::getParameterName (int index)
 {
-	switch ((Parameter)index) {
+	if (index < 0 || index >= numHostParameters)
+		return String();
+	switch (hostParameters[index]) {
 		case Parameter::SamplingRate:
 			return "Sampling Rate";
 		case Parameter::FrameSize:
@@ -425,19 +1009,62 @@ const String RoundTripOpusAudioProcessor::getParameterName (int index)
 			return "Bit Rate";
 		case Parameter::Signal:
 			return "Signal";
+		case Parameter::Complexity:
+			return "Complexity";
+		case Parameter::AdaptiveComplexity:
+			return "Adaptive Complexity";
+		case Parameter::MinComplexity:
+			return "Min Complexity";
+		case Parameter::MaxComplexity:
+			return "Max Complexity";
+		case Parameter::CurrentComplexity:
+			return "Current Complexity";
+		case Parameter::DeadlineMisses:
+			return "Deadline Misses";
+		case Parameter::ResamplerQuality:
+			return "Resampler";
+		case Parameter::LowLatency:
+			return "Low Latency";
+		case Parameter::Dtx:
+			return "DTX";
+		case Parameter::WorkerThread:
+			return "Worker Thread";
+		case Parameter::WorkerTakeover:
+			return "Worker Takeover";
+		case Parameter::NumVariants:
+			return "Variants";
+		case Parameter::ListenVariant:
+			return "Listen";
+		case Parameter::BitrateB:
+			return "B Bit Rate";
+		case Parameter::FrameSizeB:
+			return "B Frame Size";
+		case Parameter::BitrateC:
+			return "C Bit Rate";
+		case Parameter::FrameSizeC:
+			return "C Frame Size";
+		case Parameter::BitrateD:
+			return "D Bit Rate";
+		case Parameter::FrameSizeD:
+			return "D Frame Size";
 	}
     return String();
 }
 
 const String RoundTripOpusAudioProcessor::getParameterText (int index)
 {
-	switch ((Parameter)index) {
+	if (index < 0 || index >= numHostParameters)
+		return String();
+	
+	const CodecConfig config = hostConfig.load();
+	
+	switch (hostParameters[index]) {
 		case Parameter::SamplingRate:
-			return String::formatted("%d", opusSamplingRate);
+			return String::formatted("%d", config.samplingRate);
 		case Parameter::FrameSize:
-			return String::formatted("%.2f", opusFrameSizeTime / 10.f);
+			return String::formatted("%.2f", config.frameSizeTime / 10.f);
 		case Parameter::Application:
-			switch (opusApplication) {
+			switch (config.application) {
 				case Application::Audio:
 					return "Audio";
 				case Application::LowDelay:
@@ -447,9 +1074,9 @@ const String RoundTripOpusAudioProcessor::getParameterText (int index)
 			}
 			return "Unknown";
 		case Parameter::Bitrate:
-			return String::formatted("%d", opusBitRate);
+			return String::formatted("%d", config.bitRate);
 		case Parameter::Signal:
-			switch (opusSignal) {
+			switch (config.signal) {
 				case Signal::Auto:
 					return "Auto";
 				case Signal::Voice:
@@ -458,10 +1085,66 @@ const String RoundTripOpusAudioProcessor::getParameterText (int index)
 					return "Music";
 			}
 			return "Unknown";
+		case Parameter::Complexity:
+			return String::formatted("%d", config.complexity);
+		case Parameter::AdaptiveComplexity:
+			return config.adaptiveComplexity ? "On" : "Off";
+		case Parameter::MinComplexity:
+			return String::formatted("%d", config.minComplexity);
+		case Parameter::MaxComplexity:
+			return String::formatted("%d", config.maxComplexity);
+		case Parameter::CurrentComplexity:
+			return String::formatted("%d", encoderComplexity.load(std::memory_order_relaxed));
+		case Parameter::DeadlineMisses:
+			return String::formatted("%llu", (unsigned long long)
+									 complexityGovernor.getNumDeadlineMisses());
+		case Parameter::ResamplerQuality:
+			switch (config.resamplerQuality) {
+				case ResamplerQuality::Low:
+					return "Low";
+				case ResamplerQuality::Medium:
+					return "Medium";
+				case ResamplerQuality::High:
+					return "High";
+				case ResamplerQuality::LibSampleRate:
+					return "libsamplerate";
+			}
+			return "Unknown";
+		case Parameter::LowLatency:
+			return config.lowLatency ? "On" : "Off";
+		case Parameter::Dtx:
+			return config.dtx ? "On" : "Off";
+		case Parameter::WorkerThread:
+			return config.workerThread ? "On" : "Off";
+		case Parameter::WorkerTakeover:
+			return config.workerTakeover ? "On" : "Off";
+		case Parameter::NumVariants:
+			return String::formatted("%d", config.numVariants);
+		case Parameter::ListenVariant:
+			return variantNames[listenVariant.load()];
+		case Parameter::BitrateB:
+		case Parameter::BitrateC:
+		case Parameter::BitrateD:
+			return String::formatted("%d", config.variants
+									 [getVariantOfParameter(hostParameters[index]) - 1].bitRate);
+		case Parameter::FrameSizeB:
+		case Parameter::FrameSizeC:
+		case Parameter::FrameSizeD:
+			return String::formatted("%.2f", config.variants
+									 [getVariantOfParameter(hostParameters[index]) - 1].frameSizeTime / 10.f);
 	}
     return String();
 }
 
+bool RoundTripOpusAudioProcessor::isParameterAutomatable (int index) const
+{
+	// the read-only ones only report what the audio thread is doing
+	if (index < 0 || index >= numHostParameters)
+		return false;
+	return hostParameters[index] != Parameter::CurrentComplexity &&
+	hostParameters[index] != Parameter::DeadlineMisses;
+}
+
 const String RoundTripOpusAudioProcessor::getInputChannelName (int channelIndex) const
 {
     return String (channelIndex + 1);
@@ -502,12 +1185,18 @@ bool RoundTripOpusAudioProcessor::producesMidi() const
 
 bool RoundTripOpusAudioProcessor::silenceInProducesSilenceOut() const
 {
-    return false;
+	// once the tail is through. silent slices don't even get as far as
+	// the codec then; see skipSilentSlice. a replay doesn't listen to
+	// the input, though.
+	return !isReplaying();
 }
 
 double RoundTripOpusAudioProcessor::getTailLengthSeconds() const
 {
-    return 0.0;
+	// the input keeps coming out for this long after it stops
+	if (inputSamplingRate <= 0.0)
+		return 0.0;
+	return pipelineLatency.load() / inputSamplingRate;
 }
 
 int RoundTripOpusAudioProcessor::getNumPrograms()
@@ -537,37 +1226,250 @@ void RoundTripOpusAudioProcessor::changeProgramName (int index, const String& ne
 //==============================================================================
 void RoundTripOpusAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
+	// the worker owns the pipeline while it runs
+	codecWorker.stop();
+	for (auto &variant: variants)
+		variant->worker.stop();
 	invalidateSrc();
 	
-	for (auto &s: srcState) {
-		s = src_new(SRC_SINC_FASTEST, 1, nullptr);
+	int numChannels = jlimit(1, (int)maxNumChannels, getNumInputChannels());
+	
+	// the audio thread isn't running, so start right away with the latest
+	// parameters instead of picking them up at the first frame boundary
+	hostConfigVersionSeen = hostConfigVersion.load(std::memory_order_acquire);
+	const CodecConfig config = hostConfig.load();
+	configChanges.clear();
+	hasOutgoingConfig = false;
+	hasNextConfig = false;
+	resamplerQuality = config.resamplerQuality;
+	threaded = config.workerThread;
+	takeover = config.workerTakeover;
+	numVariants = config.numVariants;
+	
+	// if Opus can run at the host rate, let it do the rate conversion
+	// itself (the decoder always outputs at the rate it was created with,
+	// and the encoder is limited with OPUS_SET_MAX_BANDWIDTH)
+	int hostRate = roundDoubleToInt(sampleRate);
+	int direct = 0;
+	if (hostRate == sampleRate) {
+		for (int rate: opusSamplingRates) {
+			if (rate == hostRate)
+				direct = hostRate;
+		}
 	}
+	directSamplingRate = direct;
+	
+	// the FIFOs carry interleaved frames (in Vorbis channel order), so one
+	// multichannel converter per direction does all channels at once
+	for (int i = 0; i < numOpusSamplingRates && !direct; ++i) {
+		inputResamplers[i] = Resampler::create
+		(hostRate, opusSamplingRates[i], numChannels, resamplerQuality);
+		outputResamplers[i] = Resampler::create
+		(opusSamplingRates[i], hostRate, numChannels, resamplerQuality);
+		for (int j = 1; j < numVariants; ++j) {
+			variants[j - 1]->outputResamplers[i] = Resampler::create
+			(opusSamplingRates[i], hostRate, numChannels, resamplerQuality);
+		}
+	}
+	srcNumChannels = numChannels;
+	
+	// size everything for the worst case so that processBlock never has to
+	// allocate: host blocks of up to maxBlockSize (larger ones get split),
+	// the longest Opus frame (60ms) at the highest rate the codec can run
+	// at, and whatever the rate conversion makes of those
+	maxBlockSize = static_cast<std::size_t>(std::max(samplesPerBlock, 1));
+	
+	const double maxFrameTime = 0.06;
+	const std::size_t margin = 256; // resampler granularity, rounding
+	std::size_t maxOpusFrame = static_cast<std::size_t>
+	(std::ceil(maxFrameTime * getCodecSamplingRate(48000)));
+	std::size_t maxHostFrame = static_cast<std::size_t>
+	(std::ceil(maxFrameTime * sampleRate));
+	std::size_t maxOpusBlock = static_cast<std::size_t>
+	(std::ceil(maxBlockSize * getCodecSamplingRate(48000) / sampleRate));
+	
+	// on the direct path fifo1 and fifo4 hold whole Opus frames
+	fifo1->setCapacity(maxBlockSize + (direct ? maxHostFrame : 0) + margin,
+					   numChannels);
+	fifo2->setCapacity(maxOpusBlock + maxOpusFrame + margin, numChannels);
+	fifo3->setCapacity(maxOpusFrame * 2 + margin, numChannels);
+	fifo4->setCapacity(maxBlockSize + maxHostFrame * 2 + margin, numChannels);
+	for (int i = 1; i < numVariants; ++i) {
+		Variant &variant = *variants[i - 1];
+		variant.input->setCapacity(std::max(fifo1->getCapacity(), fifo2->getCapacity()),
+								   numChannels);
+		variant.decoded->setCapacity(fifo3->getCapacity(), numChannels);
+		variant.output->setCapacity(fifo4->getCapacity(), numChannels);
+		variant.packet.resize(maxPacketBytesPerStream * numChannels);
+	}
+	
+	for (std::size_t i = 0; i < maxNumChannels; ++i)
+		inputBuffer[i].assign(i < (std::size_t)numChannels ? maxBlockSize : 0, 0.f);
+	
+	// the rings have to ride out the worker falling a few blocks behind,
+	// and the output one holds the prefill on top of that
+	if (threaded) {
+		inputRing.setCapacity(maxBlockSize * 4 + maxHostFrame, numChannels);
+		outputRing.setCapacity(maxBlockSize * 5 + maxHostFrame * 3 + margin,
+							   numChannels);
+	}
+	ringCorrection = 0;
+	
+	// one packet of every stream at the highest bit rate
+	opusOutputBuffer.resize(maxPacketBytesPerStream * numChannels);
+	replayBuffer.resize(maxReplayPacket * numChannels);
+	
+	// the cache waits on the disk, which only an offline render can
+	// afford. catching up takes a couple of the longest frames.
+	encodeCache = isNonRealtime() ? nextEncodeCache : nullptr;
+	cacheHistory.resize(encodeCache ? maxOpusFrame * 2 * numChannels : 0);
+	cacheScratch.resize(encodeCache ? maxOpusFrame * numChannels : 0);
 	
 	inputSamplingRate = sampleRate;
+	
+	// what a callback has for everything, encoding included
+	complexityGovernor.setDeadline(static_cast<StageStats::Ticks>
+	(maxBlockSize / sampleRate * 1.e9 * StageStats::getTicksPerNanosecond()));
+	
+	// the channel count is fixed from here on, so this is the place to
+	// block on the codec if it changed
+	opusNumChannels = getNumInputChannels();
+	setCurrentConfig(config);
+	for (int i = 0; i < maxNumVariants; ++i) {
+		OpusCodecPool::Codec *&codec = i ? variants[i - 1]->codec : opusCodec;
+		if (i >= numVariants) {
+			codecPool->release(codec);
+			codec = nullptr;
+			continue;
+		}
+		auto key = makeCodecKey(config, opusNumChannels, i);
+		if (!codec || codec->key != key) {
+			codecPool->release(codec);
+			codec = codecPool->acquireWait(key);
+		} else if (codec) {
+			codec->encoderCtl(OPUS_RESET_STATE);
+			codec->decoderCtl(OPUS_RESET_STATE);
+		}
+	}
+	
+	// start from silence with the output a prefill ahead, so that the
+	// delay is the same every time and matches what the host is told
+	fifo1->clear();
+	fifo2->clear();
+	fifo3->clear();
+	fifo4->clear();
+	for (int i = 1; i < numVariants; ++i) {
+		Variant &variant = *variants[i - 1];
+		variant.input->clear();
+		variant.decoded->clear();
+		variant.output->clear();
+		variant.state = Variant::Idle;
+	}
+	variantsFed = 0;
+	selectResamplers();
+	updateLatency();
+	pipelineBalance = 0;
+	silentInputLength = 0;
+	silentOutputLength = 0;
+	
+	restartEncodeCache();
+	
+	// a replay under way starts over at the next run
+	replay = nullptr;
+	replayInUse = nullptr;
+	pipelineInputIndex = 0;
+	inputIndex = 0;
+	hasAnchor = false;
+	for (int i = 0; i < numVariants; ++i) {
+		getOutputCorrection(i) = static_cast<std::ptrdiff_t>(outputPrefill);
+		correctOutput(getOutputFifo(i), getOutputCorrection(i));
+	}
+	
+	cancelPendingUpdate();
+	setLatencySamples(pipelineLatency.load());
+	
+	for (int i = 1; i < numVariants; ++i) {
+		Variant &variant = *variants[i - 1];
+		variant.worker.start([this, &variant] { runVariantIfQueued(variant); });
+	}
+	if (threaded) {
+		moveToOutputRing();
+		codecWorker.start([this] { processWorker(false); });
+	}
 }
 
 void RoundTripOpusAudioProcessor::releaseResources()
 {
-    // When playback stops, you can use this as an opportunity to free up any
-    // spare memory, etc.
+	// nothing should be left waiting for a block that isn't coming
+	codecWorker.stop();
+	for (auto &variant: variants)
+		variant->worker.stop();
 }
 
 void RoundTripOpusAudioProcessor::processBlock (AudioSampleBuffer& buffer, MidiBuffer& midiMessages)
 {
-	std::lock_guard<std::mutex> lock(objLock);
+	// nothing below may allocate or lock; see RealtimeSafety
+	RealtimeSafety::ScopedAudioThread audioThread;
+	
+	std::size_t numSamples = buffer.getNumSamples();
+	std::size_t numChannels = std::min(getNumInputChannels(), maxNumChannels);
+	
+	if (numChannels != srcNumChannels) {
+		// prepareToPlay wasn't called for this bus width
+		buffer.clear();
+		return;
+	}
 	
-	// make sure number of channel matches
+	// a replay follows the host around the timeline. nothing to follow
+	// otherwise, and jumps made in the meantime go unnoticed, so the
+	// next replay starts from a fresh anchor.
+	AudioPlayHead::CurrentPositionInfo position;
+	bool hasPosition = false;
+	if (replayRequest.load(std::memory_order_relaxed)) {
+		AudioPlayHead *playHead = getPlayHead();
+		hasPosition = playHead && playHead->getCurrentPosition(position);
+	} else {
+		hasAnchor = false;
+	}
+	
+	// everything is sized for maxBlockSize; larger blocks are taken in
+	// several passes
+	for (std::size_t start = 0; start < numSamples; start += maxBlockSize) {
+		std::size_t sliceSize = std::min(maxBlockSize, numSamples - start);
+		if (hasPosition) {
+			noteTimeline(position.timeInSamples + static_cast<std::int64_t>(start),
+						 position.isPlaying);
+		}
+		sendConfigChange();
+		if (skipSilentSlice(buffer, start, sliceSize))
+			continue;
+		if (threaded) {
+			processSliceThreaded(buffer, start, sliceSize);
+		} else {
+			processSlice(buffer, start, sliceSize);
+		}
+		if (isSilent(buffer, start, sliceSize, settledThreshold)) {
+			silentOutputLength += static_cast<std::int64_t>(sliceSize);
+		} else {
+			silentOutputLength = 0;
+		}
+	}
+}
+
+void RoundTripOpusAudioProcessor::updateCodecState()
+{
+	// make sure number of channel matches. the host is supposed to call
+	// prepareToPlay first, but if it doesn't, swap in a matching codec
+	// once the pool has built one.
 	if (getNumInputChannels() != opusNumChannels) {
 		opusNumChannels = getNumInputChannels();
-		invalidateOpusCodec();
+		if (!hasNextConfig) {
+			nextConfig = getCurrentConfig();
+			hasNextConfig = true;
+		}
 	}
-	createOpusCodec();
 	
-	opusFrameSize = opusFrameSizeTime * opusSamplingRate / 10000;
-	
-	// set encoder parameters
-	opus_encoder_ctl(opusEncoder, OPUS_SET_BITRATE(opusBitRate));
-	opus_encoder_ctl(opusEncoder, OPUS_SET_COMPLEXITY(opusComplexity));
+	updateEncoderSettings();
 	
 	int signalType;
 	switch (opusSignal) {
@@ -581,198 +1483,969 @@ void RoundTripOpusAudioProcessor::processBlock (AudioSampleBuffer& buffer, MidiB
 			signalType = OPUS_SIGNAL_MUSIC;
 			break;
 	}
-	//opus_encoder_ctl(opusEncoder, OPUS_SET_SIGNAL(signalType)); // this crashes encoder
+	//opusCodec->encoderCtl(OPUS_SET_SIGNAL(signalType)); // this crashes encoder
+}
 
-	std::size_t numSamples = buffer.getNumSamples();
-	std::size_t numChannels = getNumInputChannels();
+void RoundTripOpusAudioProcessor::updateEncoderSettings()
+{
+	// offline there's no deadline to keep, so the governor gives way to
+	// its upper bound
+	int complexity = complexityGovernor.getComplexity();
+	if (opusAdaptiveComplexity && isNonRealtime())
+		complexity = std::max(opusMinComplexity, opusMaxComplexity);
+	encoderComplexity.store(complexity, std::memory_order_relaxed);
+	
+	if (opusCodec && opusCodec->key.numChannels == opusNumChannels) {
+		opusCodec->setBitRate(opusBitRate);
+		opusCodec->setComplexity(complexity);
+		opusCodec->setMaxBandwidth(getOpusBandwidth(opusSamplingRate));
+		opusCodec->setDtx(opusDtx);
+	}
+}
+
+bool RoundTripOpusAudioProcessor::isSilent(const AudioSampleBuffer &buffer,
+										   std::size_t offset,
+										   std::size_t numSamples,
+										   float threshold) const
+{
+	// getMagnitude goes through FloatVectorOperations, so this is a
+	// vectorised scan
+	for (std::size_t i = 0; i < srcNumChannels; ++i) {
+		if (buffer.getMagnitude(static_cast<int>(i), static_cast<int>(offset),
+								static_cast<int>(numSamples)) > threshold) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool RoundTripOpusAudioProcessor::skipSilentSlice(AudioSampleBuffer &buffer,
+												  std::size_t offset,
+												  std::size_t numSamples)
+{
+	// audio thread. the input goes in before the check and the output is
+	// checked after the slice has run, so both only count full slices.
+	// only digital silence counts as silent input; near-silence such as
+	// room tone still goes through the codec (that's what DTX is for).
+	if (!isSilent(buffer, offset, numSamples, 0.f)) {
+		silentInputLength = 0;
+		return false;
+	}
+	
+	// the input that's still in flight has to be silent, and what came
+	// out last has to have settled (the decoder and the resamplers fade
+	// out rather than stop at exactly zero). then leaving
+	// the pipeline where it is and picking up later where it was brings
+	// nothing but silence forward, and the delay stays as it was.
+	std::int64_t latency = pipelineLatency.load(std::memory_order_relaxed);
+	bool drained = silentInputLength >= latency && silentOutputLength >= latency;
+	silentInputLength += static_cast<std::int64_t>(numSamples);
+	
+	// a replay doesn't listen to the input, and a capture wants every
+	// frame
+	if (!drained || replayRequest.load(std::memory_order_relaxed) ||
+		capture.isCapturing()) {
+		return false;
+	}
 	
+	for (std::size_t i = 0; i < srcNumChannels; ++i) {
+		buffer.clear(static_cast<int>(i), static_cast<int>(offset),
+					 static_cast<int>(numSamples));
+	}
+	silentOutputLength += static_cast<std::int64_t>(numSamples);
+	audioStats.count(StageStats::SilenceSkipped);
+	return true;
+}
+
+void RoundTripOpusAudioProcessor::processSlice(AudioSampleBuffer &buffer,
+											   std::size_t offset,
+											   std::size_t numSamples)
+{
+	std::size_t numChannels = srcNumChannels;
+	const int *channelOrder = vorbisChannelOrder[numChannels - 1];
+	
+	StageStats::Ticks copyStart = StageStats::now();
 	for (std::size_t i = 0; i < numChannels; ++i) {
-		inputBuffer[i].resize(numSamples);
 		std::memcpy(inputBuffer[i].data(),
-					buffer.getReadPointer(i),
+					buffer.getReadPointer(i) + offset,
 					numSamples * sizeof(float));
-		std::memset(buffer.getWritePointer(i), 0,
+		std::memset(buffer.getWritePointer(i) + offset, 0,
 					numSamples * sizeof(float));
 	}
 	
-	std::size_t writeIndex = 0;
+	// the FIFOs are sized so that a slice always goes all the way through
+	// in one pass. if one ever runs out anyway, the output is padded or
+	// trimmed later by the same amount so that the delay doesn't drift.
+	AudioFifo::ConstBufferSet inputBufferSet;
+	inputBufferSet.fill(nullptr);
+	for (std::size_t j = 0; j < numChannels; ++j) {
+		inputBufferSet[channelOrder[j]] = inputBuffer[j].data();
+	}
+	std::size_t taken = fifo1->enqueue(inputBufferSet, numSamples);
+	inputIndex += taken;
+	pipelineInputIndex += taken;
+	for (int i = 0; i < numVariants; ++i)
+		getOutputCorrection(i) += static_cast<std::ptrdiff_t>(numSamples - taken);
+	pipelineBalance += static_cast<std::ptrdiff_t>(numSamples);
+	if (taken < numSamples)
+		audioStats.count(StageStats::Overrun);
+	StageStats::Ticks copyTicks = StageStats::now() - copyStart;
+	
+	runPipeline();
+	
+	// an underrun leaves silence in the buffer; readOutput skips as much
+	// later
+	copyStart = StageStats::now();
+	std::size_t stride = fifo4->getChannelStride();
+	std::size_t written = readOutput(getListenedVariant(), numSamples,
+									 [&](const float *frames, std::size_t count) {
+		for (std::size_t j = 0; j < numChannels; ++j) {
+			copyWithStride(buffer.getWritePointer(j) + offset,
+						   frames + channelOrder[j],
+						   count, 1, stride);
+		}
+		return count;
+	});
+	pipelineBalance -= static_cast<std::ptrdiff_t>(numSamples);
+	if (written < numSamples)
+		audioStats.count(StageStats::Underrun);
+	audioStats.add(StageStats::FifoCopy, copyTicks + (StageStats::now() - copyStart));
+}
+
+int RoundTripOpusAudioProcessor::getListenedVariant() const
+{
+	return std::min(listenVariant.load(std::memory_order_relaxed),
+					numVariants - 1);
+}
+
+template <class F>
+std::size_t RoundTripOpusAudioProcessor::readOutput(int listen, std::size_t numSamples,
+													F fn)
+{
+	// every output moves on by the same amount, so that switching to
+	// another variant keeps the timing. the heard one decides how far if
+	// the others run short (or long); that's made up for like an underrun.
+	std::size_t taken = getOutputFifo(listen).dequeueSingleCustom
+	([&](const AudioFifo::ConstBufferSet &frames, std::size_t samples) {
+		return fn(frames[0], std::min(samples, numSamples));
+	});
+	getOutputCorrection(listen) -= static_cast<std::ptrdiff_t>(numSamples - taken);
 	
-	opusInputBuffer.resize(opusFrameSize * opusNumChannels * 4);
-	opusOutputBuffer.resize(65536);
+	for (int i = 0; i < numVariants; ++i) {
+		if (i == listen)
+			continue;
+		std::size_t skipped = getOutputFifo(i).dequeueSingleCustom
+		([&](const AudioFifo::ConstBufferSet &, std::size_t samples) {
+			return std::min(samples, taken);
+		});
+		getOutputCorrection(i) -= static_cast<std::ptrdiff_t>(taken - skipped);
+	}
+	return taken;
+}
+
+void RoundTripOpusAudioProcessor::processSliceThreaded(AudioSampleBuffer &buffer,
+													   std::size_t offset,
+													   std::size_t numSamples)
+{
+	std::size_t numChannels = srcNumChannels;
+	const int *channelOrder = vorbisChannelOrder[numChannels - 1];
 	
-	std::size_t i = 0;
+	// input first, since the output goes to the same buffer
+	StageStats::Ticks copyStart = StageStats::now();
+	auto writeInput = [&](std::size_t start) {
+		return inputRing.write([&](float *frames, std::size_t maxFrames) {
+			std::size_t count = std::min(numSamples - start, maxFrames);
+			for (std::size_t j = 0; j < numChannels; ++j) {
+				copyWithStride(frames + channelOrder[j],
+							   buffer.getReadPointer(j) + offset + start,
+							   count, numChannels, 1);
+			}
+			return count;
+		});
+	};
+	std::size_t taken = writeInput(0);
+	StageStats::Ticks copyTicks = StageStats::now() - copyStart;
 	
-	for (; i < numSamples || writeIndex < numSamples;) {
-		bool stall = true;
+	if (isNonRealtime()) {
+		// rendering offline, faster than the worker would keep up with.
+		// nothing gets dropped: once a pass has emptied the ring, the
+		// rest of the slice fits.
+		processWorker(true);
+		if (taken < numSamples) {
+			copyStart = StageStats::now();
+			taken += writeInput(taken);
+			copyTicks += StageStats::now() - copyStart;
+			processWorker(true);
+		}
+		inputIndex += taken;
+	} else {
+		inputIndex += taken;
+		codecWorker.wake();
 		
-		if (!resolvingOverrun ||
-			fifo1->getNumberOfSamplesEnqueueable() > 2048) {
-			resolvingOverrun = false;
-			AudioFifo::ConstBufferSet inputBufferSet;
-			for (std::size_t j = 0; j < 2; ++j) {
-				inputBufferSet[j] = j < numChannels ?
-				inputBuffer[j].data() + i : nullptr;
+		// the prefill gives the worker a frame's time for each pass, so
+		// a frame's encode never lands on one callback. if what's due now
+		// still isn't there (the codec threads are busy with other
+		// instances, say) it's an underrun, unless takeover is on: then
+		// the pass is done here, as far as it takes to get that, and the
+		// rest is left to the worker. that's the very spike the worker is
+		// there to avoid, so it's counted as a failure all the same. if
+		// the worker is at it right now, it's too late either way.
+		if (takeover) {
+			std::size_t ready = 0;
+			outputRing.read([&](const float *, std::size_t numFrames) {
+				ready = numFrames;
+				return static_cast<std::size_t>(0);
+			});
+			if (ready < numSamples && processWorker(false, numSamples)) {
+				audioStats.count(StageStats::Takeover);
+				codecWorker.wake();
 			}
-			auto inputSunk = fifo1->enqueue(inputBufferSet, numSamples - i);
-			i += inputSunk;
-			if (inputSunk)
-				stall = false;
-		} else if (i < numSamples) {
-			stall = false;
-			i = std::min(i + 2048, numSamples);
 		}
+	}
+	
+	copyStart = StageStats::now();
+	std::size_t written = outputRing.read([&](const float *frames, std::size_t numFrames) {
+		std::size_t count = std::min(numSamples, numFrames);
+		for (std::size_t j = 0; j < numChannels; ++j) {
+			copyWithStride(buffer.getWritePointer(j) + offset,
+						   frames + channelOrder[j],
+						   count, 1, numChannels);
+		}
+		return count;
+	});
+	for (std::size_t j = 0; j < numChannels; ++j) {
+		std::fill(buffer.getWritePointer(j) + offset + written,
+				  buffer.getWritePointer(j) + offset + numSamples, 0.f);
+	}
+	audioStats.add(StageStats::FifoCopy, copyTicks + (StageStats::now() - copyStart));
+	if (taken < numSamples)
+		audioStats.count(StageStats::Overrun);
+	if (written < numSamples)
+		audioStats.count(StageStats::Underrun);
+	
+	// the worker evens these out like processSlice does its own
+	std::ptrdiff_t correction = static_cast<std::ptrdiff_t>(numSamples - taken) -
+	static_cast<std::ptrdiff_t>(numSamples - written);
+	if (correction)
+		ringCorrection.fetch_add(correction, std::memory_order_relaxed);
+}
+
+std::size_t RoundTripOpusAudioProcessor::moveToOutputRing()
+{
+	// the ring only carries the variant heard
+	std::size_t stride = fifo4->getChannelStride();
+	int listen = getListenedVariant();
+	std::size_t available = getOutputFifo(listen).getNumberOfSamplesDequeueable();
+	std::size_t moved = outputRing.write([&](float *frames, std::size_t maxFrames) {
+		return readOutput(listen, std::min(available, maxFrames),
+						  [&](const float *fifoFrames, std::size_t count) {
+			std::copy(fifoFrames, fifoFrames + count * stride, frames);
+			return count;
+		});
+	});
+	pipelineBalance -= static_cast<std::ptrdiff_t>(moved);
+	return moved;
+}
+
+bool RoundTripOpusAudioProcessor::processWorker(bool wait, std::size_t needed)
+{
+	bool expected = false;
+	bool stalled = false;
+	while (!pipelineBusy.compare_exchange_weak(expected, true,
+												std::memory_order_acquire)) {
+		if (!wait)
+			return false;
+		expected = false;
+		stalled = true;
+		std::this_thread::yield();
+	}
+	if (stalled) {
+		// only the audio thread waits
+		audioStats.count(StageStats::Stall);
+	}
+	
+	// the same rules as on the audio thread apply here
+	RealtimeSafety::ScopedAudioThread audioThread;
+	
+	std::size_t stride = fifo1->getChannelStride();
+	for (;;) {
+		std::ptrdiff_t correction = ringCorrection.exchange(0, std::memory_order_relaxed);
+		for (int i = 0; i < numVariants; ++i)
+			getOutputCorrection(i) += correction;
+		pipelineBalance += correction;
 		
-		// input SRC
-		double inputSrcRatio = opusSamplingRate / inputSamplingRate;
-		int countLimit = 10000;
-		while (fifo1->getNumberOfSamplesDequeueableBySingleRun() &&
-			   fifo2->getNumberOfSamplesEnqueueableBySingleRun()) {
-			stall = false;
-			
-			--countLimit;
-			assert(countLimit > 0);
-			
-			fifo1->dequeueSingleCustom
-			([&](const AudioFifo::ConstBufferSet& inBuffers, std::size_t inSamples) {
-				assert(inSamples);
-				
-				fifo2->enqueueSingleCustom
-				([&](const AudioFifo::BufferSet &outBuffers, std::size_t outSamples) {
-					assert(outSamples);
-					
-					SRC_DATA src;
-					for (std::size_t i = 0; i < numChannels; ++i) {
-						src.data_in = const_cast<float*>(inBuffers[i]);
-						src.data_out = outBuffers[i];
-						src.src_ratio = inputSrcRatio;
-						src.input_frames = inSamples;
-						src.output_frames = outSamples;
-						src.input_frames_used = 0;
-						src.output_frames_gen = 0;
-						src.end_of_input = 0;
-						src_process(srcState[i], &src);
-						
-						// these value must be equal for all channels...
-						// (unless libsamplerate uses nondeterministic
-						//  process)
-						outSamples = src.output_frames_gen;
-						inSamples = src.input_frames_used;
-					}
-					return outSamples;
-				});
-				return inSamples;
+		// a slice at a time, as processBlock would hand them over
+		StageStats::Ticks copyStart = StageStats::now();
+		std::size_t room = std::min(maxBlockSize, fifo1->getNumberOfSamplesEnqueueable());
+		std::size_t taken = inputRing.read([&](const float *frames, std::size_t numFrames) {
+			std::size_t count = std::min(room, numFrames);
+			fifo1->enqueueSingleCustom
+			([&](const AudioFifo::BufferSet &fifoFrames, std::size_t) {
+				std::copy(frames, frames + count * stride, fifoFrames[0]);
+				return count;
 			});
+			return count;
+		});
+		pipelineBalance += static_cast<std::ptrdiff_t>(taken);
+		pipelineInputIndex += taken;
+		StageStats::Ticks copyTicks = StageStats::now() - copyStart;
+		
+		runPipeline();
+		
+		copyStart = StageStats::now();
+		std::size_t moved = moveToOutputRing();
+		if (taken || moved)
+			pipelineStats.add(StageStats::FifoCopy, copyTicks + (StageStats::now() - copyStart));
+		
+		if (!taken)
+			break;
+		if (needed) {
+			// the audio thread taking over; a frame is usually all it
+			// takes, and the encodes stay off the callback past that
+			std::size_t ready = 0;
+			outputRing.read([&](const float *, std::size_t numFrames) {
+				ready = numFrames;
+				return static_cast<std::size_t>(0);
+			});
+			if (ready >= needed)
+				break;
 		}
+	}
+	
+	pipelineBusy.store(false, std::memory_order_release);
+	return true;
+}
+
+void RoundTripOpusAudioProcessor::runPipeline()
+{
+	updateCodecState();
+	
+	bool direct = directSamplingRate.load(std::memory_order_relaxed) != 0;
+	bool codecUsable;
+	
+	// on the direct path Opus works on fifo1 and fifo4 itself
+	AudioFifo *opusInputFifo = direct ? fifo1.get() : fifo2.get();
+	AudioFifo *opusOutputFifo = direct ? fifo4.get() : fifo3.get();
+	
+	// a replay stands in for the input SRC and the encoder
+	acquireReplay();
+	if (replay) {
+		runReplay(*opusOutputFifo);
+	}
+	
+	// input SRC
+	selectResamplers();
+	if (!direct && !replay && fifo1->canDequeueAtLeast(1)) {
+		ScopedStageTimer timer(pipelineStats, StageStats::InputSrc);
+		resample(inputResampler, *fifo1, *fifo2);
+	}
+	
+	// the other variants go off to the codec threads with a copy
+	if (numVariants > 1) {
+		feedVariants(*opusInputFifo);
+		startVariants();
+	}
+	
+	// Opus roundtrip
+	for (;;) {
+		// parameter changes take effect at Opus frame boundaries
+		applyPendingConfig();
+		codecUsable = opusCodec &&
+		opusCodec->key.numChannels == opusNumChannels;
 		
-		// Opus roundtrip
-		while (fifo2->canDequeueAtLeast(opusFrameSize) &&
-			   fifo3->canEnqueueAtLeast(opusFrameSize)) {
-			stall = false;
-			
-			AudioFifo::BufferSet writeBufferSet;
-			AudioFifo::ConstBufferSet readBufferSet;
-			for (std::size_t j = 0; j < 2; ++j) {
-				writeBufferSet[j] = j < numChannels ?
-				opusInputBuffer.data() + j : nullptr;
-				readBufferSet[j] = writeBufferSet[j];
-			}
-			
-			auto count = fifo2->dequeue(writeBufferSet, opusFrameSize, numChannels);
-			assert(count == opusFrameSize); (void) count;
-			
-			int encodedLen = opus_encode_float
-			(opusEncoder, opusInputBuffer.data(), opusFrameSize,
-			 opusOutputBuffer.data(), opusOutputBuffer.size());
-			if (encodedLen < 0) {
-				// error...
-				encodedLen = 0;
-			}
-			
-			int decodedSamples = opus_decode_float
-			(opusDecoder, opusOutputBuffer.data(), encodedLen,
-			 opusInputBuffer.data(), opusFrameSize * 4, 0);
-			if (decodedSamples < 0) {
-				// error...
-				decodedSamples = 0;
-			}
-			
-			// output might overrun; don't check the returned value
-			fifo3->enqueue(readBufferSet, decodedSamples, numChannels);
+		if (!codecUsable || replay ||
+			!opusInputFifo->canDequeueAtLeast(opusFrameSize) ||
+			!opusOutputFifo->canEnqueueAtLeast(opusFrameSize)) {
+			break;
 		}
 		
-		// output SRC
-		double outputSrcRatio = inputSamplingRate / opusSamplingRate;
-		while (fifo3->getNumberOfSamplesDequeueableBySingleRun() &&
-			   fifo4->getNumberOfSamplesEnqueueableBySingleRun()) {
-			stall = false;
-			
-			--countLimit;
-			assert(countLimit > 0);
-			
-			fifo3->dequeueSingleCustom
-			([&](const AudioFifo::ConstBufferSet& inBuffers, std::size_t inSamples) {
-				assert(inSamples);
-				
-				fifo4->enqueueSingleCustom
-				([&](const AudioFifo::BufferSet &outBuffers, std::size_t outSamples) {
-					assert(outSamples);
-					
-					SRC_DATA src;
-					for (std::size_t i = 0; i < numChannels; ++i) {
-						src.data_in = const_cast<float*>(inBuffers[i]);
-						src.data_out = outBuffers[i];
-						src.src_ratio = outputSrcRatio;
-						src.input_frames = inSamples;
-						src.output_frames = outSamples;
-						src.input_frames_used = 0;
-						src.output_frames_gen = 0;
-						src.end_of_input = 0;
-						src_process(srcState[i + 2], &src);
-						
-						// these value must be equal for all channels...
-						// (unless libsamplerate uses nondeterministic
-						//  process)
-						outSamples = src.output_frames_gen;
-						inSamples = src.input_frames_used;
-					}
-					return outSamples;
-				});
-				return inSamples;
-			});
+		// the host may go back to real time without a prepareToPlay
+		if (cacheUsable && !isNonRealtime())
+			cacheUsable = false;
+		
+		StageStats::Ticks encodeTicks = 0;
+		int encodedLen = cacheUsable ?
+		runCachedCodec(*opusInputFifo, *opusOutputFifo) :
+		runCodec(*opusCodec, opusFrameSize, *opusInputFifo,
+				 *opusOutputFifo, opusOutputBuffer, pipelineStats, &encodeTicks);
+		
+		// the next frame is encoded with whatever this one suggests
+		if (encodeTicks && !isNonRealtime() &&
+			complexityGovernor.addEncodeTime(encodeTicks)) {
+			int complexity = complexityGovernor.getComplexity();
+			encoderComplexity.store(complexity, std::memory_order_relaxed);
+			opusCodec->setComplexity(complexity);
 		}
 		
-		if (!resolvingUnderrun ||
-			fifo4->getNumberOfSamplesDequeueable() > 2048) {
-			resolvingUnderrun = false;
-			
-			AudioFifo::BufferSet outputBufferSet;
-			for (std::size_t j = 0; j < 2; ++j) {
-				outputBufferSet[j] = j < numChannels ?
-				buffer.getWritePointer(j) + writeIndex : nullptr;
-			}
-			auto outputSunk = fifo4->dequeue(outputBufferSet, numSamples - writeIndex);
-			writeIndex += outputSunk;
-			
-			if (outputSunk)
-				stall = false;
-		} else if (writeIndex < numSamples) {
-			stall = false;
-			writeIndex = std::min(writeIndex + 2048, numSamples);
+		// only A is captured; it's what the host hears by default
+		capture.addPacket(*opusCodec, opusCodec->key.samplingRate, opusFrameSize,
+						  opusOutputBuffer.data(), encodedLen);
+	}
+	variantsFed = opusInputFifo->getNumberOfSamplesDequeueable();
+	
+	// output SRC
+	selectResamplers();
+	if (!direct && fifo3->canDequeueAtLeast(1)) {
+		ScopedStageTimer timer(pipelineStats, StageStats::OutputSrc);
+		resample(outputResampler, *fifo3, *fifo4);
+	}
+	
+	correctOutput();
+	
+	finishVariants();
+}
+
+int RoundTripOpusAudioProcessor::runCodec(OpusCodec &codec, int frameSize,
+										  AudioFifo &from, AudioFifo &to,
+										  std::vector<unsigned char> &packet,
+										  StageStats &stats,
+										  StageStats::Ticks *encodeTicks)
+{
+	// the frame is always contiguous in the FIFO, so encode it in place
+	// and decode straight into the next one
+	int encodedLen;
+	from.dequeueSingleCustom
+	([&](const AudioFifo::ConstBufferSet &frames, std::size_t) {
+		StageStats::Ticks start = StageStats::now();
+		encodedLen = codec.encode(frames[0], frameSize,
+								  packet.data(), static_cast<int>(packet.size()));
+		StageStats::Ticks elapsed = StageStats::now() - start;
+		stats.add(StageStats::Encode, elapsed);
+		if (encodeTicks)
+			*encodeTicks = elapsed;
+		return static_cast<std::size_t>(frameSize);
+	});
+	if (encodedLen < 0) {
+		// error...
+		encodedLen = 0;
+	}
+	
+	// a frame that fails to decode still has to take up its time
+	to.enqueueSingleCustom
+	([&](const AudioFifo::BufferSet &frames, std::size_t) {
+		ScopedStageTimer timer(stats, StageStats::Decode);
+		// with DTX, a packet this short is one the encoder says needn't be
+		// sent. a receiver would find it missing and conceal it.
+		int decodedSamples = opusDtx && encodedLen <= 2 ?
+		codec.decode(nullptr, 0, frames[0], frameSize) :
+		codec.decode(packet.data(), encodedLen, frames[0], frameSize);
+		if (decodedSamples != frameSize) {
+			// error...
+			std::fill(frames[0], frames[0] +
+					  frameSize * to.getChannelStride(), 0.f);
 		}
+		return static_cast<std::size_t>(frameSize);
+	});
+	return encodedLen;
+}
+
+int RoundTripOpusAudioProcessor::runCachedCodec(AudioFifo &from, AudioFifo &to)
+{
+	// only ever on for offline renders
+	RealtimeSafety::ScopedAllow allow;
+	
+	// the frame is hashed and looked up where it is. runCodec reads it
+	// from and decodes to the same places, as long as nothing else gets
+	// at the FIFOs in between.
+	std::size_t frameLength = static_cast<std::size_t>(opusFrameSize) *
+	from.getChannelStride();
+	const float *input = nullptr;
+	float *output = nullptr;
+	from.dequeueSingleCustom
+	([&](const AudioFifo::ConstBufferSet &frames, std::size_t) {
+		input = frames[0];
+		return static_cast<std::size_t>(0);
+	});
+	to.enqueueSingleCustom
+	([&](const AudioFifo::BufferSet &frames, std::size_t) {
+		output = frames[0];
+		return static_cast<std::size_t>(0);
+	});
+	
+	// everything that has a say in what the codec makes of the frame
+	const int settings[] = {
+		opusCodec->key.samplingRate, opusCodec->key.numChannels,
+		opusCodec->key.application, getOpusBandwidth(opusSamplingRate),
+		opusBitRate, opusFrameSize, encoderComplexity.load(std::memory_order_relaxed),
+		opusDtx ? 1 : 0
+	};
+	auto nextLineage = [&] {
+		EncodeCache::Key key = EncodeCache::hash(settings, sizeof(settings), cacheLineage);
+		return EncodeCache::hash(input, frameLength * sizeof(float), key);
+	};
+	EncodeCache::Key key = nextLineage();
+	cacheLineage = key;
+	
+	int encodedLen = encodeCache->lookup(key, opusOutputBuffer.data(),
+										 static_cast<int>(opusOutputBuffer.size()),
+										 output, frameLength);
+	if (encodedLen < 0 && cacheBehind) {
+		// the codec is only brought close to the state the key stands
+		// for, so what it makes of this frame doesn't belong under that
+		// key. catching up starts a lineage of its own instead.
+		catchUpEncodeCache();
+		key = nextLineage();
+		cacheLineage = key;
+		encodedLen = encodeCache->lookup(key, opusOutputBuffer.data(),
+										 static_cast<int>(opusOutputBuffer.size()),
+										 output, frameLength);
+	}
+	if (encodedLen >= 0) {
+		from.dequeueSingleCustom
+		([&](const AudioFifo::ConstBufferSet &, std::size_t) {
+			return static_cast<std::size_t>(opusFrameSize);
+		});
+		to.enqueueSingleCustom
+		([&](const AudioFifo::BufferSet &, std::size_t) {
+			return static_cast<std::size_t>(opusFrameSize);
+		});
+		cacheBehind = true;
+	} else {
+		encodedLen = runCodec(*opusCodec, opusFrameSize, from, to,
+							  opusOutputBuffer, pipelineStats);
+		if (encodedLen > 0) {
+			encodeCache->store(key, opusOutputBuffer.data(), encodedLen,
+							   output, frameLength);
+		}
+	}
+	
+	// keep the latest input around, oldest first
+	std::size_t capacity = cacheHistory.size();
+	std::size_t keep = std::min(cacheHistoryLength, capacity - std::min(capacity, frameLength));
+	std::copy(cacheHistory.begin() + (cacheHistoryLength - keep),
+			  cacheHistory.begin() + cacheHistoryLength, cacheHistory.begin());
+	std::size_t add = std::min(frameLength, capacity);
+	std::copy(input + (frameLength - add), input + frameLength,
+			  cacheHistory.begin() + keep);
+	cacheHistoryLength = keep + add;
+	
+	return encodedLen;
+}
+
+void RoundTripOpusAudioProcessor::restartEncodeCache()
+{
+	// libopus builds differ in what they make of the same frame
+	const char *version = opus_get_version_string();
+	cacheLineage = EncodeCache::hash(version, std::strlen(version));
+	cacheUsable = encodeCache != nullptr;
+	cacheBehind = false;
+	cacheHistoryLength = 0;
+}
+
+void RoundTripOpusAudioProcessor::catchUpEncodeCache()
+{
+	// this won't make the output the same as if the codec had seen every
+	// frame, but it spares the next one a cold start
+	opusCodec->encoderCtl(OPUS_RESET_STATE);
+	opusCodec->decoderCtl(OPUS_RESET_STATE);
+	
+	std::size_t frameLength = static_cast<std::size_t>(opusFrameSize) *
+	static_cast<std::size_t>(opusCodec->key.numChannels);
+	std::size_t numFrames = cacheHistoryLength / frameLength;
+	const float *frame = cacheHistory.data() + cacheHistoryLength -
+	numFrames * frameLength;
+	for (std::size_t i = 0; i < numFrames; ++i, frame += frameLength) {
+		int encodedLen = opusCodec->encode(frame, opusFrameSize, opusOutputBuffer.data(),
+										   static_cast<int>(opusOutputBuffer.size()));
+		if (encodedLen > 0) {
+			opusCodec->decode(opusOutputBuffer.data(), encodedLen,
+							  cacheScratch.data(), opusFrameSize);
+		}
+	}
+	cacheBehind = false;
+	
+	// what the codec holds now follows from the frames above alone
+	static const char marker[] = "catch-up";
+	const char *version = opus_get_version_string();
+	cacheLineage = EncodeCache::hash(version, std::strlen(version));
+	cacheLineage = EncodeCache::hash(marker, sizeof(marker), cacheLineage);
+	cacheLineage = EncodeCache::hash(cacheHistory.data() + cacheHistoryLength -
+									 numFrames * frameLength,
+									 numFrames * frameLength * sizeof(float),
+									 cacheLineage);
+}
+
+void RoundTripOpusAudioProcessor::acquireReplay()
+{
+	// there's nothing sensible to replay into the other variants
+	OggOpusReplay *requested = numVariants == 1 ?
+	replayRequest.load(std::memory_order_acquire) : nullptr;
+	if (requested == replay)
+		return;
+	
+	// the current one isn't going to be touched again either way. the new
+	// one is only safe to use if it's still the one requested after the
+	// message thread could have seen it in replayInUse.
+	replayInUse.store(requested);
+	if (replayRequest.load() != requested) {
+		requested = nullptr;
+		replayInUse.store(nullptr);
+		if (!replay)
+			return;
+	}
+	
+	if (replay && opusCodec) {
+		// the encoder hasn't seen any of the input meanwhile
+		opusCodec->encoderCtl(OPUS_RESET_STATE);
+		opusCodec->decoderCtl(OPUS_RESET_STATE);
+		restartEncodeCache();
+	}
+	replay = requested;
+	
+	// like a change of rate: the converters start over too, since what
+	// they hold back isn't counted by flushCodecStage
+	if (inputResampler)
+		inputResampler->reset();
+	if (outputResampler)
+		outputResampler->reset();
+	flushCodecStage();
+	
+	if (replay) {
+		// until the audio thread says where the host is, the file starts
+		// with the first input sample that hasn't been encoded
+		std::int64_t front = pipelineInputIndex -
+		static_cast<std::int64_t>(fifo1->getNumberOfSamplesDequeueable());
+		replayAnchor.inputIndex = front;
+		replayAnchor.timeline = static_cast<std::int64_t>
+		(std::llround(replayStartTime.load() * inputSamplingRate));
+		replayAnchor.playing = true;
+		hasNextAnchor = false;
+		replayFrameIndex = static_cast<double>(front);
+		replaySynced = false;
+	}
+}
+
+void RoundTripOpusAudioProcessor::runReplay(AudioFifo &to)
+{
+	// the input only sets the pace. frames go out as soon as the input
+	// they stand for is in, so this is never later than encoding it would
+	// have been, and the correction done on the switch keeps the delay.
+	fifo1->clear();
+	
+	for (;;) {
+		applyPendingConfig();
+		if (!opusCodec || opusCodec->key.numChannels != opusNumChannels)
+			break;
 		
-		if (stall)
+		int codecRate = opusCodec->key.samplingRate;
+		double frameInput = opusFrameSize * inputSamplingRate / codecRate;
+		if (replayFrameIndex + frameInput > static_cast<double>(pipelineInputIndex) ||
+			!to.canEnqueueAtLeast(opusFrameSize)) {
 			break;
+		}
+		
+		// the anchor the start of this frame falls under. one that comes
+		// in early waits for its input to come up.
+		std::int64_t frameIndex = static_cast<std::int64_t>(replayFrameIndex);
+		if (timelineAnchors.update()) {
+			if (hasNextAnchor && frameIndex >= nextAnchor.inputIndex)
+				replayAnchor = nextAnchor;
+			nextAnchor = timelineAnchors.getReadBuffer();
+			hasNextAnchor = true;
+		}
+		if (hasNextAnchor && frameIndex >= nextAnchor.inputIndex) {
+			replayAnchor = nextAnchor;
+			hasNextAnchor = false;
+		}
+		
+		ScopedStageTimer timer(pipelineStats, StageStats::Decode);
+		
+		// a new codec has a decoder that hasn't seen the packets before
+		if (opusCodec != replayCodec) {
+			replayCodec = opusCodec;
+			replaySynced = false;
+		}
+		
+		// samples at 48kHz per codec sample
+		int step = 48000 / codecRate;
+		bool playing = replayAnchor.playing && replay->isCompatibleWith(*opusCodec);
+		if (playing) {
+			double timeline = replayAnchor.timeline +
+			(replayFrameIndex - replayAnchor.inputIndex) -
+			replayStartTime.load(std::memory_order_relaxed) * inputSamplingRate;
+			std::int64_t position = static_cast<std::int64_t>
+			(std::llround(timeline * 48000.0 / inputSamplingRate));
+			// counting on sample by sample unless the host went elsewhere
+			if (!replaySynced || std::abs(position - replayPosition) > step)
+				seekReplay(position);
+		} else {
+			replaySynced = false;
+		}
+		
+		std::size_t stride = to.getChannelStride();
+		to.enqueueSingleCustom
+		([&](const AudioFifo::BufferSet &frames, std::size_t) {
+			float *out = frames[0];
+			std::size_t needed = static_cast<std::size_t>(opusFrameSize);
+			while (needed && playing) {
+				if (replayBufferStart == replayBufferEnd && !decodeReplayPacket())
+					break;
+				std::size_t count = std::min(needed, replayBufferEnd - replayBufferStart);
+				const float *from = replayBuffer.data() + replayBufferStart * stride;
+				out = std::copy(from, from + count * stride, out);
+				replayBufferStart += count;
+				needed -= count;
+			}
+			// stopped, or past the end
+			std::fill(out, out + needed * stride, 0.f);
+			return static_cast<std::size_t>(opusFrameSize);
+		});
+		if (playing)
+			replayPosition += static_cast<std::int64_t>(opusFrameSize) * step;
+		replayFrameIndex += frameInput;
 	}
+}
+
+void RoundTripOpusAudioProcessor::seekReplay(std::int64_t position)
+{
+	int step = 48000 / opusCodec->key.samplingRate;
+	opusCodec->decoderCtl(OPUS_RESET_STATE);
+	replayBufferStart = replayBufferEnd = 0;
+	replayPosition = position;
+	replaySynced = true;
+	replayLeadIn = 0;
 	
-	if (i < numSamples) {
-		resolvingOverrun = true;
+	if (position < 0) {
+		// before the start of the file
+		replayLeadIn = (-position + step - 1) / step;
+		replayPacket = 0;
+		return;
 	}
 	
-	if (writeIndex < numSamples) {
-		// underrun occured.
-		resolvingUnderrun = true;
+	// the packet index makes this a binary search. the decoder is run
+	// over the 80ms before too, as RFC 7845 suggests, so that it has
+	// settled by the time it gets there.
+	std::size_t target = replay->findPacket(position);
+	replayPacket = replay->findPacket(std::max<std::int64_t>(0, position - 3840));
+	while (replayPacket < target) {
+		if (!decodeReplayPacket())
+			return;
 	}
+	if (!decodeReplayPacket())
+		return;
+	std::size_t skip = static_cast<std::size_t>
+	((position - replay->getPacketStart(target)) / step);
+	replayBufferStart = std::min(skip, replayBufferEnd);
+}
+
+bool RoundTripOpusAudioProcessor::decodeReplayPacket()
+{
+	std::size_t stride = static_cast<std::size_t>(opusNumChannels);
+	int step = 48000 / opusCodec->key.samplingRate;
+	replayBufferStart = 0;
+	replayBufferEnd = 0;
+	
+	if (replayLeadIn > 0) {
+		std::size_t count = static_cast<std::size_t>
+		(std::min<std::int64_t>(replayLeadIn, maxReplayPacket / step));
+		std::fill(replayBuffer.begin(), replayBuffer.begin() + count * stride, 0.f);
+		replayLeadIn -= static_cast<std::int64_t>(count);
+		replayBufferEnd = count;
+		return true;
+	}
+	if (replayPacket >= replay->getNumPackets())
+		return false;
 	
+	std::size_t packet = replayPacket++;
+	int decoded = opusCodec->decode(replay->getPacketData(packet),
+									replay->getPacketLength(packet),
+									replayBuffer.data(), maxReplayPacket / step);
+	if (decoded < 0) {
+		// a damaged packet still has to take up its time
+		std::int64_t end = packet + 1 < replay->getNumPackets() ?
+		replay->getPacketStart(packet + 1) : replay->getLength();
+		decoded = static_cast<int>(std::min<std::int64_t>
+		((end - replay->getPacketStart(packet)) / step, maxReplayPacket / step));
+		std::fill(replayBuffer.begin(), replayBuffer.begin() + decoded * stride, 0.f);
+	}
+	replayBufferEnd = static_cast<std::size_t>(decoded);
+	return true;
+}
+
+void RoundTripOpusAudioProcessor::noteTimeline(std::int64_t timeline, bool playing)
+{
+	// audio thread. inputIndex is what the next sample handed in gets.
+	if (hasAnchor && playing == lastAnchor.playing &&
+		(!playing || timeline - lastAnchor.timeline ==
+		 inputIndex - lastAnchor.inputIndex)) {
+		return;
+	}
+	lastAnchor.inputIndex = inputIndex;
+	lastAnchor.timeline = timeline;
+	lastAnchor.playing = playing;
+	hasAnchor = true;
+	timelineAnchors.getWriteBuffer() = lastAnchor;
+	timelineAnchors.publish();
+}
+
+void RoundTripOpusAudioProcessor::feedVariants(AudioFifo &from)
+{
+	// A reads from the same FIFO, so it's only peeked at: whatever came
+	// in after the first variantsFed samples is new to the variants
+	std::size_t stride = from.getChannelStride();
+	from.dequeueSingleCustom
+	([&](const AudioFifo::ConstBufferSet &frames, std::size_t samples) {
+		assert(samples >= variantsFed);
+		const float *newFrames = frames[0] + variantsFed * stride;
+		std::size_t numNew = samples - variantsFed;
+		for (int i = 1; i < numVariants; ++i) {
+			Variant &variant = *variants[i - 1];
+			std::size_t taken = variant.input->enqueueSingleCustom
+			([&](const AudioFifo::BufferSet &to, std::size_t room) {
+				std::size_t count = std::min(numNew, room);
+				std::copy(newFrames, newFrames + count * stride, to[0]);
+				return count;
+			});
+			// like an fifo1 overrun in processSlice
+			variant.outputCorrection += static_cast<std::ptrdiff_t>(numNew - taken);
+		}
+		variantsFed = samples;
+		return static_cast<std::size_t>(0);
+	});
+}
+
+void RoundTripOpusAudioProcessor::startVariants()
+{
+	for (int i = 1; i < numVariants; ++i) {
+		Variant &variant = *variants[i - 1];
+		bool codecUsable = variant.codec &&
+		variant.codec->key.numChannels == opusNumChannels;
+		if (!codecUsable)
+			continue;
+		variant.state.store(Variant::Queued, std::memory_order_release);
+		variant.worker.wake();
+	}
+}
+
+void RoundTripOpusAudioProcessor::runVariantIfQueued(Variant &variant)
+{
+	int expected = Variant::Queued;
+	if (variant.state.compare_exchange_strong(expected, Variant::Running,
+											  std::memory_order_acquire)) {
+		runVariant(variant);
+		variant.state.store(Variant::Idle, std::memory_order_release);
+	}
+}
+
+void RoundTripOpusAudioProcessor::finishVariants()
+{
+	// running what's still queued here rather than waiting for a codec
+	// thread keeps this from waiting on a pool that is all busy (or is
+	// this very thread, in threaded mode)
+	for (int i = 1; i < numVariants; ++i)
+		runVariantIfQueued(*variants[i - 1]);
+	for (int i = 1; i < numVariants; ++i) {
+		if (variants[i - 1]->state.load(std::memory_order_acquire) == Variant::Idle)
+			continue;
+		pipelineStats.count(StageStats::Stall);
+		while (variants[i - 1]->state.load(std::memory_order_acquire) != Variant::Idle)
+			std::this_thread::yield();
+	}
+}
+
+void RoundTripOpusAudioProcessor::runVariant(Variant &variant)
+{
+	// a codec thread (or the pipeline, from finishVariants). everything
+	// touched here is the variant's own, or isn't changed until the
+	// pipeline has waited for it.
+	RealtimeSafety::ScopedAudioThread audioThread;
+	
+	bool direct = directSamplingRate.load(std::memory_order_relaxed) != 0;
+	AudioFifo &decoded = direct ? *variant.output : *variant.decoded;
+	
+	OpusCodec &codec = *variant.codec;
+	codec.setBitRate(variant.bitRate);
+	codec.setComplexity(encoderComplexity.load(std::memory_order_relaxed));
+	codec.setMaxBandwidth(getOpusBandwidth(opusSamplingRate));
+	codec.setDtx(opusDtx);
+	
+	while (variant.input->canDequeueAtLeast(variant.frameSize) &&
+		   decoded.canEnqueueAtLeast(variant.frameSize)) {
+		runCodec(codec, variant.frameSize, *variant.input, decoded, variant.packet,
+				 variant.stats);
+	}
+	
+	if (!direct && variant.outputResampler && variant.decoded->canDequeueAtLeast(1)) {
+		ScopedStageTimer timer(variant.stats, StageStats::OutputSrc);
+		resample(variant.outputResampler, *variant.decoded, *variant.output);
+	}
+	
+	correctOutput(*variant.output, variant.outputCorrection);
+}
+
+StageStats::Snapshot RoundTripOpusAudioProcessor::getStageStats() const
+{
+	const StageStats *stats[2 + maxNumVariants - 1];
+	std::size_t numStats = 0;
+	stats[numStats++] = &audioStats;
+	stats[numStats++] = &pipelineStats;
+	for (const auto &variant: variants)
+		stats[numStats++] = &variant->stats;
+	return StageStats::getSnapshot(stats, numStats);
+}
+
+void RoundTripOpusAudioProcessor::resetStageStats()
+{
+	audioStats.reset();
+	pipelineStats.reset();
+	for (auto &variant: variants)
+		variant->stats.reset();
+}
+
+bool RoundTripOpusAudioProcessor::startCapture(const File &file)
+{
+	return capture.start(file);
+}
+
+void RoundTripOpusAudioProcessor::stopCapture()
+{
+	capture.stop();
+}
+
+void RoundTripOpusAudioProcessor::setEncodeCache(std::shared_ptr<EncodeCache> cache)
+{
+	nextEncodeCache = std::move(cache);
+}
+
+bool RoundTripOpusAudioProcessor::startReplay(const File &file, double timelineStart)
+{
+	std::unique_ptr<OggOpusReplay> opened(new OggOpusReplay());
+	if (!opened->open(file))
+		return false;
+	
+	{
+		std::lock_guard<std::mutex> lock(replayLock);
+		replayStartTime = timelineStart;
+		replayRequest.store(opened.get());
+		replays.push_back(std::move(opened));
+		collectReplays();
+	}
+	
+	// silenceInProducesSilenceOut changed
+	updateHostDisplay();
+	return true;
+}
+
+void RoundTripOpusAudioProcessor::stopReplay()
+{
+	{
+		std::lock_guard<std::mutex> lock(replayLock);
+		replayRequest.store(nullptr);
+		collectReplays();
+	}
+	updateHostDisplay();
+}
+
+void RoundTripOpusAudioProcessor::collectReplays()
+{
+	// called with replayLock held. whatever the pipeline isn't using or
+	// about to use can go; see acquireReplay.
+	OggOpusReplay *requested = replayRequest.load();
+	OggOpusReplay *inUse = replayInUse.load();
+	replays.erase(std::remove_if(replays.begin(), replays.end(),
+								 [&](const std::unique_ptr<OggOpusReplay> &r) {
+		return r.get() != requested && r.get() != inUse;
+	}), replays.end());
 }
 
 //==============================================================================
@@ -12,18 +12,29 @@
 #define PLUGINPROCESSOR_H_INCLUDED
 
 #include "../JuceLibraryCode/JuceHeader.h"
+#include "CodecWorker.h"
+#include "Fifo.h"
+#include "OggOpusCapture.h"
+#include "OggOpusReplay.h"
+#include "EncodeCache.h"
+#include "ComplexityGovernor.h"
+#include "LockFree.h"
+#include "OpusCodecPool.h"
+#include "RealtimeSafety.h"
+#include "Resampler.h"
+#include "StageStats.h"
 #include <opus/opus.h>
-#include <samplerate.h>
 #include <vector>
 #include <cstdint>
 #include <memory>
 #include <mutex>
+#include <atomic>
 
 
 //==============================================================================
 /**
 */
-class RoundTripOpusAudioProcessor  : public AudioProcessor
+class RoundTripOpusAudioProcessor  : public AudioProcessor, private AsyncUpdater
 {
 public:
 	enum class Parameter
@@ -33,6 +44,27 @@ public:
 		FrameSize,
 		Application,
 		Signal,
+		ResamplerQuality,
+		LowLatency,
+		WorkerThread,
+		NumVariants,
+		ListenVariant,
+		BitrateB,
+		FrameSizeB,
+		BitrateC,
+		FrameSizeC,
+		BitrateD,
+		FrameSizeD,
+		Complexity,
+		AdaptiveComplexity,
+		MinComplexity,
+		MaxComplexity,
+		Dtx,
+		WorkerTakeover,
+		
+		/** Read-only. */
+		CurrentComplexity,
+		DeadlineMisses,
 	};
 	enum class Application
 	{
@@ -47,16 +79,140 @@ public:
 		Music
 	};
 	
+	/** Up to 7.1. Above two channels a multistream codec is used. */
+	static const int maxNumChannels = 8;
+	
+	/** A/B mode runs up to this many codecs (variants A, B, ...) side by
+	 *  side on the same input, of which one is heard. */
+	static const int maxNumVariants = 4;
+	
+	/** What can differ between variants. */
+	struct VariantConfig
+	{
+		int bitRate;
+		int frameSizeTime; // 0.1ms
+	};
+	
+	/** The set of parameters that is handed over to the audio thread. */
+	struct CodecConfig
+	{
+		int samplingRate;
+		int bitRate;
+		int frameSizeTime; // 0.1ms
+		Application application;
+		Signal signal;
+		int complexity; // 0 - 10
+		
+		/** Lets the encoding time pick the complexity within these bounds
+		 *  instead; see ComplexityGovernor. complexity is where it starts. */
+		bool adaptiveComplexity;
+		int minComplexity, maxComplexity;
+		
+		/** Overrides frameSizeTime and application; see getFrameSize. */
+		bool lowLatency;
+		
+		/** Lets the encoder stop sending packets while the input is near
+		 *  silent. The decoder fills in for the missing ones. */
+		bool dtx;
+		
+		/** Variants B, C and D. A is bitRate and frameSizeTime above; the
+		 *  rest is shared. */
+		VariantConfig variants[maxNumVariants - 1];
+		
+		/** These only take effect at the next prepareToPlay. numVariants
+		 *  counts A, so 1 turns A/B mode off. */
+		ResamplerQuality resamplerQuality;
+		bool workerThread;
+		int numVariants;
+		
+		/** Lets the audio thread run the worker's pass itself when the
+		 *  output it needs isn't there yet. That's a whole frame's encode
+		 *  in one callback, so it's off unless asked for. Also at the
+		 *  next prepareToPlay. */
+		bool workerTakeover;
+	};
+	
 private:
-	template <class T, int N>
-	class Fifo;
+	// Opus can only run at these rates; there's a converter pair for each,
+	// built in prepareToPlay so that switching rates doesn't allocate on
+	// the audio thread. all take interleaved frames of srcNumChannels
+	// channels.
+	static const int numOpusSamplingRates = 5;
+	static const int opusSamplingRates[numOpusSamplingRates];
+	std::unique_ptr<Resampler> inputResamplers[numOpusSamplingRates];
+	std::unique_ptr<Resampler> outputResamplers[numOpusSamplingRates];
+	std::size_t srcNumChannels;
 	
-	SRC_STATE *srcState[4];
+	// the pair for opusSamplingRate. owned by the audio thread.
+	Resampler *inputResampler;
+	Resampler *outputResampler;
+	int resamplerSamplingRate;
+	ResamplerQuality resamplerQuality;
 	
-	std::mutex objLock;
+	// the host rate if Opus can run at it, 0 otherwise. when set, the codec
+	// runs at the host rate with its bandwidth limited to what
+	// opusSamplingRate allows, and audio goes fifo1 -> Opus -> fifo4
+	// without passing through the SRC stages. set in prepareToPlay.
+	std::atomic<int> directSamplingRate;
 	
-	OpusEncoder *opusEncoder;
-	OpusDecoder *opusDecoder;
+	// host/UI side copy of the parameters, a field per atomic. some hosts
+	// call setParameter on the audio thread while the editor polls
+	// getParameter, so neither side may block the other. setParameter
+	// stores the field and then bumps hostConfigVersion; the audio thread
+	// loads the whole set when it sees the version move. each call only
+	// changes a single field, so the set it loads is never torn.
+	struct HostConfig
+	{
+		std::atomic<int> samplingRate;
+		std::atomic<int> bitRate;
+		std::atomic<int> frameSizeTime;
+		std::atomic<Application> application;
+		std::atomic<Signal> signal;
+		std::atomic<int> complexity;
+		std::atomic<bool> adaptiveComplexity;
+		std::atomic<int> minComplexity, maxComplexity;
+		std::atomic<bool> lowLatency;
+		std::atomic<bool> dtx;
+		struct
+		{
+			std::atomic<int> bitRate;
+			std::atomic<int> frameSizeTime;
+		} variants[maxNumVariants - 1];
+		std::atomic<ResamplerQuality> resamplerQuality;
+		std::atomic<bool> workerThread;
+		std::atomic<int> numVariants;
+		std::atomic<bool> workerTakeover;
+		
+		CodecConfig load() const;
+	};
+	HostConfig hostConfig;
+	std::atomic<std::uint32_t> hostConfigVersion;
+	std::uint32_t hostConfigVersionSeen; // audio thread
+	
+	// the audio thread stamps what it picks up from hostConfig with
+	// the inputIndex of the slice it came before, and queues it for the
+	// pipeline, which applies it at the first frame that starts at or
+	// after that sample
+	struct ConfigChange
+	{
+		std::int64_t inputIndex;
+		CodecConfig config;
+	};
+	SpscRing<ConfigChange> configChanges;
+	ConfigChange outgoingConfig; // the ring was full, audio thread
+	bool hasOutgoingConfig;
+	
+	std::atomic<std::uint64_t> numConfigChangesApplied;
+	
+	// codecs are built off the audio thread; see OpusCodecPool
+	std::unique_ptr<OpusCodecPool> codecPool;
+	
+	// the following are owned by the audio thread
+	OpusCodecPool::Codec *opusCodec;
+	
+	// the config picked up from configChanges, waiting for its codec
+	CodecConfig nextConfig;
+	bool hasNextConfig;
 	
 	int opusSamplingRate;
 	int opusNumChannels;
@@ -65,29 +221,305 @@ private:
 	int opusFrameSize;
 	int opusBitRate;
 	int opusComplexity;
+	bool opusAdaptiveComplexity;
+	int opusMinComplexity, opusMaxComplexity;
 	Signal opusSignal;
+	bool opusLowLatency;
+	bool opusDtx;
+	
+	// fifo4 starts out this many samples of silence ahead so that whole
+	// Opus frames arriving at once never leave the output short
+	std::size_t outputPrefill;
+	
+	// silence still to be added to (> 0) or samples still to be dropped
+	// from (< 0) fifo4 to keep the delay where it was reported. nonzero
+	// only briefly after a parameter change, or if a FIFO ran out anyway.
+	std::ptrdiff_t outputCorrection;
 	
-	bool resolvingOverrun;
-	bool resolvingUnderrun;
+	// samples that went into fifo1 (or were dropped on the way) minus
+	// samples that left fifo4 (or were missing when needed). with this,
+	// what's in flight can be brought back in line after a flush.
+	std::ptrdiff_t pipelineBalance;
+	
+	// end-to-end delay in host samples. written by the audio thread and
+	// reported to the host from the message thread.
+	std::atomic<int> pipelineLatency;
+	
+	// silent samples in a row that were handed in and given out. once
+	// both cover the delay, all that's in flight is silence too, and
+	// silent slices skip the pipeline. audio thread.
+	std::int64_t silentInputLength;
+	std::int64_t silentOutputLength;
+	// output below this is taken as the tail of the decoder fading out
+	static const float settledThreshold;
+	
+	// interleaved so that libopus and the resamplers can work on the
+	// FIFO contents directly, and mirrored so that they never have to
+	// deal with the wrap point
+	using AudioFifo = Fifo<float, maxNumChannels, FifoLayout::Interleaved>;
+	
+	std::unique_ptr<AudioFifo> fifo1; // input -> SRC
+	std::unique_ptr<AudioFifo> fifo2; // SRC   -> Opus
+	std::unique_ptr<AudioFifo> fifo3; // Opus  -> SRC
+	std::unique_ptr<AudioFifo> fifo4; // SRC   -> output
+	
+	// with the worker thread on, processBlock only moves samples through
+	// these two rings and codecWorker runs everything from fifo1 to fifo4
+	// (and owns what the audio thread owns otherwise) on the threads shared
+	// by all instances. set up by prepareToPlay.
+	bool threaded;
+	bool takeover; // see CodecConfig::workerTakeover
+	SpscRing<float> inputRing;
+	SpscRing<float> outputRing;
+	CodecWorker codecWorker;
+	
+	// input the audio thread had to drop (> 0) or output it had to make
+	// up (< 0) because a ring was full or empty. the worker adds it to
+	// outputCorrection.
+	std::atomic<std::ptrdiff_t> ringCorrection;
+	
+	// held by whoever is running the pipeline in threaded mode. offline
+	// rendering runs it on the audio thread, which has to wait for it.
+	std::atomic<bool> pipelineBusy;
+	
+	// one per thread that can be adding to them: processBlock's side, and
+	// whoever runs the pipeline (the variants have their own)
+	StageStats audioStats;
+	StageStats pipelineStats;
+	
+	// fed by whoever runs the pipeline
+	OggOpusCapture capture;
+	ComplexityGovernor complexityGovernor;
+	
+	// what A's encoder is set to; the variants follow it
+	std::atomic<int> encoderComplexity;
+	
+	// setEncodeCache's. picked up by prepareToPlay.
+	std::shared_ptr<EncodeCache> nextEncodeCache;
+	
+	// encode cache state of whoever runs the pipeline (see runCachedCodec).
+	// cacheLineage hashes everything opusCodec has been fed since it was
+	// reset or caught up; cacheBehind is set while it skips frames the
+	// cache had.
+	std::shared_ptr<EncodeCache> encodeCache;
+	bool cacheUsable;
+	bool cacheBehind;
+	EncodeCache::Key cacheLineage;
+	std::vector<float> cacheHistory; // the latest input, for catching up
+	std::size_t cacheHistoryLength;
+	std::vector<float> cacheScratch;
+	
+	// replay. startReplay and stopReplay own every file they opened, and
+	// close those the pipeline is done with; the pipeline announces the
+	// one it's about to use in replayInUse first (see acquireReplay).
+	std::mutex replayLock;
+	std::vector<std::unique_ptr<OggOpusReplay>> replays;
+	std::atomic<OggOpusReplay *> replayRequest;
+	std::atomic<OggOpusReplay *> replayInUse;
+	std::atomic<double> replayStartTime; // seconds into the host timeline
+	
+	// a point of the host timeline: the sample handed in as the
+	// inputIndex-th one (counting from prepareToPlay) was at timeline.
+	// the audio thread sends a new one whenever the host jumps, starts or
+	// stops, or input got dropped; in between, the pipeline counts on.
+	struct TimelineAnchor
+	{
+		std::int64_t inputIndex;
+		std::int64_t timeline;
+		bool playing;
+	};
+	TripleBuffer<TimelineAnchor> timelineAnchors;
+	TimelineAnchor lastAnchor; // the audio thread's copy
+	bool hasAnchor;
+	std::int64_t inputIndex; // samples handed in, audio thread
+	
+	// replay state of whoever runs the pipeline. it stands in for the
+	// input SRC and the encoder, taking a frame's worth of input from
+	// fifo1 for every frame it decodes.
+	OggOpusReplay *replay;
+	std::int64_t pipelineInputIndex; // samples that went into fifo1
+	TimelineAnchor replayAnchor;
+	TimelineAnchor nextAnchor; // waiting for its inputIndex to come up
+	bool hasNextAnchor;
+	double replayFrameIndex; // input sample the next frame goes with
+	std::int64_t replayPosition; // of the next sample, 48kHz
+	bool replaySynced; // false if replayPosition has to be looked up
+	OpusCodec *replayCodec; // whose decoder is at replayPosition
+	std::size_t replayPacket; // next to decode
+	std::int64_t replayLeadIn; // codec samples of silence before the first
+	std::vector<float> replayBuffer; // one decoded packet
+	std::size_t replayBufferStart, replayBufferEnd;
+	static const int maxReplayPacket = 5760; // 120ms at 48kHz
+	
+	// A/B mode. variants[i] is variant B, C, ... and runs a codec of its
+	// own on what the main one (A) gets to encode: the new part of the Opus
+	// input FIFO is copied to each, so they share the input SRC. they run
+	// on the codec threads while A is encoding, then go through an output
+	// SRC of their own. all outputs start with the same prefill (that of
+	// the longest frame) so that they stay aligned and the one heard can
+	// be switched at any sample.
+	struct Variant
+	{
+		OpusCodecPool::Codec *codec;
+		int bitRate;
+		int frameSizeTime;
+		int frameSize;
+		
+		std::unique_ptr<AudioFifo> input;   // like fifo2
+		std::unique_ptr<AudioFifo> decoded; // like fifo3
+		std::unique_ptr<AudioFifo> output;  // like fifo4
+		std::ptrdiff_t outputCorrection;
+		
+		std::unique_ptr<Resampler> outputResamplers[numOpusSamplingRates];
+		Resampler *outputResampler;
+		
+		std::vector<unsigned char> packet;
+		
+		// Idle -> Queued by the pipeline, Queued -> Running by whichever
+		// gets to it first: a codec thread or the pipeline waiting for it
+		enum State { Idle, Queued, Running };
+		std::atomic<int> state;
+		CodecWorker worker;
+		
+		StageStats stats;
+	};
+	std::unique_ptr<Variant> variants[maxNumVariants - 1];
+	int numVariants; // including A. set by prepareToPlay.
 	
-	using AudioFifo = Fifo<float, 2>;
+	// samples at the front of the Opus input FIFO the variants already have
+	std::size_t variantsFed;
 	
-	std::unique_ptr<Fifo<float, 2>> fifo1; // input -> SRC
-	std::unique_ptr<Fifo<float, 2>> fifo2; // SRC   -> Opus
-	std::unique_ptr<Fifo<float, 2>> fifo3; // Opus  -> SRC
-	std::unique_ptr<Fifo<float, 2>> fifo4; // SRC   -> output
+	// the variant heard; switched right away rather than at the next frame
+	std::atomic<int> listenVariant;
 	
-	std::vector<float> inputBuffer[2];
+	// all sized by prepareToPlay
+	std::size_t maxBlockSize;
+	std::vector<float> inputBuffer[maxNumChannels];
 	
-	std::vector<float> opusInputBuffer;
 	std::vector<unsigned char> opusOutputBuffer;
+	static const std::size_t maxPacketBytesPerStream = 1275 * 3;
 	
 	double inputSamplingRate;
 	
-	void createOpusCodec();
-	void invalidateOpusCodec();
+	static int getOpusApplication(Application);
+	static int getOpusBandwidth(int samplingRate);
+	int getCodecSamplingRate(int samplingRate) const;
+	int getFrameSize(const CodecConfig &) const;
+	int getMaxFrameSize() const;
+	OpusCodecPool::Key makeCodecKey(const CodecConfig &, int numChannels,
+									int variant = 0) const;
+	bool acquireCodecs(const CodecConfig &);
+	CodecConfig getCurrentConfig() const;
 	
 	void invalidateSrc();
+	void selectResamplers();
+	
+	void processSlice(AudioSampleBuffer &, std::size_t offset,
+					  std::size_t numSamples);
+	
+	/** Clears the slice instead of running it if it's silent and the
+	 *  pipeline has drained. Returns true if it did. */
+	bool skipSilentSlice(AudioSampleBuffer &, std::size_t offset,
+						 std::size_t numSamples);
+	bool isSilent(const AudioSampleBuffer &, std::size_t offset,
+				  std::size_t numSamples, float threshold) const;
+	void processSliceThreaded(AudioSampleBuffer &, std::size_t offset,
+							  std::size_t numSamples);
+	
+	/** Everything between fifo1 and fifo4. */
+	void runPipeline();
+	void updateCodecState();
+	
+	/** The worker's task: feeds the pipeline from inputRing a slice at a
+	 *  time until it runs dry, and moves what comes out to outputRing. If
+	 *  wait is false and someone else is at it, returns false right away.
+	 *  If needed isn't zero, stops as soon as outputRing holds that many
+	 *  samples (audio thread only). */
+	bool processWorker(bool wait, std::size_t needed = 0);
+	std::size_t moveToOutputRing();
+	
+	AudioFifo &getOutputFifo(int variant);
+	std::ptrdiff_t &getOutputCorrection(int variant);
+	
+	int getListenedVariant() const;
+	
+	/** Takes numSamples from the output of every variant and returns how
+	 *  many of them the one given had; fn gets those. */
+	template <class F>
+	std::size_t readOutput(int variant, std::size_t numSamples, F fn);
+	
+	/** Encodes and decodes a frame from one FIFO to the other. Returns
+	 *  the size of the packet left in packet. */
+	int runCodec(OpusCodec &, int frameSize, AudioFifo &from, AudioFifo &to,
+				 std::vector<unsigned char> &packet, StageStats &,
+				 StageStats::Ticks *encodeTicks = nullptr);
+	
+	/** runCodec for A, through the encode cache. */
+	int runCachedCodec(AudioFifo &from, AudioFifo &to);
+	
+	/** Starts a new lineage; call whenever opusCodec is reset. */
+	void restartEncodeCache();
+	
+	/** Runs the codec over cacheHistory, so that its state is about what
+	 *  it would have been had it not skipped the cached frames, and starts
+	 *  a lineage from there. */
+	void catchUpEncodeCache();
+	
+	/** Picks up startReplay and stopReplay. Pipeline only. */
+	void acquireReplay();
+	void collectReplays();
+	
+	/** Decodes replay frames into to, as many as the input covers. */
+	void runReplay(AudioFifo &to);
+	void seekReplay(std::int64_t position);
+	
+	/** Refills replayBuffer with the next packet. False at the end. */
+	bool decodeReplayPacket();
+	
+	/** Audio thread. Tells the pipeline where the host is. */
+	void noteTimeline(std::int64_t timeline, bool playing);
+	
+	/** Drops everything between the two SRC stages, and works out how
+	 *  much each output needs padding or trimming by to keep the delay
+	 *  where it was reported. */
+	void flushCodecStage();
+	
+	void feedVariants(AudioFifo &from);
+	void startVariants();
+	void runVariant(Variant &);
+	void runVariantIfQueued(Variant &);
+	
+	/** Waits for the variants to finish, running those no codec thread
+	 *  has taken up yet itself. */
+	void finishVariants();
+	
+	/** Runs one SRC stage, converting everything that fits. */
+	void resample(Resampler *, AudioFifo &from, AudioFifo &to);
+	
+	void setCurrentConfig(const CodecConfig &);
+	void publishConfig();
+	
+	/** Audio thread. Queues what the host changed since the last slice. */
+	void sendConfigChange();
+	
+	/** Pipeline. Switches to the queued config that is due at the next
+	 *  frame of A, if any. */
+	void applyPendingConfig();
+	
+	/** Pipeline. The input sample the next frame of A stands for. */
+	double getFrameInputIndex() const;
+	
+	/** Sets the encoder of A up for the next frame. Only what changed
+	 *  reaches libopus. */
+	void updateEncoderSettings();
+	
+	/** Recomputes outputPrefill and pipelineLatency for the current
+	 *  settings. Returns true if the latency changed. */
+	bool updateLatency();
+	void correctOutput();
+	static void correctOutput(AudioFifo &, std::ptrdiff_t &correction);
+	
+	void handleAsyncUpdate() override;
 	
 public:
 	
@@ -115,6 +547,7 @@ public:
 
     const String getParameterName (int index) override;
     const String getParameterText (int index) override;
+    bool isParameterAutomatable (int index) const override;
 
     const String getInputChannelName (int channelIndex) const override;
     const String getOutputChannelName (int channelIndex) const override;
@@ -137,6 +570,69 @@ public:
     void getStateInformation (MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
+	//==============================================================================
+	/** Number of parameter changes picked up by the audio thread so far. */
+	std::uint64_t getNumConfigChangesApplied() const
+	{ return numConfigChangesApplied.load(std::memory_order_relaxed); }
+	
+	/** Like getParameter/setParameter, but also reaches the parameters
+	 *  that aren't shown to the host. */
+	float getParameterValue(Parameter);
+	void setParameterValue(Parameter, float newValue);
+	
+	/** The value of FrameSize (or FrameSizeB, ...) that selects frames of
+	 *  frameSizeTime ms, or -1 if there are no such frames. Its ranges
+	 *  aren't centred on the sizes they select, so frameSizeTime / 60
+	 *  doesn't always do (40ms in particular). */
+	static float getFrameSizeParameterValue(float frameSizeTime);
+	
+	/** The other way around: the frame size in ms a value selects. */
+	static float getFrameSizeTime(float parameterValue);
+	
+	/** End-to-end delay of the settings the audio thread is running with,
+	 *  in host samples. The host is told the same once the message thread
+	 *  gets to it. */
+	int getRoundTripLatency() const
+	{ return pipelineLatency.load(std::memory_order_relaxed); }
+	
+	/** How long each stage has been taking and how often the pipeline
+	 *  had to drop, make up or wait for something, over all variants.
+	 *  Wait-free; can be called from any thread. */
+	StageStats::Snapshot getStageStats() const;
+	
+	/** Starts the figures over. Takes effect when the audio thread next
+	 *  gets to them. */
+	void resetStageStats();
+	
+	/** Saves the packets variant A's encoder produces to an Ogg Opus file
+	 *  until stopCapture. The audio thread only queues them; they are
+	 *  written out in the background. */
+	bool startCapture(const File &);
+	void stopCapture();
+	bool isCapturing() const
+	{ return capture.isCapturing(); }
+	
+	/** Packets left out of the capture because the writer fell behind. */
+	std::uint64_t getNumDroppedCapturePackets() const
+	{ return capture.getNumDroppedPackets(); }
+	
+	/** Plays back an Ogg Opus file (such as a capture) in place of
+	 *  encoding the input: only the decoder and the output SRC run. The
+	 *  start of the file goes with timelineStart seconds into the host
+	 *  timeline, and playback follows the host's position; hosts that
+	 *  don't report one hear the file from the start right away. The
+	 *  input is ignored meanwhile. Not used in A/B mode. */
+	bool startReplay(const File &, double timelineStart = 0.0);
+	void stopReplay();
+	bool isReplaying() const
+	{ return replayRequest.load(std::memory_order_relaxed) != nullptr; }
+
+	/** Offline renders look up frames in the cache given (nullptr for
+	 *  none) and skip Opus for those it has, storing the others. A's
+	 *  encoder only. Takes effect at the next prepareToPlay, and only
+	 *  while isNonRealtime(), since it waits on the disk. */
+	void setEncodeCache(std::shared_ptr<EncodeCache>);
+	
 private:
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RoundTripOpusAudioProcessor)
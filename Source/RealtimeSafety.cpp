@@ -0,0 +1,263 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#include "RealtimeSafety.h"
+
+#if ROUNDTRIPOPUS_REALTIME_CHECKS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+namespace
+{
+	// all zero-initialized, so they work before static constructors run
+	thread_local bool inAudioThread = false;
+	std::atomic<std::uint64_t> numAllocations;
+	std::atomic<std::uint64_t> numDeallocations;
+	std::atomic<std::uint64_t> numLocks;
+	std::atomic<bool> abortOnViolation;
+
+	inline void check(std::atomic<std::uint64_t> &counter)
+	{
+		if (!inAudioThread)
+			return;
+		counter.fetch_add(1, std::memory_order_relaxed);
+		if (abortOnViolation.load(std::memory_order_relaxed))
+			std::abort();
+	}
+
+#ifndef __linux__
+	void *allocate(std::size_t size)
+	{
+		check(numAllocations);
+		if (void *p = std::malloc(size ? size : 1))
+			return p;
+		throw std::bad_alloc();
+	}
+
+	void deallocate(void *p)
+	{
+		if (!p)
+			return;
+		check(numDeallocations);
+		std::free(p);
+	}
+#endif
+}
+
+namespace RealtimeSafety
+{
+	ScopedAudioThread::ScopedAudioThread():
+	previous(inAudioThread)
+	{
+		inAudioThread = true;
+	}
+
+	ScopedAudioThread::~ScopedAudioThread()
+	{
+		inAudioThread = previous;
+	}
+
+	ScopedAllow::ScopedAllow():
+	previous(inAudioThread)
+	{
+		inAudioThread = false;
+	}
+
+	ScopedAllow::~ScopedAllow()
+	{
+		inAudioThread = previous;
+	}
+
+	std::uint64_t getNumAllocations()
+	{
+		return numAllocations.load();
+	}
+
+	std::uint64_t getNumDeallocations()
+	{
+		return numDeallocations.load();
+	}
+
+	std::uint64_t getNumLocks()
+	{
+		return numLocks.load();
+	}
+
+	void setAbortOnViolation(bool enable)
+	{
+		abortOnViolation = enable;
+	}
+}
+
+//==============================================================================
+#ifndef __linux__
+// on Linux malloc and free themselves are replaced below, which catches
+// the C libraries (libopus, libsamplerate) too, and operator new ends up
+// there anyway
+void *operator new(std::size_t size)
+{ return allocate(size); }
+void *operator new[](std::size_t size)
+{ return allocate(size); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	check(numAllocations);
+	return std::malloc(size ? size : 1);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	check(numAllocations);
+	return std::malloc(size ? size : 1);
+}
+void operator delete(void *p) noexcept
+{ deallocate(p); }
+void operator delete[](void *p) noexcept
+{ deallocate(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{ deallocate(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{ deallocate(p); }
+void operator delete(void *p, std::size_t) noexcept
+{ deallocate(p); }
+void operator delete[](void *p, std::size_t) noexcept
+{ deallocate(p); }
+#else
+// these only work with ELF's flat symbol lookup; macOS binds to
+// libSystem's ones by its two-level namespace. the real ones are looked up
+// lazily (glibc's dlsym doesn't lock a pthread mutex) and possibly by
+// several threads at once, hence the atomics.
+namespace
+{
+	using MallocFunction = void *(*)(std::size_t);
+	using CallocFunction = void *(*)(std::size_t, std::size_t);
+	using ReallocFunction = void *(*)(void *, std::size_t);
+	using FreeFunction = void (*)(void *);
+	using LockFunction = int (*)(pthread_mutex_t *);
+	std::atomic<MallocFunction> realMalloc;
+	std::atomic<CallocFunction> realCalloc;
+	std::atomic<ReallocFunction> realRealloc;
+	std::atomic<FreeFunction> realFree;
+	std::atomic<LockFunction> realLock;
+
+	// dlsym may allocate (glibc keeps its error state in calloc'd memory),
+	// which comes back here before the real functions are known. that's
+	// served from this buffer, which is never given back.
+	alignas(std::max_align_t) char bootstrapBuffer[4096];
+	std::atomic<std::size_t> bootstrapUsed;
+	thread_local bool resolving = false;
+
+	void *bootstrapAllocate(std::size_t size)
+	{
+		const std::size_t align = alignof(std::max_align_t);
+		size = (size + align - 1) & ~(align - 1);
+		std::size_t offset = bootstrapUsed.fetch_add(size);
+		if (offset + size > sizeof(bootstrapBuffer))
+			std::abort();
+		return bootstrapBuffer + offset; // zeroed, so calloc is fine too
+	}
+
+	bool isBootstrap(void *p)
+	{
+		return p >= bootstrapBuffer && p < bootstrapBuffer + sizeof(bootstrapBuffer);
+	}
+
+	template <class Function>
+	Function resolve(std::atomic<Function> &function, const char *name)
+	{
+		Function f = function.load(std::memory_order_acquire);
+		if (!f) {
+			resolving = true;
+			f = reinterpret_cast<Function>(dlsym(RTLD_NEXT, name));
+			resolving = false;
+			function.store(f, std::memory_order_release);
+		}
+		return f;
+	}
+}
+
+extern "C" void *malloc(std::size_t size)
+{
+	if (resolving)
+		return bootstrapAllocate(size);
+	MallocFunction real = resolve(realMalloc, "malloc");
+	check(numAllocations);
+	return real(size);
+}
+
+extern "C" void *calloc(std::size_t count, std::size_t size)
+{
+	if (resolving)
+		return bootstrapAllocate(count * size);
+	CallocFunction real = resolve(realCalloc, "calloc");
+	check(numAllocations);
+	return real(count, size);
+}
+
+extern "C" void *realloc(void *p, std::size_t size)
+{
+	if (isBootstrap(p)) {
+		// the size isn't known, so copy as much as there could be
+		void *moved = malloc(size);
+		if (moved) {
+			std::size_t available = bootstrapBuffer + sizeof(bootstrapBuffer) -
+			static_cast<char *>(p);
+			std::memcpy(moved, p, std::min(size, available));
+		}
+		return moved;
+	}
+	if (resolving)
+		return bootstrapAllocate(size);
+	ReallocFunction real = resolve(realRealloc, "realloc");
+	check(numAllocations);
+	return real(p, size);
+}
+
+extern "C" void free(void *p)
+{
+	if (!p || isBootstrap(p))
+		return;
+	FreeFunction real = resolve(realFree, "free");
+	check(numDeallocations);
+	real(p);
+}
+
+// std::mutex and friends end up here
+extern "C" int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+	LockFunction lock = resolve(realLock, "pthread_mutex_lock");
+	check(numLocks);
+	return lock(mutex);
+}
+#endif
+
+#endif
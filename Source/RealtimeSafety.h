@@ -0,0 +1,91 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#ifndef REALTIMESAFETY_H_INCLUDED
+#define REALTIMESAFETY_H_INCLUDED
+
+#include <cstdint>
+
+/**
+ * Debug aid that catches allocations and locks on the audio thread.
+ *
+ * With ROUNDTRIPOPUS_REALTIME_CHECKS defined to 1, this counts every
+ * allocation and lock made while a ScopedAudioThread is alive on the calling
+ * thread. On Linux it replaces malloc, calloc, realloc, free and
+ * pthread_mutex_lock, which covers the C libraries as well as operator new.
+ * Elsewhere a plain definition of those doesn't take the place of the
+ * system's ones, so only the global operator new/delete is replaced: C++
+ * allocations are counted, but not those of libopus or libsamplerate, nor
+ * any locks.
+ *
+ * Since the replacements can end up serving the host process too, this is
+ * meant for the command line tools (their Debug builds turn it on), not for
+ * shipping plugins.
+ *
+ * Without the flag everything here compiles to nothing.
+ */
+#ifndef ROUNDTRIPOPUS_REALTIME_CHECKS
+#define ROUNDTRIPOPUS_REALTIME_CHECKS 0
+#endif
+
+namespace RealtimeSafety
+{
+#if ROUNDTRIPOPUS_REALTIME_CHECKS
+	/** Marks the current thread as the audio thread while alive. Nests. */
+	class ScopedAudioThread
+	{
+		bool previous;
+	public:
+		ScopedAudioThread();
+		~ScopedAudioThread();
+	};
+
+	/** Lifts the checks again for a known-safe section. */
+	class ScopedAllow
+	{
+		bool previous;
+	public:
+		ScopedAllow();
+		~ScopedAllow();
+	};
+
+	std::uint64_t getNumAllocations();
+	std::uint64_t getNumDeallocations();
+	std::uint64_t getNumLocks();
+
+	/** Calls std::abort on the first violation, so a debugger stops right
+	 *  at the culprit. Off by default. */
+	void setAbortOnViolation(bool);
+#else
+	class ScopedAudioThread { public: ScopedAudioThread() {} };
+	class ScopedAllow { public: ScopedAllow() {} };
+
+	inline std::uint64_t getNumAllocations() { return 0; }
+	inline std::uint64_t getNumDeallocations() { return 0; }
+	inline std::uint64_t getNumLocks() { return 0; }
+	inline void setAbortOnViolation(bool) { }
+#endif
+}
+
+#endif  // REALTIMESAFETY_H_INCLUDED
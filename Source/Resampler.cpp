@@ -0,0 +1,462 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#include "Resampler.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define RESAMPLER_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLER_NEON 1
+#endif
+
+// the kernels below work on this many taps at a time
+static const int tapAlignment = 8;
+
+// upsampling factors above this make the tables too big to be worth it
+static const int maxNumPhases = 160;
+
+// new input frames the history holds at once
+static const std::size_t chunkSize = 4096;
+
+static const double pi = 3.14159265358979323846;
+
+//==============================================================================
+std::unique_ptr<Resampler> Resampler::create(int inputRate, int outputRate,
+											 int numChannels,
+											 ResamplerQuality quality)
+{
+	std::unique_ptr<Resampler> resampler;
+	if (quality != ResamplerQuality::LibSampleRate &&
+		PolyphaseResampler::isSupported(inputRate, outputRate)) {
+		resampler.reset(new PolyphaseResampler(inputRate, outputRate,
+											   numChannels, quality));
+	} else {
+		resampler.reset(new LibSampleRateResampler(inputRate, outputRate,
+												   numChannels));
+	}
+	resampler->measure(inputRate, outputRate, numChannels);
+	return resampler;
+}
+
+void Resampler::measure(int inputRate, int outputRate, int numChannels)
+{
+	// push an impulse through and see where and how late it comes out.
+	// libsamplerate doesn't tell, so both kinds are measured the same way.
+	const std::size_t inputFrames = 8192;
+	const std::size_t expected = static_cast<std::size_t>
+	(inputFrames * static_cast<double>(outputRate) / inputRate);
+	const std::size_t outputFrames = expected + 64;
+	std::vector<float> input(inputFrames * numChannels, 0.f);
+	std::vector<float> output(outputFrames * numChannels, 0.f);
+	input[0] = 1.f;
+
+	std::size_t used = 0;
+	std::size_t generated = 0;
+	while (used < inputFrames) {
+		std::size_t usedNow;
+		std::size_t generatedNow = process
+		(input.data() + used * numChannels, inputFrames - used,
+		 output.data() + generated * numChannels, outputFrames - generated,
+		 usedNow);
+		if (!usedNow && !generatedNow)
+			break;
+		used += usedNow;
+		generated += generatedNow;
+	}
+	holdback = generated < expected ? expected - generated : 0;
+
+	// the filters are symmetric, so the peak is the group delay. refine it
+	// with a parabola through the neighbours.
+	std::size_t peak = 0;
+	for (std::size_t i = 1; i < generated; ++i) {
+		if (std::abs(output[i * numChannels]) > std::abs(output[peak * numChannels]))
+			peak = i;
+	}
+	delay = static_cast<double>(peak);
+	if (peak > 0 && peak + 1 < generated) {
+		double a = output[(peak - 1) * numChannels];
+		double b = output[peak * numChannels];
+		double c = output[(peak + 1) * numChannels];
+		double denom = a - 2.0 * b + c;
+		if (denom != 0.0)
+			delay += 0.5 * (a - c) / denom;
+	}
+
+	reset();
+}
+
+//==============================================================================
+LibSampleRateResampler::LibSampleRateResampler(int inputRate, int outputRate,
+											   int numChannels):
+state(src_new(SRC_SINC_FASTEST, numChannels, nullptr)),
+ratio(static_cast<double>(outputRate) / inputRate)
+{ }
+
+LibSampleRateResampler::~LibSampleRateResampler()
+{
+	if (state)
+		src_delete(state);
+}
+
+std::size_t LibSampleRateResampler::process(const float *input, std::size_t inputFrames,
+											float *output, std::size_t outputFrames,
+											std::size_t &inputFramesUsed)
+{
+	SRC_DATA src;
+	src.data_in = const_cast<float*>(input);
+	src.data_out = output;
+	src.src_ratio = ratio;
+	src.input_frames = inputFrames;
+	src.output_frames = outputFrames;
+	src.input_frames_used = 0;
+	src.output_frames_gen = 0;
+	src.end_of_input = 0;
+	src_process(state, &src);
+
+	inputFramesUsed = src.input_frames_used;
+	return static_cast<std::size_t>(src.output_frames_gen);
+}
+
+void LibSampleRateResampler::reset()
+{
+	src_reset(state);
+}
+
+//==============================================================================
+struct PolyphaseResampler::Table
+{
+	int upFactor;   // L
+	int downFactor; // M
+	int numTaps;    // per phase, multiple of tapAlignment
+
+	// numPhases rows of numTaps, each row reversed so that it lines up with
+	// the history going forward
+	std::vector<float> coefs;
+
+	const float *getRow(int phase) const
+	{ return coefs.data() + static_cast<std::size_t>(phase) * numTaps; }
+};
+
+static int greatestCommonDivisor(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static double besselI0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 50; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1.e-12)
+			break;
+	}
+	return sum;
+}
+
+static void getQualitySettings(ResamplerQuality quality, int &taps,
+							   double &beta, double &rolloff)
+{
+	// taps are per phase at unity ratio; roughly 60, 85 and 110 dB of
+	// stopband attenuation
+	switch (quality) {
+		case ResamplerQuality::Low:
+			taps = 16; beta = 6.0; rolloff = 0.85;
+			return;
+		case ResamplerQuality::High:
+			taps = 64; beta = 11.0; rolloff = 0.94;
+			return;
+		default:
+			taps = 32; beta = 8.5; rolloff = 0.91;
+			return;
+	}
+}
+
+static std::shared_ptr<const PolyphaseResampler::Table>
+buildTable(int upFactor, int downFactor, ResamplerQuality quality)
+{
+	int baseTaps;
+	double beta, rolloff;
+	getQualitySettings(quality, baseTaps, beta, rolloff);
+
+	// when decimating the filter has to be longer by the same factor to keep
+	// the transition band as narrow relative to the output rate
+	double stretch = std::max(1.0, static_cast<double>(downFactor) / upFactor);
+	int numTaps = static_cast<int>(std::ceil(baseTaps * stretch));
+	numTaps = (numTaps + tapAlignment - 1) / tapAlignment * tapAlignment;
+
+	auto table = std::make_shared<PolyphaseResampler::Table>();
+	table->upFactor = upFactor;
+	table->downFactor = downFactor;
+	table->numTaps = numTaps;
+	table->coefs.resize(static_cast<std::size_t>(upFactor) * numTaps);
+
+	// prototype lowpass at the upsampled rate, cut off below the lower of
+	// the two Nyquist frequencies
+	int length = upFactor * numTaps;
+	double center = (length - 1) * 0.5;
+	double cutoff = 0.5 * rolloff / std::max(upFactor, downFactor);
+	double norm = 1.0 / besselI0(beta);
+	for (int j = 0; j < length; ++j) {
+		double t = j - center;
+		double x = 2.0 * cutoff * t;
+		double sinc = std::abs(x) < 1.e-9 ? 1.0 : std::sin(pi * x) / (pi * x);
+		double w = 2.0 * j / (length - 1) - 1.0;
+		double window = besselI0(beta * std::sqrt(std::max(0.0, 1.0 - w * w))) * norm;
+
+		// each output only sees every upFactor-th tap, hence the gain
+		double h = 2.0 * cutoff * sinc * window * upFactor;
+
+		int phase = j % upFactor;
+		int tap = j / upFactor;
+		table->coefs[static_cast<std::size_t>(phase) * numTaps + (numTaps - 1 - tap)] =
+		static_cast<float>(h);
+	}
+	return table;
+}
+
+// instances with the same ratio and quality share their tables
+static std::shared_ptr<const PolyphaseResampler::Table>
+getTable(int upFactor, int downFactor, ResamplerQuality quality)
+{
+	static std::mutex lock;
+	static std::map<std::tuple<int, int, int>,
+	std::weak_ptr<const PolyphaseResampler::Table>> tables;
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto &entry = tables[std::make_tuple(upFactor, downFactor, static_cast<int>(quality))];
+	auto table = entry.lock();
+	if (!table) {
+		table = buildTable(upFactor, downFactor, quality);
+		entry = table;
+	}
+	return table;
+}
+
+// computes out[c] = dot(row, x[c]) for every channel. channels are done two
+// at a time so each coefficient load is used twice.
+static void dotProducts(const float *row, const float *const *x, float *out,
+						int numChannels, int numTaps)
+{
+	int c = 0;
+#if defined(__AVX__)
+	for (; c + 1 < numChannels; c += 2) {
+		const float *x0 = x[c], *x1 = x[c + 1];
+		__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+		for (int k = 0; k < numTaps; k += 8) {
+			__m256 h = _mm256_loadu_ps(row + k);
+			acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(h, _mm256_loadu_ps(x0 + k)));
+			acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(h, _mm256_loadu_ps(x1 + k)));
+		}
+		// horizontal sums of both accumulators at once
+		__m256 sum = _mm256_hadd_ps(acc0, acc1);
+		sum = _mm256_hadd_ps(sum, sum);
+		__m128 lanes = _mm_add_ps(_mm256_castps256_ps128(sum),
+								  _mm256_extractf128_ps(sum, 1));
+		out[c] = _mm_cvtss_f32(lanes);
+		out[c + 1] = _mm_cvtss_f32(_mm_shuffle_ps(lanes, lanes, 1));
+	}
+	for (; c < numChannels; ++c) {
+		const float *x0 = x[c];
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < numTaps; k += 8)
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(row + k),
+												   _mm256_loadu_ps(x0 + k)));
+		__m128 lanes = _mm_add_ps(_mm256_castps256_ps128(acc),
+								  _mm256_extractf128_ps(acc, 1));
+		lanes = _mm_add_ps(lanes, _mm_movehl_ps(lanes, lanes));
+		lanes = _mm_add_ss(lanes, _mm_shuffle_ps(lanes, lanes, 1));
+		out[c] = _mm_cvtss_f32(lanes);
+	}
+#elif defined(RESAMPLER_SSE)
+	for (; c + 1 < numChannels; c += 2) {
+		const float *x0 = x[c], *x1 = x[c + 1];
+		__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+		for (int k = 0; k < numTaps; k += 4) {
+			__m128 h = _mm_loadu_ps(row + k);
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(h, _mm_loadu_ps(x0 + k)));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(h, _mm_loadu_ps(x1 + k)));
+		}
+		// transpose-add so that lane 0 and 1 hold the two sums
+		__m128 lo = _mm_unpacklo_ps(acc0, acc1);
+		__m128 hi = _mm_unpackhi_ps(acc0, acc1);
+		__m128 sum = _mm_add_ps(lo, hi);
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		out[c] = _mm_cvtss_f32(sum);
+		out[c + 1] = _mm_cvtss_f32(_mm_shuffle_ps(sum, sum, 1));
+	}
+	for (; c < numChannels; ++c) {
+		const float *x0 = x[c];
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < numTaps; k += 4)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(row + k),
+											 _mm_loadu_ps(x0 + k)));
+		acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+		acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+		out[c] = _mm_cvtss_f32(acc);
+	}
+#elif defined(RESAMPLER_NEON)
+	for (; c + 1 < numChannels; c += 2) {
+		const float *x0 = x[c], *x1 = x[c + 1];
+		float32x4_t acc0 = vdupq_n_f32(0.f), acc1 = vdupq_n_f32(0.f);
+		for (int k = 0; k < numTaps; k += 4) {
+			float32x4_t h = vld1q_f32(row + k);
+			acc0 = vmlaq_f32(acc0, h, vld1q_f32(x0 + k));
+			acc1 = vmlaq_f32(acc1, h, vld1q_f32(x1 + k));
+		}
+		float32x2_t sum = vpadd_f32(vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0)),
+									vadd_f32(vget_low_f32(acc1), vget_high_f32(acc1)));
+		out[c] = vget_lane_f32(sum, 0);
+		out[c + 1] = vget_lane_f32(sum, 1);
+	}
+	for (; c < numChannels; ++c) {
+		const float *x0 = x[c];
+		float32x4_t acc = vdupq_n_f32(0.f);
+		for (int k = 0; k < numTaps; k += 4)
+			acc = vmlaq_f32(acc, vld1q_f32(row + k), vld1q_f32(x0 + k));
+		float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+		out[c] = vget_lane_f32(vpadd_f32(sum, sum), 0);
+	}
+#endif
+	for (; c < numChannels; ++c) {
+		const float *x0 = x[c];
+		float acc = 0.f;
+		for (int k = 0; k < numTaps; ++k)
+			acc += row[k] * x0[k];
+		out[c] = acc;
+	}
+}
+
+//==============================================================================
+bool PolyphaseResampler::isSupported(int inputRate, int outputRate)
+{
+	if (inputRate <= 0 || outputRate <= 0)
+		return false;
+	int gcd = greatestCommonDivisor(inputRate, outputRate);
+	return outputRate / gcd <= maxNumPhases;
+}
+
+PolyphaseResampler::PolyphaseResampler(int inputRate, int outputRate,
+									   int numChannels,
+									   ResamplerQuality quality):
+numChannels(numChannels)
+{
+	assert(isSupported(inputRate, outputRate));
+	int gcd = greatestCommonDivisor(inputRate, outputRate);
+	table = getTable(outputRate / gcd, inputRate / gcd, quality);
+
+	historyCapacity = table->numTaps - 1 + chunkSize;
+	history.resize(historyCapacity * numChannels);
+	reset();
+}
+
+void PolyphaseResampler::reset()
+{
+	// start with a full filter's worth of silence
+	std::fill(history.begin(), history.end(), 0.f);
+	historyLength = table->numTaps - 1;
+	position = historyLength * table->upFactor;
+}
+
+std::size_t PolyphaseResampler::process(const float *input, std::size_t inputFrames,
+										float *output, std::size_t outputFrames,
+										std::size_t &inputFramesUsed)
+{
+	const Table &t = *table;
+	std::size_t numTaps = t.numTaps;
+	std::size_t upFactor = t.upFactor;
+
+	const float *x[32];
+	float frame[32];
+	assert(numChannels <= 32);
+
+	// the history only holds chunkSize frames of new input, so go around
+	// until either side runs out
+	std::size_t generated = 0;
+	inputFramesUsed = 0;
+	for (;;) {
+		std::size_t taken = std::min(inputFrames - inputFramesUsed,
+									 historyCapacity - historyLength);
+		for (int c = 0; c < numChannels; ++c) {
+			float *dest = history.data() + c * historyCapacity + historyLength;
+			const float *src = input + inputFramesUsed * numChannels + c;
+			for (std::size_t i = 0; i < taken; ++i) {
+				dest[i] = *src;
+				src += numChannels;
+			}
+		}
+		historyLength += taken;
+		inputFramesUsed += taken;
+
+		while (generated < outputFrames) {
+			std::size_t index = position / upFactor;
+			if (index >= historyLength)
+				break;
+
+			const float *row = t.getRow(static_cast<int>(position % upFactor));
+			for (int c = 0; c < numChannels; ++c)
+				x[c] = history.data() + c * historyCapacity + index + 1 - numTaps;
+			dotProducts(row, x, frame, numChannels, t.numTaps);
+
+			std::memcpy(output + generated * numChannels, frame,
+						numChannels * sizeof(float));
+			++generated;
+			position += t.downFactor;
+		}
+
+		// drop what the next output doesn't need anymore
+		std::size_t firstNeeded = position / upFactor + 1 - numTaps;
+		std::size_t dropped = std::min(firstNeeded, historyLength);
+		if (dropped > 0) {
+			for (int c = 0; c < numChannels; ++c) {
+				float *base = history.data() + c * historyCapacity;
+				std::memmove(base, base + dropped,
+							 (historyLength - dropped) * sizeof(float));
+			}
+			historyLength -= dropped;
+			position -= dropped * upFactor;
+		}
+
+		if (generated == outputFrames || inputFramesUsed == inputFrames)
+			break;
+	}
+
+	return generated;
+}
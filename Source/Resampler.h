@@ -0,0 +1,143 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+#ifndef RESAMPLER_H_INCLUDED
+#define RESAMPLER_H_INCLUDED
+
+#include <samplerate.h>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+enum class ResamplerQuality
+{
+	Low,
+	Medium,
+	High,
+
+	/** Always use libsamplerate. */
+	LibSampleRate
+};
+
+/**
+ * Converts interleaved frames from one fixed sampling rate to another.
+ *
+ * Instances are created (and their tables built) off the audio thread;
+ * process() and reset() never allocate.
+ */
+class Resampler
+{
+public:
+	virtual ~Resampler() {}
+
+	/** Converts as much as possible. Returns the number of frames written
+	 *  to output and stores the number of frames taken from input in
+	 *  inputFramesUsed. */
+	virtual std::size_t process(const float *input, std::size_t inputFrames,
+								float *output, std::size_t outputFrames,
+								std::size_t &inputFramesUsed) = 0;
+
+	/** Forgets all past input. */
+	virtual void reset() = 0;
+
+	/** Group delay of the filter, in output frames. */
+	double getDelay() const { return delay; }
+
+	/** How many output frames the converter can fall behind input frames
+	 *  times the ratio, because it holds input back for its filter. */
+	std::size_t getHoldback() const { return holdback; }
+
+	/** Uses a PolyphaseResampler if the ratio is supported and the quality
+	 *  asks for one, libsamplerate otherwise. */
+	static std::unique_ptr<Resampler> create(int inputRate, int outputRate,
+											 int numChannels,
+											 ResamplerQuality quality);
+
+protected:
+	Resampler(): delay(0.0), holdback(0) {}
+
+private:
+	double delay;
+	std::size_t holdback;
+
+	void measure(int inputRate, int outputRate, int numChannels);
+};
+
+/** libsamplerate, SRC_SINC_FASTEST. Handles any ratio. */
+class LibSampleRateResampler : public Resampler
+{
+	SRC_STATE *state;
+	double ratio;
+
+public:
+	LibSampleRateResampler(int inputRate, int outputRate, int numChannels);
+	~LibSampleRateResampler();
+
+	std::size_t process(const float *input, std::size_t inputFrames,
+						float *output, std::size_t outputFrames,
+						std::size_t &inputFramesUsed) override;
+	void reset() override;
+};
+
+/**
+ * Windowed-sinc polyphase resampler for rational ratios with a small
+ * numerator, which covers all the fixed ratios between common host rates
+ * and the Opus rates (e.g. 44.1k -> 48k is 160/147).
+ *
+ * All channels of an output frame are computed against the same row of
+ * coefficients, using SSE/AVX or NEON for the dot products where the build
+ * targets them.
+ */
+class PolyphaseResampler : public Resampler
+{
+public:
+	struct Table;
+
+private:
+	std::shared_ptr<const Table> table;
+	int numChannels;
+
+	// per-channel input history. the dot products run over this, so it's
+	// stored planar even though the interface is interleaved.
+	std::vector<float> history;
+	std::size_t historyCapacity;
+	std::size_t historyLength;
+
+	// position of the next output frame in the history, in units of
+	// 1 / upsampling factor
+	std::size_t position;
+
+public:
+	PolyphaseResampler(int inputRate, int outputRate, int numChannels,
+					   ResamplerQuality quality);
+
+	static bool isSupported(int inputRate, int outputRate);
+
+	std::size_t process(const float *input, std::size_t inputFrames,
+						float *output, std::size_t outputFrames,
+						std::size_t &inputFramesUsed) override;
+	void reset() override;
+};
+
+#endif  // RESAMPLER_H_INCLUDED
@@ -0,0 +1,181 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "StageStats.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace
+{
+	// taken when the library is loaded, so that by the time anyone reads
+	// the stats the calibration interval is usually long over
+	const auto referenceTime = std::chrono::steady_clock::now();
+	const StageStats::Ticks referenceTicks = StageStats::now();
+
+	int getMostSignificantBit(std::uint64_t x)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanReverse64(&index, x);
+		return static_cast<int>(index);
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (x >> 32) {
+			_BitScanReverse(&index, static_cast<unsigned long>(x >> 32));
+			return static_cast<int>(index) + 32;
+		}
+		_BitScanReverse(&index, static_cast<unsigned long>(x));
+		return static_cast<int>(index);
+#else
+		return 63 - __builtin_clzll(x);
+#endif
+	}
+}
+
+const int StageStats::bucketsPerOctave;
+const int StageStats::numBuckets;
+
+StageStats::StageStats():
+resetRequests(0),
+resetsDone(0)
+{
+	clear();
+}
+
+void StageStats::clear()
+{
+	resetsDone = resetRequests.load(std::memory_order_relaxed);
+	for (Figures &f: figures) {
+		f.count.store(0, std::memory_order_relaxed);
+		f.sum.store(0, std::memory_order_relaxed);
+		f.min.store(0, std::memory_order_relaxed);
+		f.max.store(0, std::memory_order_relaxed);
+		for (auto &bucket: f.histogram)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+	for (auto &counter: events)
+		counter.store(0, std::memory_order_relaxed);
+}
+
+// below bucketsPerOctave ticks every value has a bucket of its own; above,
+// each octave is split into bucketsPerOctave equal parts
+int StageStats::getBucket(Ticks ticks)
+{
+	if (ticks < static_cast<Ticks>(bucketsPerOctave))
+		return static_cast<int>(ticks);
+	int msb = getMostSignificantBit(ticks);
+	int sub = static_cast<int>((ticks >> (msb - 3)) & (bucketsPerOctave - 1));
+	return (msb - 2) * bucketsPerOctave + sub;
+}
+
+double StageStats::getBucketTicks(int bucket)
+{
+	if (bucket < bucketsPerOctave)
+		return bucket;
+	int msb = bucket / bucketsPerOctave + 2;
+	int sub = bucket % bucketsPerOctave;
+	double width = std::ldexp(1.0, msb - 3);
+	return (bucketsPerOctave + sub + 0.5) * width;
+}
+
+double StageStats::getTicksPerNanosecond()
+{
+	static const double ticksPerNanosecond = [] {
+		using namespace std::chrono;
+		// a few ms are plenty for a counter running at GHz
+		auto minimum = milliseconds(20);
+		auto elapsed = steady_clock::now() - referenceTime;
+		if (elapsed < minimum)
+			std::this_thread::sleep_for(minimum - elapsed);
+		Ticks ticks = now() - referenceTicks;
+		auto ns = duration_cast<nanoseconds>(steady_clock::now() - referenceTime).count();
+		return ns > 0 ? static_cast<double>(ticks) / ns : 1.0;
+	}();
+	return ticksPerNanosecond;
+}
+
+StageStats::Snapshot StageStats::getSnapshot(const StageStats *const *stats,
+											 std::size_t numStats)
+{
+	Snapshot snapshot;
+	double scale = 1.0 / getTicksPerNanosecond();
+	std::uint64_t histogram[numBuckets];
+
+	for (int stage = 0; stage < numStages; ++stage) {
+		std::uint64_t count = 0;
+		Ticks sum = 0, min = 0, max = 0;
+		std::fill(histogram, histogram + numBuckets, 0);
+
+		for (std::size_t i = 0; i < numStats; ++i) {
+			const Figures &f = stats[i]->figures[stage];
+			std::uint64_t n = f.count.load(std::memory_order_relaxed);
+			if (!n)
+				continue;
+			Ticks fmin = f.min.load(std::memory_order_relaxed);
+			min = count ? std::min(min, fmin) : fmin;
+			max = std::max(max, f.max.load(std::memory_order_relaxed));
+			sum += f.sum.load(std::memory_order_relaxed);
+			count += n;
+			for (int b = 0; b < numBuckets; ++b)
+				histogram[b] += f.histogram[b].load(std::memory_order_relaxed);
+		}
+
+		Summary &summary = snapshot.stages[stage];
+		summary.count = count;
+		summary.min = min * scale;
+		summary.max = max * scale;
+		summary.mean = count ? sum * scale / count : 0.0;
+
+		// the bucket the 99th percentile falls in, held within the range
+		// actually seen
+		std::uint64_t total = 0;
+		for (int b = 0; b < numBuckets; ++b)
+			total += histogram[b];
+		std::uint64_t target = (total * 99 + 99) / 100;
+		double p99 = 0.0;
+		std::uint64_t seen = 0;
+		for (int b = 0; b < numBuckets && total; ++b) {
+			seen += histogram[b];
+			if (seen >= target) {
+				p99 = getBucketTicks(b);
+				break;
+			}
+		}
+		summary.p99 = count ? std::min(std::max(p99, (double)min), (double)max) * scale : 0.0;
+	}
+
+	for (int event = 0; event < numEvents; ++event) {
+		std::uint64_t count = 0;
+		for (std::size_t i = 0; i < numStats; ++i)
+			count += stats[i]->events[event].load(std::memory_order_relaxed);
+		snapshot.events[event] = count;
+	}
+	return snapshot;
+}
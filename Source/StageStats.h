@@ -0,0 +1,227 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef STAGESTATS_H_INCLUDED
+#define STAGESTATS_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+/**
+ * Timings of the stages of the pipeline and counts of the things that go
+ * wrong in it, kept by whichever thread runs them and readable from any
+ * other without disturbing it.
+ *
+ * Only one thread may add to an instance at a time; the pipeline keeps one
+ * per thread that can be running it. Every figure is a relaxed atomic that
+ * only its writer changes, so reading is wait-free for any number of
+ * readers. A snapshot is not taken at a single instant, though: a count
+ * and its sum may be a sample apart.
+ *
+ * Durations are kept in ticks of the CPU's cycle counter (or of
+ * steady_clock where there is none) and converted to nanoseconds when
+ * read. Percentiles come from a histogram with eight buckets per octave,
+ * so they are within about 9%.
+ */
+class StageStats
+{
+public:
+	enum Stage
+	{
+		InputSrc,
+		Encode,
+		Decode,
+		OutputSrc,
+
+		/** Host buffers in and out of the pipeline, per slice. */
+		FifoCopy,
+
+		numStages
+	};
+
+	enum Event
+	{
+		/** Input had to be dropped because the pipeline was full. */
+		Overrun,
+
+		/** Output had to be made up because the pipeline ran dry. */
+		Underrun,
+
+		/** A thread had to wait for another one to finish. */
+		Stall,
+
+		/** A frame boundary passed with new settings on hold because
+		 *  their codec wasn't built yet. */
+		CodecNotReady,
+
+		/** The worker fell behind and the audio thread did its pass
+		 *  itself, as far as the output that was due, so this callback
+		 *  ran whole encodes. Only with Worker Takeover on; otherwise
+		 *  it's an Underrun. */
+		Takeover,
+
+		/** A slice of silence went around the pipeline, everything in
+		 *  flight being silent too. */
+		SilenceSkipped,
+
+		numEvents
+	};
+
+	using Ticks = std::uint64_t;
+
+	static Ticks now()
+	{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+		return __rdtsc();
+#elif defined(__aarch64__)
+		std::uint64_t ticks;
+		asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+		return ticks;
+#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+
+	struct Summary
+	{
+		std::uint64_t count;
+
+		// ns; all zero if count is
+		double min;
+		double mean;
+		double max;
+		double p99;
+	};
+
+	struct Snapshot
+	{
+		Summary stages[numStages];
+		std::uint64_t events[numEvents];
+	};
+
+	StageStats();
+
+	/** Writer side. */
+	void add(Stage stage, Ticks elapsed)
+	{
+		checkReset();
+		Figures &f = figures[stage];
+		std::uint64_t count = f.count.load(std::memory_order_relaxed);
+		f.sum.store(f.sum.load(std::memory_order_relaxed) + elapsed,
+					std::memory_order_relaxed);
+		if (!count || elapsed < f.min.load(std::memory_order_relaxed))
+			f.min.store(elapsed, std::memory_order_relaxed);
+		if (elapsed > f.max.load(std::memory_order_relaxed))
+			f.max.store(elapsed, std::memory_order_relaxed);
+		auto &bucket = f.histogram[getBucket(elapsed)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+					 std::memory_order_relaxed);
+		f.count.store(count + 1, std::memory_order_relaxed);
+	}
+
+	/** Writer side. */
+	void count(Event event)
+	{
+		checkReset();
+		auto &counter = events[event];
+		counter.store(counter.load(std::memory_order_relaxed) + 1,
+					  std::memory_order_relaxed);
+	}
+
+	/** Any thread. The writer starts over the next time it adds something. */
+	void reset()
+	{
+		resetRequests.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/** Any thread. Adds up the figures of several instances. */
+	static Snapshot getSnapshot(const StageStats *const *stats, std::size_t numStats);
+
+	Snapshot getSnapshot() const
+	{
+		const StageStats *self = this;
+		return getSnapshot(&self, 1);
+	}
+
+	/** Measured against steady_clock the first time it's needed, which
+	 *  takes a few ms; not for the audio thread until then. */
+	static double getTicksPerNanosecond();
+
+private:
+	static const int bucketsPerOctave = 8;
+	static const int numBuckets = 64 * bucketsPerOctave;
+
+	struct Figures
+	{
+		std::atomic<std::uint64_t> count;
+		std::atomic<Ticks> sum;
+		std::atomic<Ticks> min;
+		std::atomic<Ticks> max;
+		std::atomic<std::uint32_t> histogram[numBuckets];
+	};
+
+	Figures figures[numStages];
+	std::atomic<std::uint64_t> events[numEvents];
+
+	std::atomic<std::uint32_t> resetRequests;
+	std::uint32_t resetsDone; // writer only
+
+	void checkReset()
+	{
+		if (resetRequests.load(std::memory_order_relaxed) != resetsDone)
+			clear();
+	}
+	void clear();
+
+	static int getBucket(Ticks ticks);
+	static double getBucketTicks(int bucket);
+};
+
+/** Times a scope and adds it to a StageStats on the way out. */
+class ScopedStageTimer
+{
+	StageStats &stats;
+	StageStats::Stage stage;
+	StageStats::Ticks start;
+
+public:
+	ScopedStageTimer(StageStats &stats, StageStats::Stage stage):
+	stats(stats), stage(stage), start(StageStats::now())
+	{ }
+	~ScopedStageTimer()
+	{
+		stats.add(stage, StageStats::now() - start);
+	}
+};
+
+#endif  // STAGESTATS_H_INCLUDED
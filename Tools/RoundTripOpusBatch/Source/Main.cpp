@@ -0,0 +1,768 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+// RoundTripOpusBatch: feeds audio files through RoundTripOpusAudioProcessor
+// offline, one file per worker thread. With -S it instead measures the
+// result against the input over a grid of settings.
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "../../../Source/PluginProcessor.h"
+#include "QualityMetrics.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+	using Application = RoundTripOpusAudioProcessor::Application;
+
+	struct Options
+	{
+		int samplingRate = 48000;
+		int bitRate = 64000;
+		float frameSizeTime = 40.f; // ms
+		Application application = Application::Audio;
+		ResamplerQuality resamplerQuality = ResamplerQuality::Medium;
+		bool lowLatency = false;
+		bool dtx = false;
+		bool workerThread = false;
+		int blockSize = 4096;
+		int numThreads = 0;
+		File outputDirectory;
+		bool capture = false;
+		bool replay = false;
+		std::shared_ptr<EncodeCache> encodeCache;
+		bool sweep = false;
+		bool json = false;
+		bool verbose = false;
+	};
+
+	/** Values of -r, -b, -f and -a. Only a sweep takes more than one. */
+	struct SweepGrid
+	{
+		std::vector<int> samplingRates;
+		std::vector<int> bitRates;
+		std::vector<float> frameSizeTimes;
+		std::vector<Application> applications;
+
+		std::size_t getNumPoints() const
+		{
+			return samplingRates.size() * bitRates.size() *
+			frameSizeTimes.size() * applications.size();
+		}
+	};
+
+	struct SweepResult
+	{
+		File input;
+		Options options;
+		bool done = false;
+		int latency = 0;
+		float frameSizeTime = 0.f; // ms, as applied; see roundTrip
+		double speed = 0.0; // x realtime
+		QualityMetrics::Result metrics;
+	};
+
+	const char *const applicationNames[] = {"audio", "voip", "lowdelay"};
+
+	std::mutex printLock;
+
+	// shared by all jobs; only touched when a job finishes
+	std::atomic<double> totalAudioSeconds {0.0};
+	std::atomic<int> numFailedFiles {0};
+
+	void printUsage()
+	{
+		std::printf
+		("usage: RoundTripOpusBatch [OPTIONS] INPUT...\n"
+		 "\n"
+		 "Encodes and decodes each INPUT with Opus and writes the result as\n"
+		 "a WAV file. Files are processed in parallel.\n"
+		 "\n"
+		 "With -S, nothing is written; instead every combination of the\n"
+		 "comma separated values given to -r, -b, -f and -a is run on every\n"
+		 "INPUT and compared with it, and a table goes to stdout.\n"
+		 "\n"
+		 "  -o DIR     output directory (default: next to each input)\n"
+		 "  -r RATE    Opus sampling rate [8000, 12000, 16000, 24000, 48000]\n"
+		 "  -b BPS     bit rate [600 - 512000] (default: 64000)\n"
+		 "  -f MS      frame size [2.5, 5, 10, 20, 40, 60] (default: 40)\n"
+		 "  -a APP     application [audio, voip, lowdelay] (default: audio)\n"
+		 "  -q QUALITY resampler [low, medium, high, libsamplerate]\n"
+		 "             (default: medium)\n"
+		 "  -L         low latency mode (frame size follows -B, -f and -a\n"
+		 "             are ignored)\n"
+		 "  -x         let the encoder skip near silent frames (DTX)\n"
+		 "  -t         run the codec through the worker thread path\n"
+		 "  -B N       samples per processBlock call (default: 4096)\n"
+		 "  -j N       number of worker threads (default: number of CPUs)\n"
+		 "  -O         also save the encoded packets as an Ogg Opus file\n"
+		 "             (INPUT-opus.opus, next to the WAV file)\n"
+		 "  -P         decode the packets saved by -O instead of encoding\n"
+		 "             INPUT again (INPUT is still needed for its length)\n"
+		 "  -C DIR     keep what Opus made of each frame in DIR, and reuse it\n"
+		 "             when the same audio is run with the same settings\n"
+		 "  -M MB      size limit of the -C directory (default: 1024)\n"
+		 "  -v         print how long each stage took, per file\n"
+		 "  -S         quality sweep (SNR, segmental SNR, log-spectral\n"
+		 "             distance and per-band SNR, as CSV)\n"
+		 "  -J         print the sweep table as JSON instead\n");
+	}
+
+	void addAudioSeconds(double seconds)
+	{
+		double prev = totalAudioSeconds.load();
+		while (!totalAudioSeconds.compare_exchange_weak(prev, prev + seconds)) {
+			// retry
+		}
+	}
+
+	void fail(const File &inputFile, const char *reason)
+	{
+		std::lock_guard<std::mutex> lock(printLock);
+		std::fprintf(stderr, "%s: %s\n",
+					 inputFile.getFullPathName().toRawUTF8(), reason);
+		++numFailedFiles;
+	}
+
+	void printStageStats(const File &inputFile, const StageStats::Snapshot &stats)
+	{
+		static const char *const stageNames[StageStats::numStages] =
+		{"input SRC", "encode", "decode", "output SRC", "FIFO copy"};
+
+		std::lock_guard<std::mutex> lock(printLock);
+		std::fprintf(stderr, "%s:\n", inputFile.getFullPathName().toRawUTF8());
+		for (int i = 0; i < StageStats::numStages; ++i) {
+			const StageStats::Summary &stage = stats.stages[i];
+			if (!stage.count)
+				continue;
+			std::fprintf(stderr, "  %-10s %8llu x  min %8.1f  mean %8.1f  "
+						 "p99 %8.1f  max %8.1f us\n", stageNames[i],
+						 (unsigned long long)stage.count, stage.min * 1.e-3,
+						 stage.mean * 1.e-3, stage.p99 * 1.e-3, stage.max * 1.e-3);
+		}
+		std::fprintf(stderr, "  %llu overrun(s), %llu underrun(s), %llu stall(s), "
+					 "%llu frame(s) waiting for a codec, %llu silent slice(s) skipped\n",
+					 (unsigned long long)stats.events[StageStats::Overrun],
+					 (unsigned long long)stats.events[StageStats::Underrun],
+					 (unsigned long long)stats.events[StageStats::Stall],
+					 (unsigned long long)stats.events[StageStats::CodecNotReady],
+					 (unsigned long long)stats.events[StageStats::SilenceSkipped]);
+	}
+
+	bool isSupportedChannelCount(const AudioFormatReader &reader)
+	{
+		return reader.numChannels >= 1 &&
+		(int)reader.numChannels <= RoundTripOpusAudioProcessor::maxNumChannels;
+	}
+
+	/**
+	 * Streams the whole of reader through a processor set up after options,
+	 * in host-sized blocks so memory use doesn't depend on the length of
+	 * the input. fn(block, start, count, pos) gets the output lined up with
+	 * the input: sample start of block goes with input sample pos.
+	 * Returns the latency that was trimmed off, and the frame size (ms) the
+	 * processor went with in frameSizeTime. With -O the packets are saved
+	 * to packetFile as well; with -P they are taken from there.
+	 */
+	template <class F>
+	int roundTrip(AudioFormatReader &reader, const Options &options,
+				  const File &packetFile, ThreadPoolJob &job,
+				  StageStats::Snapshot &stats, float &frameSizeTime, F fn)
+	{
+		using Parameter = RoundTripOpusAudioProcessor::Parameter;
+
+		int numChannels = static_cast<int>(reader.numChannels);
+
+		RoundTripOpusAudioProcessor processor;
+		processor.setPlayConfigDetails(numChannels, numChannels,
+									   reader.sampleRate, options.blockSize);
+		processor.setNonRealtime(true);
+		processor.setParameterValue(Parameter::SamplingRate,
+									options.samplingRate / 48000.f);
+		processor.setParameterValue(Parameter::Bitrate,
+									options.bitRate / 512000.f);
+		processor.setParameterValue(Parameter::FrameSize,
+									RoundTripOpusAudioProcessor::getFrameSizeParameterValue
+									(options.frameSizeTime));
+		processor.setParameterValue(Parameter::Application,
+									(float)options.application / 2.f);
+		processor.setParameterValue(Parameter::ResamplerQuality,
+									(float)options.resamplerQuality / 3.f);
+		processor.setParameterValue(Parameter::LowLatency,
+									options.lowLatency ? 1.f : 0.f);
+		processor.setParameterValue(Parameter::Dtx, options.dtx ? 1.f : 0.f);
+		processor.setParameterValue(Parameter::WorkerThread,
+									options.workerThread ? 1.f : 0.f);
+		processor.setEncodeCache(options.encodeCache);
+		processor.prepareToPlay(reader.sampleRate, options.blockSize);
+		frameSizeTime = RoundTripOpusAudioProcessor::getFrameSizeTime
+		(processor.getParameterValue(Parameter::FrameSize));
+
+		if (options.capture && !processor.startCapture(packetFile))
+			fail(packetFile, "cannot create the capture file");
+		if (options.replay && !processor.startReplay(packetFile))
+			fail(packetFile, "cannot read the packets");
+
+		AudioSampleBuffer buffer(numChannels, options.blockSize);
+		MidiBuffer midi;
+
+		// the output lags by the reported latency. run that much silence
+		// through at the end and drop it from the start, so the output
+		// lines up with the input sample for sample.
+		std::int64_t length = reader.lengthInSamples;
+		std::int64_t latency = processor.getLatencySamples();
+		for (std::int64_t pos = 0; pos < length + latency;) {
+			if (job.shouldExit())
+				break;
+
+			int numSamples = (int)std::min<std::int64_t>
+			(options.blockSize, length + latency - pos);
+
+			AudioSampleBuffer block(buffer.getArrayOfWritePointers(),
+									numChannels, numSamples);
+			// reads past the end come back as silence
+			reader.read(&block, 0, numSamples, pos, true, true);
+			processor.processBlock(block, midi);
+
+			int skip = (int)jlimit<std::int64_t>(0, numSamples, latency - pos);
+			if (skip < numSamples)
+				fn(block, skip, numSamples - skip, pos + skip - latency);
+
+			pos += numSamples;
+		}
+
+		stats = processor.getStageStats();
+		processor.stopCapture();
+		processor.stopReplay();
+		if (processor.getNumDroppedCapturePackets())
+			fail(packetFile, "packets were left out; the disk could not keep up");
+		processor.releaseResources();
+		return (int)latency;
+	}
+
+	class RoundTripJob : public ThreadPoolJob
+	{
+		File inputFile;
+		File outputFile;
+		File packetFile;
+		const Options &options;
+
+	public:
+		RoundTripJob(const File &inputFile, const File &outputFile,
+					 const File &packetFile, const Options &options):
+		ThreadPoolJob(inputFile.getFileName()),
+		inputFile(inputFile),
+		outputFile(outputFile),
+		packetFile(packetFile),
+		options(options)
+		{ }
+
+		JobStatus runJob() override
+		{
+			double startTime = Time::getMillisecondCounterHiRes();
+
+			AudioFormatManager formatManager;
+			formatManager.registerBasicFormats();
+
+			std::unique_ptr<AudioFormatReader> reader
+			(formatManager.createReaderFor(inputFile));
+			if (!reader) {
+				fail(inputFile, "unsupported or unreadable file");
+				return jobHasFinished;
+			}
+			if (!isSupportedChannelCount(*reader)) {
+				fail(inputFile, "too many channels");
+				return jobHasFinished;
+			}
+			int numChannels = static_cast<int>(reader->numChannels);
+
+			outputFile.deleteFile();
+			std::unique_ptr<FileOutputStream> outStream
+			(outputFile.createOutputStream());
+			if (!outStream) {
+				fail(inputFile, "cannot create the output file");
+				return jobHasFinished;
+			}
+
+			int bitsPerSample = reader->usesFloatingPointData ?
+			32 : std::max(16, std::min(24, (int)reader->bitsPerSample));
+
+			WavAudioFormat wavFormat;
+			std::unique_ptr<AudioFormatWriter> writer
+			(wavFormat.createWriterFor(outStream.get(), reader->sampleRate,
+									   numChannels, bitsPerSample,
+									   StringPairArray(), 0));
+			if (!writer) {
+				fail(inputFile, "cannot create a WAV writer");
+				return jobHasFinished;
+			}
+			outStream.release(); // owned by the writer now
+
+			StageStats::Snapshot stats;
+			float frameSizeTime;
+			int latency = roundTrip
+			(*reader, options, packetFile, *this, stats, frameSizeTime,
+			 [&](const AudioSampleBuffer &block, int start, int count, std::int64_t) {
+				writer->writeFromAudioSampleBuffer(block, start, count);
+			});
+			writer.reset();
+
+			double elapsed = (Time::getMillisecondCounterHiRes() - startTime) * 0.001;
+			double audioSeconds = reader->lengthInSamples / reader->sampleRate;
+			addAudioSeconds(audioSeconds);
+
+			{
+				std::lock_guard<std::mutex> lock(printLock);
+				std::printf("%s: %.1fs of audio in %.2fs (%.1fx realtime), "
+							"%g ms frames, latency %d samples\n",
+							outputFile.getFullPathName().toRawUTF8(),
+							audioSeconds, elapsed,
+							elapsed > 0.0 ? audioSeconds / elapsed : 0.0,
+							frameSizeTime, latency);
+			}
+			if (options.verbose)
+				printStageStats(inputFile, stats);
+
+			return jobHasFinished;
+		}
+	};
+
+	/** One file at one point of the grid. */
+	class SweepJob : public ThreadPoolJob
+	{
+		SweepResult &result;
+
+	public:
+		SweepJob(SweepResult &result):
+		ThreadPoolJob(result.input.getFileName()),
+		result(result)
+		{ }
+
+		JobStatus runJob() override
+		{
+			const File &inputFile = result.input;
+			double startTime = Time::getMillisecondCounterHiRes();
+
+			AudioFormatManager formatManager;
+			formatManager.registerBasicFormats();
+
+			// a second reader follows behind with the reference, so neither
+			// of them has to seek
+			std::unique_ptr<AudioFormatReader> reader
+			(formatManager.createReaderFor(inputFile));
+			std::unique_ptr<AudioFormatReader> referenceReader
+			(formatManager.createReaderFor(inputFile));
+			if (!reader || !referenceReader) {
+				fail(inputFile, "unsupported or unreadable file");
+				return jobHasFinished;
+			}
+			if (!isSupportedChannelCount(*reader)) {
+				fail(inputFile, "too many channels");
+				return jobHasFinished;
+			}
+			int numChannels = static_cast<int>(reader->numChannels);
+
+			QualityMetrics metrics(reader->sampleRate, numChannels);
+			AudioSampleBuffer reference(numChannels, result.options.blockSize);
+
+			StageStats::Snapshot stats;
+			result.latency = roundTrip
+			(*reader, result.options, File(), *this, stats, result.frameSizeTime,
+			 [&](const AudioSampleBuffer &block, int start, int count, std::int64_t pos) {
+				referenceReader->read(&reference, 0, count, pos, true, true);
+
+				const float *processed[RoundTripOpusAudioProcessor::maxNumChannels];
+				for (int ch = 0; ch < numChannels; ++ch)
+					processed[ch] = block.getReadPointer(ch, start);
+				metrics.add(reference.getArrayOfReadPointers(), processed,
+							static_cast<std::size_t>(count));
+			});
+			if (shouldExit())
+				return jobHasFinished;
+
+			double elapsed = (Time::getMillisecondCounterHiRes() - startTime) * 0.001;
+			double audioSeconds = reader->lengthInSamples / reader->sampleRate;
+			addAudioSeconds(audioSeconds);
+
+			result.metrics = metrics.getResult();
+			result.speed = elapsed > 0.0 ? audioSeconds / elapsed : 0.0;
+			result.done = true;
+
+			{
+				const Options &options = result.options;
+				std::lock_guard<std::mutex> lock(printLock);
+				std::fprintf(stderr, "%s: %d Hz, %d bps, %g ms, %s: "
+							 "SNR %.2f dB (%.1fx realtime)\n",
+							 inputFile.getFullPathName().toRawUTF8(),
+							 options.samplingRate, options.bitRate,
+							 result.frameSizeTime,
+							 applicationNames[(int)options.application],
+							 result.metrics.snr, result.speed);
+			}
+			if (result.options.verbose)
+				printStageStats(inputFile, stats);
+
+			return jobHasFinished;
+		}
+	};
+
+	void printSweepTable(const std::vector<SweepResult> &results, bool json)
+	{
+		const int numBands = QualityMetrics::numBands;
+		auto bandName = [](int band) {
+			return String((int)QualityMetrics::bandEdges[band]) + "Hz";
+		};
+
+		if (json) {
+			std::printf("[");
+		} else {
+			std::printf("file,sampling_rate,bitrate,frame_size,application,"
+						"latency,snr,segmental_snr,log_spectral_distance");
+			for (int band = 0; band < numBands; ++band)
+				std::printf(",snr_%s", bandName(band).toRawUTF8());
+			std::printf(",speed\n");
+		}
+
+		bool first = true;
+		for (const SweepResult &result: results) {
+			if (!result.done)
+				continue;
+
+			const Options &options = result.options;
+			const QualityMetrics::Result &m = result.metrics;
+			String path = result.input.getFullPathName();
+
+			if (json) {
+				path = path.replace("\\", "\\\\").replace("\"", "\\\"");
+				std::printf("%s\n  {\"file\": \"%s\", \"sampling_rate\": %d, "
+							"\"bitrate\": %d, \"frame_size\": %g, "
+							"\"application\": \"%s\", \"latency\": %d, "
+							"\"snr\": %.3f, \"segmental_snr\": %.3f, "
+							"\"log_spectral_distance\": %.3f, \"band_snr\": {",
+							first ? "" : ",", path.toRawUTF8(),
+							options.samplingRate, options.bitRate,
+							result.frameSizeTime,
+							applicationNames[(int)options.application],
+							result.latency, m.snr, m.segmentalSnr,
+							m.logSpectralDistance);
+				for (int band = 0; band < numBands; ++band) {
+					std::printf("%s\"%s\": %.3f", band ? ", " : "",
+								bandName(band).toRawUTF8(), m.bandSnr[band]);
+				}
+				std::printf("}, \"speed\": %.2f}", result.speed);
+			} else {
+				path = "\"" + path.replace("\"", "\"\"") + "\"";
+				std::printf("%s,%d,%d,%g,%s,%d,%.3f,%.3f,%.3f",
+							path.toRawUTF8(), options.samplingRate,
+							options.bitRate, result.frameSizeTime,
+							applicationNames[(int)options.application],
+							result.latency, m.snr, m.segmentalSnr,
+							m.logSpectralDistance);
+				for (int band = 0; band < numBands; ++band)
+					std::printf(",%.3f", m.bandSnr[band]);
+				std::printf(",%.2f\n", result.speed);
+			}
+			first = false;
+		}
+
+		if (json)
+			std::printf("\n]\n");
+	}
+
+	bool parseApplication(const String &text, Application &out)
+	{
+		if (text == "audio") {
+			out = Application::Audio;
+		} else if (text == "voip") {
+			out = Application::VoiceOverIP;
+		} else if (text == "lowdelay") {
+			out = Application::LowDelay;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	bool parseResamplerQuality(const String &text, ResamplerQuality &out)
+	{
+		if (text == "low") {
+			out = ResamplerQuality::Low;
+		} else if (text == "medium") {
+			out = ResamplerQuality::Medium;
+		} else if (text == "high") {
+			out = ResamplerQuality::High;
+		} else if (text == "libsamplerate") {
+			out = ResamplerQuality::LibSampleRate;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	/** Splits "a,b,c" and parses each with parseOne(String, T &). */
+	template <class T, class F>
+	bool parseList(const String &text, std::vector<T> &out, F parseOne)
+	{
+		out.clear();
+		String rest = text;
+		while (true) {
+			String item = rest.upToFirstOccurrenceOf(",", false, false).trim();
+			T value;
+			if (item.isEmpty() || !parseOne(item, value))
+				return false;
+			out.push_back(value);
+			if (!rest.containsChar(','))
+				return true;
+			rest = rest.fromFirstOccurrenceOf(",", false, false);
+		}
+	}
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+	Options options;
+	SweepGrid grid;
+	Array<File> inputs;
+	File cacheDirectory;
+	int cacheSize = 1024; // MB
+
+	auto parseInt = [](const String &text, int &out) {
+		out = text.getIntValue();
+		return true;
+	};
+	auto parseFrameSize = [](const String &text, float &out) {
+		out = text.getFloatValue();
+		return RoundTripOpusAudioProcessor::getFrameSizeParameterValue(out) >= 0.f;
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		String arg(argv[i]);
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "-h" || arg == "--help") {
+			printUsage();
+			return 0;
+		} else if (arg == "-o" && hasValue) {
+			options.outputDirectory = File::getCurrentWorkingDirectory()
+			.getChildFile(argv[++i]);
+		} else if (arg == "-r" && hasValue) {
+			if (!parseList(argv[++i], grid.samplingRates, parseInt)) {
+				std::fprintf(stderr, "bad sampling rate: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-b" && hasValue) {
+			if (!parseList(argv[++i], grid.bitRates, parseInt)) {
+				std::fprintf(stderr, "bad bit rate: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-f" && hasValue) {
+			if (!parseList(argv[++i], grid.frameSizeTimes, parseFrameSize)) {
+				std::fprintf(stderr, "bad frame size: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-a" && hasValue) {
+			if (!parseList(argv[++i], grid.applications, parseApplication)) {
+				std::fprintf(stderr, "unknown application: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-q" && hasValue) {
+			if (!parseResamplerQuality(argv[++i], options.resamplerQuality)) {
+				std::fprintf(stderr, "unknown resampler quality: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (arg == "-L") {
+			options.lowLatency = true;
+		} else if (arg == "-x") {
+			options.dtx = true;
+		} else if (arg == "-t") {
+			options.workerThread = true;
+		} else if (arg == "-B" && hasValue) {
+			options.blockSize = String(argv[++i]).getIntValue();
+		} else if (arg == "-j" && hasValue) {
+			options.numThreads = String(argv[++i]).getIntValue();
+		} else if (arg == "-S") {
+			options.sweep = true;
+		} else if (arg == "-J") {
+			options.json = true;
+		} else if (arg == "-O") {
+			options.capture = true;
+		} else if (arg == "-P") {
+			options.replay = true;
+		} else if (arg == "-C" && hasValue) {
+			cacheDirectory = File::getCurrentWorkingDirectory().getChildFile(argv[++i]);
+		} else if (arg == "-M" && hasValue) {
+			cacheSize = String(argv[++i]).getIntValue();
+		} else if (arg == "-v") {
+			options.verbose = true;
+		} else if (arg.startsWith("-")) {
+			std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+			printUsage();
+			return 1;
+		} else {
+			inputs.add(File::getCurrentWorkingDirectory().getChildFile(arg));
+		}
+	}
+
+	if (inputs.size() == 0) {
+		printUsage();
+		return 1;
+	}
+	if (options.blockSize < 1) {
+		std::fprintf(stderr, "block size must be positive\n");
+		return 1;
+	}
+
+	// whatever wasn't given keeps the default
+	if (grid.samplingRates.empty())
+		grid.samplingRates.push_back(options.samplingRate);
+	if (grid.bitRates.empty())
+		grid.bitRates.push_back(options.bitRate);
+	if (grid.frameSizeTimes.empty())
+		grid.frameSizeTimes.push_back(options.frameSizeTime);
+	if (grid.applications.empty())
+		grid.applications.push_back(options.application);
+	if (!options.sweep && grid.getNumPoints() > 1) {
+		std::fprintf(stderr, "more than one value per option needs -S\n");
+		return 1;
+	}
+	if ((options.capture || options.replay) &&
+		(options.sweep || (options.capture && options.replay))) {
+		std::fprintf(stderr, "-O, -P and -S don't go together\n");
+		return 1;
+	}
+	if (cacheDirectory != File()) {
+		if (cacheSize < 1) {
+			std::fprintf(stderr, "cache size must be positive\n");
+			return 1;
+		}
+		options.encodeCache = EncodeCache::open(cacheDirectory,
+												(std::int64_t)cacheSize << 20);
+		if (!options.encodeCache) {
+			std::fprintf(stderr, "cannot create %s\n",
+						 cacheDirectory.getFullPathName().toRawUTF8());
+			return 1;
+		}
+	}
+	options.samplingRate = grid.samplingRates[0];
+	options.bitRate = grid.bitRates[0];
+	options.frameSizeTime = grid.frameSizeTimes[0];
+	options.application = grid.applications[0];
+
+	// one job per file, times the grid when sweeping
+	std::vector<SweepResult> sweepResults;
+	if (options.sweep) {
+		for (const File &input: inputs) {
+			for (int samplingRate: grid.samplingRates)
+			for (int bitRate: grid.bitRates)
+			for (float frameSizeTime: grid.frameSizeTimes)
+			for (Application application: grid.applications) {
+				SweepResult result;
+				result.input = input;
+				result.options = options;
+				result.options.samplingRate = samplingRate;
+				result.options.bitRate = bitRate;
+				result.options.frameSizeTime = frameSizeTime;
+				result.options.application = application;
+				sweepResults.push_back(result);
+			}
+		}
+	}
+	int numJobs = options.sweep ? (int)sweepResults.size() : inputs.size();
+
+	if (options.numThreads <= 0)
+		options.numThreads = SystemStats::getNumCpus();
+	options.numThreads = std::min(options.numThreads, numJobs);
+
+	if (!options.sweep && options.outputDirectory != File() &&
+		!options.outputDirectory.createDirectory().wasOk()) {
+		std::fprintf(stderr, "cannot create %s\n",
+					 options.outputDirectory.getFullPathName().toRawUTF8());
+		return 1;
+	}
+
+	double startTime = Time::getMillisecondCounterHiRes();
+
+	{
+		ThreadPool pool(options.numThreads);
+		std::vector<std::unique_ptr<ThreadPoolJob>> jobs;
+
+		if (options.sweep) {
+			for (SweepResult &result: sweepResults)
+				jobs.emplace_back(new SweepJob(result));
+		} else {
+			for (const File &input: inputs) {
+				File outputDirectory = options.outputDirectory != File() ?
+				options.outputDirectory : input.getParentDirectory();
+				File output = outputDirectory.getChildFile
+				(input.getFileNameWithoutExtension() + "-opus.wav");
+				File packets = output.withFileExtension(".opus");
+
+				jobs.emplace_back(new RoundTripJob(input, output, packets, options));
+			}
+		}
+		for (auto &job: jobs)
+			pool.addJob(job.get(), false);
+
+		for (auto &job: jobs)
+			pool.waitForJobToFinish(job.get(), -1);
+	}
+
+	double elapsed = (Time::getMillisecondCounterHiRes() - startTime) * 0.001;
+	double audioSeconds = totalAudioSeconds.load();
+
+	// the sweep table owns stdout
+	std::FILE *log = options.sweep ? stderr : stdout;
+	if (options.sweep)
+		printSweepTable(sweepResults, options.json);
+
+	std::fprintf(log, "\n%d job(s), %.1fs of audio in %.2fs on %d thread(s): "
+				 "%.1fx realtime\n",
+				 numJobs - numFailedFiles.load(), audioSeconds, elapsed,
+				 options.numThreads,
+				 elapsed > 0.0 ? audioSeconds / elapsed : 0.0);
+	if (options.encodeCache) {
+		std::fprintf(log, "encode cache: %llu hit(s), %llu miss(es)\n",
+					 (unsigned long long)options.encodeCache->getNumHits(),
+					 (unsigned long long)options.encodeCache->getNumMisses());
+	}
+
+#if ROUNDTRIPOPUS_REALTIME_CHECKS
+	// processBlock must not allocate or lock; a debug build counts it
+	std::uint64_t numViolations = RealtimeSafety::getNumAllocations() +
+	RealtimeSafety::getNumDeallocations() + RealtimeSafety::getNumLocks();
+	std::fprintf(log, "audio thread: %llu allocation(s), %llu deallocation(s), "
+				 "%llu lock(s)\n",
+				 (unsigned long long) RealtimeSafety::getNumAllocations(),
+				 (unsigned long long) RealtimeSafety::getNumDeallocations(),
+				 (unsigned long long) RealtimeSafety::getNumLocks());
+	if (numViolations)
+		return 2;
+#endif
+
+	return numFailedFiles.load() ? 1 : 0;
+}
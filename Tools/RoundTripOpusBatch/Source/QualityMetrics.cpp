@@ -0,0 +1,283 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#include "QualityMetrics.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define QUALITYMETRICS_SSE 1
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define QUALITYMETRICS_NEON 1
+#endif
+
+const double QualityMetrics::bandEdges[QualityMetrics::numBands] =
+{ 0., 250., 500., 1000., 2000., 4000., 8000., 16000. };
+
+namespace
+{
+	const float silenceThreshold = 1.e-6f; // -60dBFS, mean square
+	const double minSegmentalSnr = -10.;
+	const double maxSegmentalSnr = 35.;
+	const double maxDecibels = 100.; // what identical signals come out as
+
+	double toDecibels(double signal, double noise)
+	{
+		double db = 10. * std::log10((signal + 1.e-30) / (noise + 1.e-30));
+		return std::min(std::max(db, -maxDecibels), maxDecibels);
+	}
+
+	// adds up x^2 and (x - y)^2. called with at most a hop of samples, so
+	// single precision lanes are enough.
+	void sumSquares(const float *x, const float *y, std::size_t count,
+					double &signal, double &noise)
+	{
+		std::size_t i = 0;
+		float s = 0.f, e = 0.f;
+#if QUALITYMETRICS_SSE
+		__m128 accS = _mm_setzero_ps(), accE = _mm_setzero_ps();
+		for (; i + 4 <= count; i += 4) {
+			__m128 a = _mm_loadu_ps(x + i);
+			__m128 d = _mm_sub_ps(a, _mm_loadu_ps(y + i));
+			accS = _mm_add_ps(accS, _mm_mul_ps(a, a));
+			accE = _mm_add_ps(accE, _mm_mul_ps(d, d));
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, accS);
+		s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+		_mm_storeu_ps(lanes, accE);
+		e = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif QUALITYMETRICS_NEON
+		float32x4_t accS = vdupq_n_f32(0.f), accE = vdupq_n_f32(0.f);
+		for (; i + 4 <= count; i += 4) {
+			float32x4_t a = vld1q_f32(x + i);
+			float32x4_t d = vsubq_f32(a, vld1q_f32(y + i));
+			accS = vmlaq_f32(accS, a, a);
+			accE = vmlaq_f32(accE, d, d);
+		}
+		float lanes[4];
+		vst1q_f32(lanes, accS);
+		s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+		vst1q_f32(lanes, accE);
+		e = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+		for (; i < count; ++i) {
+			float d = x[i] - y[i];
+			s += x[i] * x[i];
+			e += d * d;
+		}
+		signal += s;
+		noise += e;
+	}
+}
+
+QualityMetrics::QualityMetrics(double samplingRate, int numChannels):
+numChannels(numChannels),
+numPending(0),
+signalEnergy(0.),
+noiseEnergy(0.),
+segmentalSnrSum(0.),
+numSegments(0),
+logSpectralDistanceSum(0.),
+numSpectralFrames(0)
+{
+	assert(numChannels >= 1);
+
+	// ~20ms, hopping by half of it
+	fftSize = 64;
+	while (fftSize < samplingRate * 0.02)
+		fftSize <<= 1;
+	hopSize = fftSize / 2;
+
+	referenceHistory.assign(numChannels, std::vector<float>(fftSize, 0.f));
+	processedHistory.assign(numChannels, std::vector<float>(fftSize, 0.f));
+
+	const double pi = 3.14159265358979323846;
+	window.resize(fftSize);
+	for (std::size_t i = 0; i < fftSize; ++i)
+		window[i] = static_cast<float>(0.5 - 0.5 * std::cos(2. * pi * i / fftSize));
+
+	twiddles.resize(fftSize / 2);
+	for (std::size_t i = 0; i < fftSize / 2; ++i)
+		twiddles[i] = std::polar(1.f, static_cast<float>(-2. * pi * i / fftSize));
+
+	int bits = 0;
+	while ((std::size_t(1) << bits) < fftSize)
+		++bits;
+	bitReversed.resize(fftSize);
+	for (std::size_t i = 0; i < fftSize; ++i) {
+		std::size_t r = 0;
+		for (int b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		bitReversed[i] = r;
+	}
+
+	std::size_t numBins = fftSize / 2 + 1;
+	bandOfBin.resize(numBins);
+	for (std::size_t k = 0; k < numBins; ++k) {
+		double freq = samplingRate * k / fftSize;
+		int band = 0;
+		while (band + 1 < numBands && freq >= bandEdges[band + 1])
+			++band;
+		bandOfBin[k] = band;
+	}
+
+	spectrum.resize(fftSize);
+	referencePower.resize(numBins);
+	processedPower.resize(numBins);
+	errorPower.resize(numBins);
+
+	for (int i = 0; i < numBands; ++i) {
+		bandSignalEnergy[i] = 0.;
+		bandNoiseEnergy[i] = 0.;
+	}
+}
+
+void QualityMetrics::add(const float *const *reference, const float *const *processed,
+						 std::size_t numSamples)
+{
+	std::size_t done = 0;
+	while (done < numSamples) {
+		std::size_t count = std::min(numSamples - done, hopSize - numPending);
+		for (int ch = 0; ch < numChannels; ++ch) {
+			float *ref = referenceHistory[ch].data() + fftSize - hopSize + numPending;
+			float *proc = processedHistory[ch].data() + fftSize - hopSize + numPending;
+			std::memcpy(ref, reference[ch] + done, count * sizeof(float));
+			std::memcpy(proc, processed[ch] + done, count * sizeof(float));
+		}
+		numPending += count;
+		done += count;
+		if (numPending == hopSize) {
+			analyzeHop();
+			numPending = 0;
+		}
+	}
+}
+
+void QualityMetrics::analyzeHop()
+{
+	// time domain, over the newest hop
+	double segmentSignal = 0., segmentNoise = 0.;
+	for (int ch = 0; ch < numChannels; ++ch) {
+		sumSquares(referenceHistory[ch].data() + fftSize - hopSize,
+				   processedHistory[ch].data() + fftSize - hopSize,
+				   hopSize, segmentSignal, segmentNoise);
+	}
+	signalEnergy += segmentSignal;
+	noiseEnergy += segmentNoise;
+
+	bool silent = segmentSignal < silenceThreshold * hopSize * numChannels;
+	if (!silent) {
+		double snr = toDecibels(segmentSignal, segmentNoise);
+		segmentalSnrSum += std::min(std::max(snr, minSegmentalSnr), maxSegmentalSnr);
+		++numSegments;
+	}
+
+	// frequency domain, over the whole window. both signals are real, so
+	// one goes into the real part and the other into the imaginary part
+	// and they are pulled apart after a single transform.
+	std::size_t numBins = fftSize / 2 + 1;
+	std::fill(referencePower.begin(), referencePower.end(), 0.f);
+	std::fill(processedPower.begin(), processedPower.end(), 0.f);
+	std::fill(errorPower.begin(), errorPower.end(), 0.f);
+	for (int ch = 0; ch < numChannels; ++ch) {
+		const float *ref = referenceHistory[ch].data();
+		const float *proc = processedHistory[ch].data();
+		for (std::size_t i = 0; i < fftSize; ++i)
+			spectrum[bitReversed[i]] = std::complex<float>(ref[i] * window[i], proc[i] * window[i]);
+		fft(spectrum.data());
+
+		for (std::size_t k = 0; k < numBins; ++k) {
+			std::complex<float> z = spectrum[k];
+			std::complex<float> zc = std::conj(spectrum[(fftSize - k) & (fftSize - 1)]);
+			std::complex<float> x = (z + zc) * 0.5f;
+			std::complex<float> y = (z - zc) * std::complex<float>(0.f, -0.5f);
+			referencePower[k] += std::norm(x);
+			processedPower[k] += std::norm(y);
+			errorPower[k] += std::norm(x - y);
+		}
+	}
+
+	for (std::size_t k = 0; k < numBins; ++k) {
+		bandSignalEnergy[bandOfBin[k]] += referencePower[k];
+		bandNoiseEnergy[bandOfBin[k]] += errorPower[k];
+	}
+
+	if (!silent) {
+		// the floor sits 100dB below the frame's peak bin so that empty
+		// bins on both sides don't count as matching or as differing
+		float peak = *std::max_element(referencePower.begin(), referencePower.end());
+		float floor = std::max(peak * 1.e-10f, 1.e-20f);
+		double sum = 0.;
+		for (std::size_t k = 0; k < numBins; ++k) {
+			double d = 10. * std::log10((referencePower[k] + floor) /
+										(processedPower[k] + floor));
+			sum += d * d;
+		}
+		logSpectralDistanceSum += std::sqrt(sum / numBins);
+		++numSpectralFrames;
+	}
+
+	// slide the window by a hop
+	for (int ch = 0; ch < numChannels; ++ch) {
+		std::memmove(referenceHistory[ch].data(), referenceHistory[ch].data() + hopSize,
+					 (fftSize - hopSize) * sizeof(float));
+		std::memmove(processedHistory[ch].data(), processedHistory[ch].data() + hopSize,
+					 (fftSize - hopSize) * sizeof(float));
+	}
+}
+
+// in-place radix-2, input already in bit-reversed order
+void QualityMetrics::fft(std::complex<float> *data) const
+{
+	for (std::size_t half = 1; half < fftSize; half <<= 1) {
+		std::size_t step = fftSize / (half * 2);
+		for (std::size_t start = 0; start < fftSize; start += half * 2) {
+			for (std::size_t j = 0; j < half; ++j) {
+				std::complex<float> a = data[start + j];
+				std::complex<float> b = data[start + j + half] * twiddles[j * step];
+				data[start + j] = a + b;
+				data[start + j + half] = a - b;
+			}
+		}
+	}
+}
+
+QualityMetrics::Result QualityMetrics::getResult() const
+{
+	Result result;
+	result.snr = toDecibels(signalEnergy, noiseEnergy);
+	result.segmentalSnr = numSegments ? segmentalSnrSum / numSegments : 0.;
+	result.logSpectralDistance = numSpectralFrames ?
+		logSpectralDistanceSum / numSpectralFrames : 0.;
+	for (int i = 0; i < numBands; ++i)
+		result.bandSnr[i] = toDecibels(bandSignalEnergy[i], bandNoiseEnergy[i]);
+	result.numFrames = numSegments;
+	return result;
+}
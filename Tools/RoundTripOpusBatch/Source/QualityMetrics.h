@@ -0,0 +1,111 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+#ifndef QUALITYMETRICS_H_INCLUDED
+#define QUALITYMETRICS_H_INCLUDED
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Objective measures of how far a processed signal is from its reference,
+ * accumulated block by block so that any length of audio can be measured
+ * in constant memory. Both signals must already be time-aligned.
+ *
+ * The signals are cut into frames of about 20ms (a power of two in
+ * samples). Frames where the reference is quieter than -60dBFS are left
+ * out of the per-frame measures, since the ratios don't mean much there.
+ */
+class QualityMetrics
+{
+public:
+	static const int numBands = 8;
+
+	/** Lower edges of the bands in Hz. The last one goes up to Nyquist. */
+	static const double bandEdges[numBands];
+
+	struct Result
+	{
+		/** Over the whole signal, in dB. */
+		double snr;
+
+		/** Mean of the per-frame SNRs (each limited to -10...35dB). */
+		double segmentalSnr;
+
+		/** Mean of the per-frame RMS differences of the log power
+		 *  spectra, in dB. */
+		double logSpectralDistance;
+
+		/** Reference to error energy per band, in dB. */
+		double bandSnr[numBands];
+
+		/** Frames that counted for the per-frame measures. */
+		std::size_t numFrames;
+	};
+
+	QualityMetrics(double samplingRate, int numChannels);
+
+	/** Both are arrays of numChannels planar buffers. */
+	void add(const float *const *reference, const float *const *processed,
+			 std::size_t numSamples);
+
+	Result getResult() const;
+
+private:
+	int numChannels;
+	std::size_t fftSize;
+	std::size_t hopSize;
+
+	// the last fftSize samples of each channel, reference and processed
+	std::vector<std::vector<float>> referenceHistory;
+	std::vector<std::vector<float>> processedHistory;
+	std::size_t numPending; // new samples since the last hop
+
+	std::vector<float> window;
+	std::vector<std::complex<float>> twiddles;
+	std::vector<std::size_t> bitReversed;
+	std::vector<int> bandOfBin;
+
+	// scratch, reused every hop
+	std::vector<std::complex<float>> spectrum;
+	std::vector<float> referencePower;
+	std::vector<float> processedPower;
+	std::vector<float> errorPower;
+
+	double signalEnergy;
+	double noiseEnergy;
+	double segmentalSnrSum;
+	std::size_t numSegments;
+	double logSpectralDistanceSum;
+	std::size_t numSpectralFrames;
+	double bandSignalEnergy[numBands];
+	double bandNoiseEnergy[numBands];
+
+	void analyzeHop();
+	void fft(std::complex<float> *data) const;
+};
+
+#endif  // QUALITYMETRICS_H_INCLUDED
@@ -0,0 +1,520 @@
+/*
+  ==============================================================================
+
+		RoundTripOpus
+
+		Copyright 2015 yvt
+
+	 This file is part of RoundTripOpus.
+
+	 RoundTripOpus is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 RoundTripOpus is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with RoundTripOpus.  If not, see <http://www.gnu.org/licenses/>.
+  ==============================================================================
+*/
+
+
+// RoundTripOpusBench: times RoundTripOpusAudioProcessor::processBlock on a
+// synthetic signal over a range of settings, together with the stages it
+// is made of (SRC, Opus, FIFO copies) run on their own, so that the split
+// between them can be followed from version to version.
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "../../../Source/PluginProcessor.h"
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+namespace
+{
+	struct Case
+	{
+		int hostRate;
+		int blockSize;
+		int opusRate;
+		float frameSizeTime; // ms
+		int bitRate;
+		int complexity;
+	};
+
+	/** Values to try. The first of each is the baseline. */
+	struct Options
+	{
+		std::vector<int> hostRates {44100, 48000, 96000};
+		std::vector<int> blockSizes {256, 32, 64, 128, 512, 1024, 2048, 4096};
+		std::vector<int> opusRates {48000, 8000, 12000, 16000, 24000};
+		std::vector<float> frameSizeTimes {20.f, 2.5f, 5.f, 10.f, 40.f, 60.f};
+		std::vector<int> bitRates {64000, 16000, 32000, 128000, 256000};
+		std::vector<int> complexities {5, 0, 2, 8, 10};
+
+		/** Every combination instead of one value off the baseline at a
+		 *  time. */
+		bool cross = false;
+		bool csv = false;
+		double seconds = 5.0; // per case
+		int numChannels = 2;
+		ResamplerQuality resamplerQuality = ResamplerQuality::Medium;
+	};
+
+	/** All in ns per host sample frame (all channels). */
+	struct Result
+	{
+		double total; // processBlock
+		double src;   // both SRC stages
+		double opus;  // encode + decode
+		double fifo;  // in and out of the interleaved FIFOs
+	};
+
+	const int opusRates[] = {8000, 12000, 16000, 24000, 48000};
+
+	bool isOpusRate(int rate)
+	{
+		for (int r: opusRates) {
+			if (r == rate)
+				return true;
+		}
+		return false;
+	}
+
+	double getSeconds(std::int64_t ticks)
+	{
+		return Time::highResolutionTicksToSeconds(ticks);
+	}
+
+	// a few partials wandering in pitch plus some noise, so that neither
+	// the codec nor the SRC gets an easy signal. the same every run.
+	void makeSignal(AudioSampleBuffer &buffer, double rate)
+	{
+		Random random(1);
+		const double pi = 3.14159265358979323846;
+		for (int ch = 0; ch < buffer.getNumChannels(); ++ch) {
+			float *out = buffer.getWritePointer(ch);
+			double phase[4] = {0.0, 0.0, 0.0, 0.0};
+			for (int i = 0; i < buffer.getNumSamples(); ++i) {
+				double t = i / rate;
+				double sample = 0.0;
+				for (int k = 0; k < 4; ++k) {
+					double freq = (110.0 + 55.0 * ch) * (k * 2 + 1) *
+					(1.0 + 0.05 * std::sin(2.0 * pi * 0.5 * t));
+					phase[k] += 2.0 * pi * freq / rate;
+					sample += std::sin(phase[k]) * 0.2 / (k + 1);
+				}
+				sample += (random.nextFloat() - 0.5f) * 0.05f;
+				out[i] = static_cast<float>(sample);
+			}
+		}
+	}
+
+	void interleave(const AudioSampleBuffer &buffer, std::vector<float> &out)
+	{
+		int numChannels = buffer.getNumChannels();
+		out.resize(buffer.getNumSamples() * numChannels);
+		for (int ch = 0; ch < numChannels; ++ch) {
+			const float *in = buffer.getReadPointer(ch);
+			for (int i = 0; i < buffer.getNumSamples(); ++i)
+				out[i * numChannels + ch] = in[i];
+		}
+	}
+
+	double timeProcessor(const Case &c, const Options &options,
+						 const AudioSampleBuffer &signal)
+	{
+		using Parameter = RoundTripOpusAudioProcessor::Parameter;
+
+		int numChannels = options.numChannels;
+		RoundTripOpusAudioProcessor processor;
+		processor.setPlayConfigDetails(numChannels, numChannels,
+									   c.hostRate, c.blockSize);
+		processor.setParameterValue(Parameter::SamplingRate, c.opusRate / 48000.f);
+		processor.setParameterValue(Parameter::Bitrate, c.bitRate / 512000.f);
+		processor.setParameterValue(Parameter::FrameSize,
+									RoundTripOpusAudioProcessor::getFrameSizeParameterValue
+									(c.frameSizeTime));
+		processor.setParameterValue(Parameter::Complexity, c.complexity / 10.f);
+		processor.setParameterValue(Parameter::ResamplerQuality,
+									(float)options.resamplerQuality / 3.f);
+		processor.prepareToPlay(c.hostRate, c.blockSize);
+
+		AudioSampleBuffer block(numChannels, c.blockSize);
+		MidiBuffer midi;
+
+		// the first half second only gets things going
+		int warmUp = c.hostRate / 2;
+		int length = signal.getNumSamples();
+		std::int64_t ticks = 0;
+		std::int64_t measured = 0;
+		for (int pos = 0; pos + c.blockSize <= length; pos += c.blockSize) {
+			for (int ch = 0; ch < numChannels; ++ch)
+				block.copyFrom(ch, 0, signal, ch, pos, c.blockSize);
+
+			std::int64_t start = Time::getHighResolutionTicks();
+			processor.processBlock(block, midi);
+			if (pos >= warmUp) {
+				ticks += Time::getHighResolutionTicks() - start;
+				measured += c.blockSize;
+			}
+		}
+
+		processor.releaseResources();
+		return measured > 0 ? getSeconds(ticks) * 1.e9 / measured : 0.0;
+	}
+
+	// the input and output copies of processSlice: planar host buffers
+	// into an interleaved FIFO and back
+	double timeFifo(const Case &c, const Options &options,
+					const AudioSampleBuffer &signal)
+	{
+		using AudioFifo = Fifo<float, RoundTripOpusAudioProcessor::maxNumChannels,
+		FifoLayout::Interleaved>;
+
+		int numChannels = options.numChannels;
+		AudioFifo fifo(std::max(4096, c.blockSize), numChannels);
+		AudioSampleBuffer block(numChannels, c.blockSize);
+
+		AudioFifo::ConstBufferSet input;
+		AudioFifo::BufferSet output;
+		input.fill(nullptr);
+		output.fill(nullptr);
+
+		int length = signal.getNumSamples();
+		std::int64_t start = Time::getHighResolutionTicks();
+		for (int pos = 0; pos + c.blockSize <= length; pos += c.blockSize) {
+			for (int ch = 0; ch < numChannels; ++ch) {
+				input[ch] = signal.getReadPointer(ch, pos);
+				output[ch] = block.getWritePointer(ch);
+			}
+			fifo.enqueue(input, c.blockSize);
+			fifo.dequeue(output, c.blockSize);
+		}
+		std::int64_t ticks = Time::getHighResolutionTicks() - start;
+		return getSeconds(ticks) * 1.e9 / (length / c.blockSize * c.blockSize);
+	}
+
+	// host rate -> Opus rate -> host rate, a host block at a time. nothing
+	// to do when the codec can run at the host rate.
+	double timeSrc(const Case &c, const Options &options,
+				   const std::vector<float> &signal)
+	{
+		if (isOpusRate(c.hostRate))
+			return 0.0;
+
+		int numChannels = options.numChannels;
+		std::unique_ptr<Resampler> in = Resampler::create
+		(c.hostRate, c.opusRate, numChannels, options.resamplerQuality);
+		std::unique_ptr<Resampler> out = Resampler::create
+		(c.opusRate, c.hostRate, numChannels, options.resamplerQuality);
+
+		std::size_t blockFrames = c.blockSize;
+		std::vector<float> middle((blockFrames * 48000 / 8000 + 64) * numChannels);
+		std::vector<float> output((blockFrames * 2 + 64) * numChannels);
+
+		std::size_t length = signal.size() / numChannels;
+		std::int64_t start = Time::getHighResolutionTicks();
+		for (std::size_t pos = 0; pos + blockFrames <= length; pos += blockFrames) {
+			std::size_t used;
+			std::size_t converted = in->process
+			(signal.data() + pos * numChannels, blockFrames,
+			 middle.data(), middle.size() / numChannels, used);
+			out->process(middle.data(), converted,
+						 output.data(), output.size() / numChannels, used);
+		}
+		std::int64_t ticks = Time::getHighResolutionTicks() - start;
+		return getSeconds(ticks) * 1.e9 / (length / blockFrames * blockFrames);
+	}
+
+	// what the processor's codec does, at the rate it would run at
+	double timeOpus(const Case &c, const Options &options,
+					const std::vector<float> &signal, int codecRate)
+	{
+		int numChannels = options.numChannels;
+		OpusCodec codec;
+		if (!codec.create(codecRate, numChannels, OPUS_APPLICATION_AUDIO))
+			return 0.0;
+
+		int bandwidth = c.opusRate <= 8000 ? OPUS_BANDWIDTH_NARROWBAND :
+		c.opusRate <= 12000 ? OPUS_BANDWIDTH_MEDIUMBAND :
+		c.opusRate <= 16000 ? OPUS_BANDWIDTH_WIDEBAND :
+		c.opusRate <= 24000 ? OPUS_BANDWIDTH_SUPERWIDEBAND :
+		OPUS_BANDWIDTH_FULLBAND;
+		codec.encoderCtl(OPUS_SET_BITRATE(c.bitRate));
+		codec.encoderCtl(OPUS_SET_COMPLEXITY(c.complexity));
+		codec.encoderCtl(OPUS_SET_MAX_BANDWIDTH(bandwidth));
+
+		int frameSize = static_cast<int>(c.frameSizeTime * codecRate / 1000.f);
+		std::vector<unsigned char> packet(1275 * 3 * numChannels);
+		std::vector<float> decoded(frameSize * numChannels);
+
+		std::size_t length = signal.size() / numChannels;
+		std::size_t numFrames = 0;
+		std::int64_t start = Time::getHighResolutionTicks();
+		for (std::size_t pos = 0; pos + frameSize <= length; pos += frameSize) {
+			int len = codec.encode(signal.data() + pos * numChannels, frameSize,
+								   packet.data(), static_cast<int>(packet.size()));
+			codec.decode(packet.data(), std::max(len, 0), decoded.data(), frameSize);
+			++numFrames;
+		}
+		std::int64_t ticks = Time::getHighResolutionTicks() - start;
+
+		double hostSamples = numFrames * frameSize * (double)c.hostRate / codecRate;
+		return hostSamples > 0.0 ? getSeconds(ticks) * 1.e9 / hostSamples : 0.0;
+	}
+
+	Result run(const Case &c, const Options &options)
+	{
+		int numChannels = options.numChannels;
+		int codecRate = isOpusRate(c.hostRate) ? c.hostRate : c.opusRate;
+
+		int hostLength = static_cast<int>(c.hostRate * options.seconds);
+		int codecLength = static_cast<int>(codecRate * options.seconds);
+
+		// half a second more for the processor to warm up with
+		AudioSampleBuffer hostSignal(numChannels, hostLength + c.hostRate / 2);
+		makeSignal(hostSignal, c.hostRate);
+		AudioSampleBuffer codecSignal(numChannels, codecLength);
+		makeSignal(codecSignal, codecRate);
+
+		std::vector<float> hostInterleaved, codecInterleaved;
+		interleave(hostSignal, hostInterleaved);
+		interleave(codecSignal, codecInterleaved);
+
+		Result result;
+		result.total = timeProcessor(c, options, hostSignal);
+		result.src = timeSrc(c, options, hostInterleaved);
+		result.opus = timeOpus(c, options, codecInterleaved, codecRate);
+		result.fifo = timeFifo(c, options, hostSignal);
+		return result;
+	}
+
+	void printHeader(bool csv)
+	{
+		if (csv) {
+			std::printf("host_rate,block_size,opus_rate,frame_size,bitrate,"
+						"complexity,ns_per_sample,realtime,src_ns,opus_ns,"
+						"fifo_ns,other_ns\n");
+		} else {
+			std::printf("  host block  opus  frame  bitrate cx |  ns/smp  realtime |"
+						"     src    opus    fifo   other\n");
+		}
+	}
+
+	void printResult(const Case &c, const Result &r, bool csv)
+	{
+		double realtime = r.total > 0.0 ? 1.e9 / (r.total * c.hostRate) : 0.0;
+		double other = r.total - r.src - r.opus - r.fifo;
+		if (csv) {
+			std::printf("%d,%d,%d,%g,%d,%d,%.2f,%.1f,%.2f,%.2f,%.2f,%.2f\n",
+						c.hostRate, c.blockSize, c.opusRate, c.frameSizeTime,
+						c.bitRate, c.complexity, r.total, realtime,
+						r.src, r.opus, r.fifo, other);
+		} else {
+			// the stages as shares of processBlock
+			auto share = [&](double ns) {
+				return r.total > 0.0 ? ns * 100.0 / r.total : 0.0;
+			};
+			std::printf("%6d %5d %5d %6g %8d %2d | %7.1f %8.1fx |"
+						" %6.1f%% %6.1f%% %6.1f%% %6.1f%%\n",
+						c.hostRate, c.blockSize, c.opusRate, c.frameSizeTime,
+						c.bitRate, c.complexity, r.total, realtime,
+						share(r.src), share(r.opus), share(r.fifo), share(other));
+		}
+		std::fflush(stdout);
+	}
+
+	std::vector<Case> makeCases(const Options &options)
+	{
+		std::vector<Case> cases;
+		Case baseline = {options.hostRates[0], options.blockSizes[0],
+			options.opusRates[0], options.frameSizeTimes[0],
+			options.bitRates[0], options.complexities[0]};
+
+		if (options.cross) {
+			for (int hostRate: options.hostRates)
+			for (int blockSize: options.blockSizes)
+			for (int opusRate: options.opusRates)
+			for (float frameSizeTime: options.frameSizeTimes)
+			for (int bitRate: options.bitRates)
+			for (int complexity: options.complexities) {
+				Case c = {hostRate, blockSize, opusRate, frameSizeTime,
+					bitRate, complexity};
+				cases.push_back(c);
+			}
+			return cases;
+		}
+
+		// the baseline, then each value off it one setting at a time
+		cases.push_back(baseline);
+		for (std::size_t i = 1; i < options.hostRates.size(); ++i) {
+			cases.push_back(baseline);
+			cases.back().hostRate = options.hostRates[i];
+		}
+		for (std::size_t i = 1; i < options.blockSizes.size(); ++i) {
+			cases.push_back(baseline);
+			cases.back().blockSize = options.blockSizes[i];
+		}
+		for (std::size_t i = 1; i < options.opusRates.size(); ++i) {
+			cases.push_back(baseline);
+			cases.back().opusRate = options.opusRates[i];
+		}
+		for (std::size_t i = 1; i < options.frameSizeTimes.size(); ++i) {
+			cases.push_back(baseline);
+			cases.back().frameSizeTime = options.frameSizeTimes[i];
+		}
+		for (std::size_t i = 1; i < options.bitRates.size(); ++i) {
+			cases.push_back(baseline);
+			cases.back().bitRate = options.bitRates[i];
+		}
+		for (std::size_t i = 1; i < options.complexities.size(); ++i) {
+			cases.push_back(baseline);
+			cases.back().complexity = options.complexities[i];
+		}
+		return cases;
+	}
+
+	void printUsage()
+	{
+		std::printf
+		("usage: RoundTripOpusBench [OPTIONS]\n"
+		 "\n"
+		 "Times processBlock on a synthetic signal, along with the SRC, Opus\n"
+		 "and FIFO stages on their own, and prints ns per sample frame, how\n"
+		 "many times faster than realtime that is, and the share of each\n"
+		 "stage. Each option takes a comma separated list whose first value\n"
+		 "is the baseline; every other value is tried with the rest at the\n"
+		 "baseline.\n"
+		 "\n"
+		 "  -R RATES   host sampling rates (default: 44100,48000,96000)\n"
+		 "  -B SIZES   host block sizes (default: 256,32,64,...,4096)\n"
+		 "  -r RATES   Opus sampling rates (default: 48000,8000,...,24000)\n"
+		 "  -f MS      frame sizes (default: 20,2.5,5,10,40,60)\n"
+		 "  -b BPS     bit rates (default: 64000,16000,32000,128000,256000)\n"
+		 "  -C N       complexities (default: 5,0,2,8,10)\n"
+		 "  -x         try every combination instead\n"
+		 "  -s SECONDS length of the signal per case (default: 5)\n"
+		 "  -n N       number of channels (default: 2)\n"
+		 "  -q QUALITY resampler [low, medium, high, libsamplerate]\n"
+		 "             (default: medium)\n"
+		 "  -c         print CSV (stage times in ns instead of shares)\n");
+	}
+
+	/** Splits "a,b,c" and parses each with parseOne(String, T &). */
+	template <class T, class F>
+	bool parseList(const String &text, std::vector<T> &out, F parseOne)
+	{
+		out.clear();
+		String rest = text;
+		while (true) {
+			String item = rest.upToFirstOccurrenceOf(",", false, false).trim();
+			T value;
+			if (item.isEmpty() || !parseOne(item, value))
+				return false;
+			out.push_back(value);
+			if (!rest.containsChar(','))
+				return true;
+			rest = rest.fromFirstOccurrenceOf(",", false, false);
+		}
+	}
+
+	bool parseResamplerQuality(const String &text, ResamplerQuality &out)
+	{
+		if (text == "low") {
+			out = ResamplerQuality::Low;
+		} else if (text == "medium") {
+			out = ResamplerQuality::Medium;
+		} else if (text == "high") {
+			out = ResamplerQuality::High;
+		} else if (text == "libsamplerate") {
+			out = ResamplerQuality::LibSampleRate;
+		} else {
+			return false;
+		}
+		return true;
+	}
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+	Options options;
+
+	auto parseInt = [](const String &text, int &out) {
+		out = text.getIntValue();
+		return out > 0 || text.trim() == "0";
+	};
+	auto parseFloat = [](const String &text, float &out) {
+		out = text.getFloatValue();
+		return out > 0.f;
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		String arg(argv[i]);
+		bool hasValue = i + 1 < argc;
+		bool ok = true;
+
+		if (arg == "-h" || arg == "--help") {
+			printUsage();
+			return 0;
+		} else if (arg == "-R" && hasValue) {
+			ok = parseList(argv[++i], options.hostRates, parseInt);
+		} else if (arg == "-B" && hasValue) {
+			ok = parseList(argv[++i], options.blockSizes, parseInt);
+		} else if (arg == "-r" && hasValue) {
+			ok = parseList(argv[++i], options.opusRates, parseInt);
+			for (int rate: options.opusRates)
+				ok = ok && isOpusRate(rate);
+		} else if (arg == "-f" && hasValue) {
+			ok = parseList(argv[++i], options.frameSizeTimes, parseFloat);
+			// timeOpus has to run the same frames as the processor
+			for (float frameSizeTime: options.frameSizeTimes) {
+				ok = ok && RoundTripOpusAudioProcessor::getFrameSizeParameterValue
+				(frameSizeTime) >= 0.f;
+			}
+		} else if (arg == "-b" && hasValue) {
+			ok = parseList(argv[++i], options.bitRates, parseInt);
+		} else if (arg == "-C" && hasValue) {
+			ok = parseList(argv[++i], options.complexities, parseInt);
+		} else if (arg == "-x") {
+			options.cross = true;
+		} else if (arg == "-s" && hasValue) {
+			options.seconds = String(argv[++i]).getDoubleValue();
+			ok = options.seconds > 0.0;
+		} else if (arg == "-n" && hasValue) {
+			options.numChannels = String(argv[++i]).getIntValue();
+			ok = options.numChannels >= 1 &&
+			options.numChannels <= RoundTripOpusAudioProcessor::maxNumChannels;
+		} else if (arg == "-q" && hasValue) {
+			ok = parseResamplerQuality(argv[++i], options.resamplerQuality);
+		} else if (arg == "-c") {
+			options.csv = true;
+		} else {
+			std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+			printUsage();
+			return 1;
+		}
+
+		if (!ok) {
+			std::fprintf(stderr, "bad value for %s: %s\n", argv[i - 1], argv[i]);
+			return 1;
+		}
+	}
+
+	std::vector<Case> cases = makeCases(options);
+	printHeader(options.csv);
+
+	double startTime = Time::getMillisecondCounterHiRes();
+	for (const Case &c: cases)
+		printResult(c, run(c, options), options.csv);
+	double elapsed = (Time::getMillisecondCounterHiRes() - startTime) * 0.001;
+
+	std::fprintf(stderr, "%d case(s) in %.1fs\n", (int)cases.size(), elapsed);
+	return 0;
+}